@@ -33,6 +33,25 @@ void addBenchmarkingPermutations(std::vector<Settings>& settingsList)
     }
 }
 
+/* @brief Add a run per acceleration structure, to compare them on the same scenes. Each run logs its build time (`buildAccelStructure`)
+   and trace time (`RENDER_ALL`) per frame. Scenes that set "accel_structure" keep it */
+void addAccelStructurePermutations(std::vector<Settings>& settingsList)
+{
+    const Settings base = settingsList.back();
+    for (AccelStructType type : { AccelStructType::KDTREE, AccelStructType::BVH, AccelStructType::GRID }) {
+        if (type == base.accelStructure) {
+            continue;
+        }
+        settingsList.push_back(settingsList.back());
+        settingsList.back().settingsId += 1;
+        settingsList.back().accelStructure = type;
+    }
+    // A cache hit would time the cache read instead of the build
+    for (Settings& settings : settingsList) {
+        settings.useSceneCache = false;
+    }
+}
+
 void writeDiffs(std::vector<Vec2<size_t>> diff)
 {
 
@@ -78,6 +97,7 @@ int launch()
 #endif
 
     // addBenchmarkingPermutations(settingsList); // uncomment for benchmarking
+    // addAccelStructurePermutations(settingsList); // uncomment to compare acceleration structures
 
     for (Settings& settings : settingsList) {
         std::cout << "Running iteration " << settings.iterationName() << std::endl;
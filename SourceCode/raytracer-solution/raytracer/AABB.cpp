@@ -2,6 +2,7 @@
 
 #include <iostream>
 #include <algorithm>
+#include <array>
 #include <string>
 #include <sstream>
 
@@ -74,6 +75,38 @@ bool AABB::hasIntersection(const Ray& r) const {
     return true;
 }
 
+bool AABB::hasIntersection(const Ray& r, float maxT, float& tEntry, float& tExit) const {
+    if (!hasIntersection(r, maxT, tEntry)) {
+        return false;
+    }
+
+    tExit = std::min({ (bounds[1 - r.sign[0]].x - r.origin.x) * r.invdir.x,
+        (bounds[1 - r.sign[1]].y - r.origin.y) * r.invdir.y,
+        (bounds[1 - r.sign[2]].z - r.origin.z) * r.invdir.z,
+        maxT });
+    tEntry = std::max(tEntry, 0.f);
+    return true;
+}
+
+bool AABB::hasIntersection(const Ray& r, float maxT, float& tEntry) const {
+    float tmin = (bounds[r.sign[0]].x - r.origin.x) * r.invdir.x;
+    float tmax = (bounds[1 - r.sign[0]].x - r.origin.x) * r.invdir.x;
+    float tymin = (bounds[r.sign[1]].y - r.origin.y) * r.invdir.y;
+    float tymax = (bounds[1 - r.sign[1]].y - r.origin.y) * r.invdir.y;
+    float tzmin = (bounds[r.sign[2]].z - r.origin.z) * r.invdir.z;
+    float tzmax = (bounds[1 - r.sign[2]].z - r.origin.z) * r.invdir.z;
+
+    tmin = std::max({ tmin, tymin, tzmin });
+    tmax = std::min({ tmax, tymax, tzmax });
+
+    if (tmin > tmax || tmax < 0.f || tmin > maxT) {
+        return false;
+    }
+
+    tEntry = tmin;
+    return true;
+}
+
 void AABB::intersect(const Ray& r, TraceHit& out) const
 {
 #ifndef NDEBUG
@@ -161,6 +194,70 @@ void AABB::expand(const Vec3& point)
     bounds[1].z = std::max(bounds[1].z, point.z);
 }
 
+void AABB::expand(const AABB& other)
+{
+    expand(other.bounds[0]);
+    expand(other.bounds[1]);
+}
+
+bool AABB::intersectWith(const AABB& other)
+{
+    bounds[0].x = std::max(bounds[0].x, other.bounds[0].x);
+    bounds[0].y = std::max(bounds[0].y, other.bounds[0].y);
+    bounds[0].z = std::max(bounds[0].z, other.bounds[0].z);
+
+    bounds[1].x = std::min(bounds[1].x, other.bounds[1].x);
+    bounds[1].y = std::min(bounds[1].y, other.bounds[1].y);
+    bounds[1].z = std::min(bounds[1].z, other.bounds[1].z);
+
+    return bounds[0].x <= bounds[1].x && bounds[0].y <= bounds[1].y && bounds[0].z <= bounds[1].z;
+}
+
+bool AABB::clipTriangle(const Vec3& v0, const Vec3& v1, const Vec3& v2, AABB& out) const
+{
+    // Sutherland-Hodgman. Every plane adds at most one vertex to a convex polygon
+    std::array<Vec3, 9> polygon{ v0, v1, v2 };
+    std::array<Vec3, 9> clipped{};
+    size_t count = 3;
+
+    for (int axis = 0; axis < 3; ++axis) {
+        for (int side = 0; side < 2; ++side) {
+            const float plane = bounds[side].axis(axis);
+            auto inside = [&](const Vec3& p) {
+                return side == 0 ? p.axis(axis) >= plane : p.axis(axis) <= plane;
+            };
+
+            size_t clippedCount = 0;
+            for (size_t i = 0; i < count; ++i) {
+                const Vec3& current = polygon[i];
+                const Vec3& next = polygon[(i + 1) % count];
+                bool currentInside = inside(current);
+                if (currentInside) {
+                    clipped[clippedCount++] = current;
+                }
+                if (currentInside != inside(next)) {
+                    float t = (plane - current.axis(axis)) / (next.axis(axis) - current.axis(axis));
+                    Vec3 intersection = current + (next - current) * t;
+                    intersection.axis(axis) = plane; // exact, avoids drifting out of the box
+                    clipped[clippedCount++] = intersection;
+                }
+            }
+
+            polygon = clipped;
+            count = clippedCount;
+            if (count == 0) {
+                return false;
+            }
+        }
+    }
+
+    out = AABB::MakeEmpty();
+    for (size_t i = 0; i < count; ++i) {
+        out.expand(polygon[i]);
+    }
+    return true;
+}
+
 inline std::string AABB::toString() const {
     std::stringstream ss;
     ss << "bounds[0]: (" << bounds[0].x << ", " << bounds[0].y << ", " << bounds[0].z << ")\n";
@@ -175,3 +272,11 @@ float AABB::volume() const {
 
     return width * height * depth;
 }
+
+float AABB::surfaceArea() const {
+    float width = bounds[1].x - bounds[0].x;
+    float height = bounds[1].y - bounds[0].y;
+    float depth = bounds[1].z - bounds[0].z;
+
+    return 2.f * (width * height + height * depth + depth * width);
+}
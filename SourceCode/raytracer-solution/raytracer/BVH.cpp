@@ -0,0 +1,1442 @@
+#include "include/BVH.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <immintrin.h>
+#define BVH_SSE
+#endif
+
+#include "json.hpp"
+
+#include "include/TraceHit.h"
+#include "include/CRTTypes.h"
+#include "include/Scene.h"
+#include "include/Settings.h"
+#include "include/ThreadPool.h"
+#include "include/SceneCache.h"
+#include "include/NodeLayout.h"
+#include "include/Utils.h"
+#include "include/Mailbox.h"
+
+/* Slab test of a ray against all children of a wide node.
+*  @return bit i is set if the ray enters child i before `maxT`. `tEntries[i]` is only meaningful for set bits */
+template <size_t Width>
+static uint32_t intersectChildren(const WideBVHNode<Width>& node, const Ray& ray, float maxT, float* tEntries)
+{
+	uint32_t hitMask = 0;
+	for (size_t slot = 0; slot < Width; ++slot) {
+		float tNear = 0.f;
+		float tFar = maxT;
+		for (int axis = 0; axis < 3; ++axis) {
+			float origin = ray.origin.axis(axis);
+			float invdir = ray.invdir.axis(axis);
+			tNear = std::max(tNear, (node.bounds[ray.sign[axis]][axis][slot] - origin) * invdir);
+			tFar = std::min(tFar, (node.bounds[1 - ray.sign[axis]][axis][slot] - origin) * invdir);
+		}
+		tEntries[slot] = tNear;
+		hitMask |= uint32_t(tNear <= tFar) << slot;
+	}
+	return hitMask;
+}
+
+#ifdef BVH_SSE
+static uint32_t intersectChildren(const WideBVHNode<4>& node, const Ray& ray, float maxT, float* tEntries)
+{
+	__m128 tNear = _mm_setzero_ps();
+	__m128 tFar = _mm_set1_ps(maxT);
+	for (int axis = 0; axis < 3; ++axis) {
+		const __m128 origin = _mm_set1_ps(ray.origin.axis(axis));
+		const __m128 invdir = _mm_set1_ps(ray.invdir.axis(axis));
+		const __m128 nearPlanes = _mm_load_ps(node.bounds[ray.sign[axis]][axis]);
+		const __m128 farPlanes = _mm_load_ps(node.bounds[1 - ray.sign[axis]][axis]);
+		tNear = _mm_max_ps(tNear, _mm_mul_ps(_mm_sub_ps(nearPlanes, origin), invdir));
+		tFar = _mm_min_ps(tFar, _mm_mul_ps(_mm_sub_ps(farPlanes, origin), invdir));
+	}
+	_mm_storeu_ps(tEntries, tNear);
+	return uint32_t(_mm_movemask_ps(_mm_cmple_ps(tNear, tFar)));
+}
+#endif
+
+#ifdef __AVX__
+static uint32_t intersectChildren(const WideBVHNode<8>& node, const Ray& ray, float maxT, float* tEntries)
+{
+	__m256 tNear = _mm256_setzero_ps();
+	__m256 tFar = _mm256_set1_ps(maxT);
+	for (int axis = 0; axis < 3; ++axis) {
+		const __m256 origin = _mm256_set1_ps(ray.origin.axis(axis));
+		const __m256 invdir = _mm256_set1_ps(ray.invdir.axis(axis));
+		const __m256 nearPlanes = _mm256_load_ps(node.bounds[ray.sign[axis]][axis]);
+		const __m256 farPlanes = _mm256_load_ps(node.bounds[1 - ray.sign[axis]][axis]);
+		tNear = _mm256_max_ps(tNear, _mm256_mul_ps(_mm256_sub_ps(nearPlanes, origin), invdir));
+		tFar = _mm256_min_ps(tFar, _mm256_mul_ps(_mm256_sub_ps(farPlanes, origin), invdir));
+	}
+	_mm256_storeu_ps(tEntries, tNear);
+	return uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ)));
+}
+#endif
+
+/* @brief Stable LSD radix sort of `values` by `keys`, 8 bits per pass. Chunks of `chunkSize` count and scatter their digits in parallel */
+static void radixSortByKey(std::vector<uint32_t>& keys, std::vector<uint32_t>& values, size_t chunkSize, ThreadPool& pool)
+{
+	constexpr size_t radix = 256;
+	const size_t count = keys.size();
+	const size_t numChunks = (count + chunkSize - 1) / chunkSize;
+	std::vector<uint32_t> sortedKeys(count);
+	std::vector<uint32_t> sortedValues(count);
+	// chunkOffsets[chunk * radix + digit]: digit count of the chunk, then where the chunk writes that digit
+	std::vector<size_t> chunkOffsets(numChunks * radix);
+
+	for (uint32_t shift = 0; shift < 32; shift += 8) {
+		pool.parallelFor(count, chunkSize, [&](size_t chunkBegin, size_t chunkEnd) {
+			size_t* histogram = chunkOffsets.data() + (chunkBegin / chunkSize) * radix;
+			std::fill(histogram, histogram + radix, size_t(0));
+			for (size_t i = chunkBegin; i < chunkEnd; ++i) {
+				++histogram[(keys[i] >> shift) & (radix - 1)];
+			}
+		});
+
+		// Digit-major prefix sum, so equal digits keep the chunk order and the sort stays stable
+		bool singleDigit = false;
+		size_t offset = 0;
+		for (size_t digit = 0; digit < radix; ++digit) {
+			const size_t digitBegin = offset;
+			for (size_t chunk = 0; chunk < numChunks; ++chunk) {
+				size_t& slot = chunkOffsets[chunk * radix + digit];
+				const size_t digitCount = slot;
+				slot = offset;
+				offset += digitCount;
+			}
+			singleDigit |= offset - digitBegin == count;
+		}
+		if (singleDigit) {
+			continue; // e.g. the top bits of 30-bit Morton codes. The order would not change
+		}
+
+		pool.parallelFor(count, chunkSize, [&](size_t chunkBegin, size_t chunkEnd) {
+			size_t* offsets = chunkOffsets.data() + (chunkBegin / chunkSize) * radix;
+			for (size_t i = chunkBegin; i < chunkEnd; ++i) {
+				const size_t dst = offsets[(keys[i] >> shift) & (radix - 1)]++;
+				sortedKeys[dst] = keys[i];
+				sortedValues[dst] = values[i];
+			}
+		});
+		keys.swap(sortedKeys);
+		values.swap(sortedValues);
+	}
+}
+
+void BVH::build(std::vector<uint32_t>&& newTriangleRefs, const std::vector<AABB>& cacheTriangleAABBs,
+	const std::vector<Triangle>& triangles, const std::vector<Vec3>& vertices, const Settings& settings,
+	BVHBuilder builder, ThreadPool& pool)
+{
+	nodes.clear();
+	nodes4.clear();
+	nodes8.clear();
+	quantizedNodes.clear();
+	width = settings.bvhWidth;
+	spatialSplits = false;
+	triangleRefs = std::move(newTriangleRefs);
+	if (triangleRefs.empty()) {
+		return;
+	}
+
+	// A binary tree with N leaves has 2N - 1 nodes
+	nodes.reserve(2 * (triangleRefs.size() / std::max<size_t>(settings.maxTrianglesPerLeaf, 1)) + 1);
+	nodes.emplace_back();
+	if (builder == BVHBuilder::LBVH) {
+		buildLinear(cacheTriangleAABBs, settings, pool);
+	}
+	else if (builder == BVHBuilder::SBVH) {
+		spatialSplits = true;
+		buildSpatial(cacheTriangleAABBs, triangles, vertices, settings);
+	}
+	else {
+		buildRecursive(nodes, 0, 0, uint32_t(triangleRefs.size()), cacheTriangleAABBs, settings, 0, pool);
+	}
+	if (settings.trianglePackWidth > 1) {
+		alignLeaves(settings.trianglePackWidth);
+	}
+
+	if (width == 4) {
+		buildWide(nodes4);
+	}
+	else if (width == 8) {
+		buildWide(nodes8);
+	}
+	else if (settings.quantizeBVHNodes) {
+		buildQuantized();
+	}
+	builtSahCost = sahCost(settings);
+}
+
+size_t BVH::getTraversalNodeBytes() const
+{
+	if (width == 4) {
+		return nodes4.size() * sizeof(WideBVHNode<4>);
+	}
+	if (width == 8) {
+		return nodes8.size() * sizeof(WideBVHNode<8>);
+	}
+	if (!quantizedNodes.empty()) {
+		return quantizedNodes.size() * sizeof(QuantizedBVHNode);
+	}
+	return getBinaryNodeBytes();
+}
+
+void BVH::buildQuantized()
+{
+	quantizedNodes.assign(nodes.size(), QuantizedBVHNode{});
+
+	struct StackEntry {
+		uint32_t nodeIdx;
+		/* Bounds the traversal will decode for this node. Encloses `nodes[nodeIdx].aabb` */
+		AABB decoded;
+	};
+	std::array<StackEntry, maxDepth + 1> stack;
+	size_t stackSize = 0;
+	stack[stackSize++] = { 0, nodes[0].aabb };
+
+	while (stackSize > 0) {
+		const StackEntry entry = stack[--stackSize];
+		const BVHNode& node = nodes[entry.nodeIdx];
+		if (node.isLeaf()) {
+			quantizedNodes[entry.nodeIdx] = QuantizedBVHNode::MakeLeaf(node.offset, node.triangleCount);
+			continue;
+		}
+
+		const AABB children[2] = { nodes[node.offset].aabb, nodes[node.offset + 1].aabb };
+		const QuantizedBVHNode quantized = QuantizedBVHNode::MakeInterior(entry.decoded, children, node.offset);
+		quantizedNodes[entry.nodeIdx] = quantized;
+		for (int child = 0; child < 2; ++child) {
+			const AABB decoded = quantized.decodeChild(entry.decoded, child);
+			for (int axis = 0; axis < 3; ++axis) {
+				assert(decoded.bounds[0].axis(axis) <= children[child].bounds[0].axis(axis));
+				assert(decoded.bounds[1].axis(axis) >= children[child].bounds[1].axis(axis));
+			}
+			stack[stackSize++] = { node.offset + child, decoded };
+		}
+	}
+}
+
+void BVH::reorderNodes()
+{
+	// Wide nodes are collapsed from `nodes` depth first and do not follow its order, see `buildWide`
+	if (width != 2 || nodes.empty()) {
+		return;
+	}
+
+	std::vector<uint32_t> firstChild(nodes.size());
+	for (size_t i = 0; i < nodes.size(); ++i) {
+		firstChild[i] = nodes[i].isLeaf() ? NodeLayout::noChild : nodes[i].offset;
+	}
+	const std::vector<uint32_t> newIdx = NodeLayout::treeletOrder(firstChild, sizeof(BVHNode));
+
+	std::vector<BVHNode> reordered(nodes.size());
+	for (size_t i = 0; i < nodes.size(); ++i) {
+		BVHNode node = nodes[i];
+		if (!node.isLeaf()) {
+			node.offset = newIdx[node.offset];
+		}
+		reordered[newIdx[i]] = node;
+	}
+	nodes = std::move(reordered);
+
+	if (!quantizedNodes.empty()) {
+		buildQuantized();
+	}
+}
+
+float BVH::refit(const std::vector<AABB>& cacheTriangleAABBs, const Settings& settings)
+{
+	// Children are always stored after their parent, so a reverse sweep visits children first
+	for (size_t i = nodes.size(); i-- > 0;) {
+		BVHNode& node = nodes[i];
+		node.aabb = AABB::MakeEmpty();
+		if (node.isLeaf()) {
+			for (uint32_t j = node.offset; j < node.offset + node.triangleCount; ++j) {
+				node.aabb.expand(cacheTriangleAABBs[triangleRefs[j]]);
+			}
+		}
+		else {
+			node.aabb.expand(nodes[node.offset].aabb);
+			node.aabb.expand(nodes[node.offset + 1].aabb);
+		}
+	}
+
+	// Wide and quantized nodes copy their bounds from the binary tree. Deriving them again is linear in the node count
+	if (width == 4) {
+		buildWide(nodes4);
+	}
+	else if (width == 8) {
+		buildWide(nodes8);
+	}
+	else if (!quantizedNodes.empty()) {
+		buildQuantized();
+	}
+	return builtSahCost > 0.f ? sahCost(settings) / builtSahCost : 1.f;
+}
+
+float BVH::sahCost(const Settings& settings) const
+{
+	if (nodes.empty() || nodes[0].aabb.surfaceArea() <= 0.f) {
+		return 0.f;
+	}
+
+	float cost = 0.f;
+	for (const BVHNode& node : nodes) {
+		float nodeCost = node.isLeaf() ? settings.sahIntersectionCost * float(node.triangleCount) : settings.sahTraversalCost;
+		cost += node.aabb.surfaceArea() * nodeCost;
+	}
+	return cost / nodes[0].aabb.surfaceArea();
+}
+
+void BVH::traverse(const Scene& scene, const Ray& ray, TraceHit& out) const
+{
+	if (width == 4) {
+		traverseWide(nodes4, scene, ray, out);
+		return;
+	}
+	if (width == 8) {
+		traverseWide(nodes8, scene, ray, out);
+		return;
+	}
+	if (!quantizedNodes.empty()) {
+		traverseQuantized(scene, ray, out);
+		return;
+	}
+
+	out.t = std::numeric_limits<float>::max();
+	out.type = TraceHitType::OUT_OF_BOUNDS;
+	float rootEntry;
+	if (nodes.empty() || !nodes[0].aabb.hasIntersection(ray, out.t, rootEntry)) {
+		return;
+	}
+
+	struct StackEntry {
+		uint32_t nodeIdx;
+		/* Distance at which the ray enters the node */
+		float tEntry;
+	};
+	// Every interior node pops one entry and pushes at most two, so the stack never exceeds depth + 1
+	std::array<StackEntry, maxDepth + 1> stack;
+	size_t stackSize = 0;
+	stack[stackSize++] = { 0, rootEntry };
+	Mailbox mailbox{};
+	Mailbox* leafMailbox = spatialSplits ? &mailbox : nullptr;
+	ScopedCounter nodeVisits{ GSceneMetrics, "BVHNodeVisit" };
+	ScopedCounter packTests{ GSceneMetrics, "TrianglePackIntersection" };
+
+	while (stackSize > 0) {
+		const StackEntry entry = stack[--stackSize];
+		if (entry.tEntry > out.t) {
+			continue; // a closer hit was found after this node was pushed
+		}
+
+		nodeVisits.increment();
+		const BVHNode& node = nodes[entry.nodeIdx];
+		if (node.isLeaf()) {
+			intersectLeaf(scene, ray, node.offset, node.triangleCount, leafMailbox, packTests, out);
+			continue;
+		}
+
+		// Children may overlap, so both have to be visited. Visit the closer one first
+		float tEntry0, tEntry1;
+		bool hit0 = nodes[node.offset].aabb.hasIntersection(ray, out.t, tEntry0);
+		bool hit1 = nodes[node.offset + 1].aabb.hasIntersection(ray, out.t, tEntry1);
+		if (hit0 && hit1) {
+			if (tEntry0 <= tEntry1) {
+				stack[stackSize++] = { node.offset + 1, tEntry1 };
+				stack[stackSize++] = { node.offset, tEntry0 };
+			}
+			else {
+				stack[stackSize++] = { node.offset, tEntry0 };
+				stack[stackSize++] = { node.offset + 1, tEntry1 };
+			}
+		}
+		else if (hit0) {
+			stack[stackSize++] = { node.offset, tEntry0 };
+		}
+		else if (hit1) {
+			stack[stackSize++] = { node.offset + 1, tEntry1 };
+		}
+	}
+}
+
+void BVH::traverseQuantized(const Scene& scene, const Ray& ray, TraceHit& out) const
+{
+	out.t = std::numeric_limits<float>::max();
+	out.type = TraceHitType::OUT_OF_BOUNDS;
+	float rootEntry;
+	if (!nodes[0].aabb.hasIntersection(ray, out.t, rootEntry)) {
+		return;
+	}
+
+	// Same order as `traverse`. Entries carry the decoded bounds, which the children are quantized against
+	struct StackEntry {
+		uint32_t nodeIdx;
+		float tEntry;
+		AABB box;
+	};
+	std::array<StackEntry, maxDepth + 1> stack;
+	size_t stackSize = 0;
+	stack[stackSize++] = { 0, rootEntry, nodes[0].aabb };
+	Mailbox mailbox{};
+	Mailbox* leafMailbox = spatialSplits ? &mailbox : nullptr;
+	ScopedCounter nodeVisits{ GSceneMetrics, "BVHNodeVisit" };
+	ScopedCounter packTests{ GSceneMetrics, "TrianglePackIntersection" };
+
+	while (stackSize > 0) {
+		const StackEntry entry = stack[--stackSize];
+		if (entry.tEntry > out.t) {
+			continue; // a closer hit was found after this node was pushed
+		}
+
+		nodeVisits.increment();
+		const QuantizedBVHNode& node = quantizedNodes[entry.nodeIdx];
+		if (node.isLeaf()) {
+			intersectLeaf(scene, ray, node.getTriangleOffset(), node.getTriangleCount(), leafMailbox, packTests, out);
+			continue;
+		}
+
+		const AABB box0 = node.decodeChild(entry.box, 0);
+		const AABB box1 = node.decodeChild(entry.box, 1);
+		float tEntry0, tEntry1;
+		bool hit0 = box0.hasIntersection(ray, out.t, tEntry0);
+		bool hit1 = box1.hasIntersection(ray, out.t, tEntry1);
+		const uint32_t child = node.getChildIdx();
+		if (hit0 && hit1) {
+			if (tEntry0 <= tEntry1) {
+				stack[stackSize++] = { child + 1, tEntry1, box1 };
+				stack[stackSize++] = { child, tEntry0, box0 };
+			}
+			else {
+				stack[stackSize++] = { child, tEntry0, box0 };
+				stack[stackSize++] = { child + 1, tEntry1, box1 };
+			}
+		}
+		else if (hit0) {
+			stack[stackSize++] = { child, tEntry0, box0 };
+		}
+		else if (hit1) {
+			stack[stackSize++] = { child + 1, tEntry1, box1 };
+		}
+	}
+}
+
+bool BVH::isOccludedQuantized(const Scene& scene, const Ray& ray, float maxT, const Vec3& start, const Vec3& end) const
+{
+	float tEntry;
+	if (!nodes[0].aabb.hasIntersection(ray, maxT, tEntry)) {
+		return false;
+	}
+
+	struct StackEntry {
+		uint32_t nodeIdx;
+		AABB box;
+	};
+	std::array<StackEntry, maxDepth + 1> stack;
+	size_t stackSize = 0;
+	stack[stackSize++] = { 0, nodes[0].aabb };
+	Mailbox mailbox{};
+	Mailbox* leafMailbox = spatialSplits ? &mailbox : nullptr;
+
+	while (stackSize > 0) {
+		const StackEntry entry = stack[--stackSize];
+		const QuantizedBVHNode& node = quantizedNodes[entry.nodeIdx];
+		if (node.isLeaf()) {
+			if (leafOccludes(scene, node.getTriangleOffset(), node.getTriangleCount(), start, end, leafMailbox)) {
+				return true;
+			}
+			continue;
+		}
+
+		for (uint32_t child = 0; child < 2; ++child) {
+			const AABB box = node.decodeChild(entry.box, int(child));
+			if (box.hasIntersection(ray, maxT, tEntry)) {
+				stack[stackSize++] = { node.getChildIdx() + child, box };
+			}
+		}
+	}
+	return false;
+}
+
+template <size_t Width>
+void BVH::traverseWide(const std::vector<WideBVHNode<Width>>& wideNodes, const Scene& scene, const Ray& ray, TraceHit& out) const
+{
+	out.t = std::numeric_limits<float>::max();
+	out.type = TraceHitType::OUT_OF_BOUNDS;
+	if (wideNodes.empty()) {
+		return;
+	}
+
+	struct StackEntry {
+		/* interior: index in `wideNodes`. leaf: offset into `triangleRefs` */
+		uint32_t idx;
+		/* 0 for interior nodes */
+		uint32_t triangleCount;
+		float tEntry;
+	};
+	// Every wide node pops one entry and pushes at most Width
+	std::array<StackEntry, maxDepth * (Width - 1) + 1> stack;
+	size_t stackSize = 0;
+	stack[stackSize++] = { 0, 0, 0.f };
+	Mailbox mailbox{};
+	Mailbox* leafMailbox = spatialSplits ? &mailbox : nullptr;
+	ScopedCounter nodeVisits{ GSceneMetrics, "BVHNodeVisit" };
+	ScopedCounter packTests{ GSceneMetrics, "TrianglePackIntersection" };
+
+	alignas(32) float tEntries[Width];
+	while (stackSize > 0) {
+		const StackEntry entry = stack[--stackSize];
+		if (entry.tEntry > out.t) {
+			continue; // a closer hit was found after this node was pushed
+		}
+
+		nodeVisits.increment();
+		if (entry.triangleCount > 0) {
+			intersectLeaf(scene, ray, entry.idx, entry.triangleCount, leafMailbox, packTests, out);
+			continue;
+		}
+
+		const WideBVHNode<Width>& node = wideNodes[entry.idx];
+		uint32_t hitMask = intersectChildren(node, ray, out.t, tEntries);
+
+		// Insertion sort the hit children by descending entry distance, so that the closest one is popped first
+		const size_t firstPushed = stackSize;
+		for (size_t slot = 0; slot < Width; ++slot) {
+			if (!(hitMask & (1u << slot))) {
+				continue;
+			}
+			StackEntry child{ node.child[slot], node.triangleCount[slot], tEntries[slot] };
+			size_t i = stackSize++;
+			while (i > firstPushed && stack[i - 1].tEntry < child.tEntry) {
+				stack[i] = stack[i - 1];
+				--i;
+			}
+			stack[i] = child;
+		}
+	}
+}
+
+bool BVH::isOccluded(const Scene& scene, const Vec3& start, const Vec3& end) const
+{
+	if (nodes.empty()) {
+		return false;
+	}
+
+	Vec3 dir = end - start;
+	const float maxT = dir.length();
+	dir.normalize();
+	const Ray ray{ start, dir };
+
+	if (width == 4) {
+		return isOccludedWide(nodes4, scene, ray, maxT, start, end);
+	}
+	if (width == 8) {
+		return isOccludedWide(nodes8, scene, ray, maxT, start, end);
+	}
+	if (!quantizedNodes.empty()) {
+		return isOccludedQuantized(scene, ray, maxT, start, end);
+	}
+
+	float tEntry;
+	if (!nodes[0].aabb.hasIntersection(ray, maxT, tEntry)) {
+		return false;
+	}
+
+	// Children are visited in any order, the first occluder ends the query
+	std::array<uint32_t, maxDepth + 1> stack;
+	size_t stackSize = 0;
+	stack[stackSize++] = 0;
+	Mailbox mailbox{};
+	Mailbox* leafMailbox = spatialSplits ? &mailbox : nullptr;
+
+	while (stackSize > 0) {
+		const BVHNode& node = nodes[stack[--stackSize]];
+		if (node.isLeaf()) {
+			if (leafOccludes(scene, node.offset, node.triangleCount, start, end, leafMailbox)) {
+				return true;
+			}
+			continue;
+		}
+
+		if (nodes[node.offset].aabb.hasIntersection(ray, maxT, tEntry)) {
+			stack[stackSize++] = node.offset;
+		}
+		if (nodes[node.offset + 1].aabb.hasIntersection(ray, maxT, tEntry)) {
+			stack[stackSize++] = node.offset + 1;
+		}
+	}
+	return false;
+}
+
+template <size_t Width>
+bool BVH::isOccludedWide(const std::vector<WideBVHNode<Width>>& wideNodes, const Scene& scene, const Ray& ray, float maxT,
+	const Vec3& start, const Vec3& end) const
+{
+	struct StackEntry {
+		/* interior: index in `wideNodes`. leaf: offset into `triangleRefs` */
+		uint32_t idx;
+		/* 0 for interior nodes */
+		uint32_t triangleCount;
+	};
+	std::array<StackEntry, maxDepth * (Width - 1) + 1> stack;
+	size_t stackSize = 0;
+	stack[stackSize++] = { 0, 0 };
+	Mailbox mailbox{};
+	Mailbox* leafMailbox = spatialSplits ? &mailbox : nullptr;
+
+	alignas(32) float tEntries[Width];
+	while (stackSize > 0) {
+		const StackEntry entry = stack[--stackSize];
+		if (entry.triangleCount > 0) {
+			if (leafOccludes(scene, entry.idx, entry.triangleCount, start, end, leafMailbox)) {
+				return true;
+			}
+			continue;
+		}
+
+		const WideBVHNode<Width>& node = wideNodes[entry.idx];
+		uint32_t hitMask = intersectChildren(node, ray, maxT, tEntries);
+		for (size_t slot = 0; slot < Width; ++slot) {
+			if (hitMask & (1u << slot)) {
+				stack[stackSize++] = { node.child[slot], node.triangleCount[slot] };
+			}
+		}
+	}
+	return false;
+}
+
+bool BVH::leafOccludes(const Scene& scene, uint32_t offset, uint32_t triangleCount, const Vec3& start, const Vec3& end,
+	Mailbox* mailbox) const
+{
+	const uint32_t* refsBegin = triangleRefs.data() + offset;
+	const uint32_t* refsEnd = refsBegin + triangleCount;
+	for (const uint32_t* triRef = refsBegin; triRef != refsEnd; ++triRef) {
+		if (mailbox && mailbox->checkAndRecord(*triRef)) {
+			continue;
+		}
+		const Triangle& tri = scene.triangles[*triRef];
+		if (scene.materials[tri.materialIndex].occludes && tri.fastIntersect(scene, start, end)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+template <size_t Width>
+void BVH::buildWide(std::vector<WideBVHNode<Width>>& wideNodes) const
+{
+	wideNodes.clear();
+	if (nodes.empty()) {
+		return;
+	}
+
+	struct Pending {
+		uint32_t binaryIdx;
+		uint32_t wideIdx;
+	};
+	std::vector<Pending> pending{ { 0, 0 } };
+	wideNodes.emplace_back();
+
+	while (!pending.empty()) {
+		const Pending current = pending.back();
+		pending.pop_back();
+
+		// Start from the binary node itself and keep replacing the largest interior child by its two children
+		std::array<uint32_t, Width> children{};
+		size_t childCount = 0;
+		children[childCount++] = current.binaryIdx;
+		while (childCount < Width) {
+			int largest = -1;
+			float largestArea = -1.f;
+			for (size_t i = 0; i < childCount; ++i) {
+				const BVHNode& candidate = nodes[children[i]];
+				if (!candidate.isLeaf() && candidate.aabb.surfaceArea() > largestArea) {
+					largest = int(i);
+					largestArea = candidate.aabb.surfaceArea();
+				}
+			}
+			if (largest < 0) {
+				break; // only leaves left
+			}
+			uint32_t firstChild = nodes[children[largest]].offset;
+			children[largest] = firstChild;
+			children[childCount++] = firstChild + 1;
+		}
+
+		WideBVHNode<Width> wideNode{};
+		wideNode.childCount = uint32_t(childCount);
+		for (size_t slot = 0; slot < childCount; ++slot) {
+			const BVHNode& binaryChild = nodes[children[slot]];
+			for (int axis = 0; axis < 3; ++axis) {
+				wideNode.bounds[0][axis][slot] = binaryChild.aabb.bounds[0].axis(axis);
+				wideNode.bounds[1][axis][slot] = binaryChild.aabb.bounds[1].axis(axis);
+			}
+
+			if (binaryChild.isLeaf()) {
+				wideNode.child[slot] = binaryChild.offset;
+				wideNode.triangleCount[slot] = binaryChild.triangleCount;
+			}
+			else {
+				uint32_t wideIdx = uint32_t(wideNodes.size());
+				wideNodes.emplace_back();
+				pending.push_back({ children[slot], wideIdx });
+				wideNode.child[slot] = wideIdx;
+			}
+		}
+		wideNodes[current.wideIdx] = wideNode;
+	}
+}
+
+void BVH::intersectLeaf(const Scene& scene, const Ray& ray, uint32_t offset, uint32_t triangleCount, Mailbox* mailbox,
+	ScopedCounter& packTests, TraceHit& out) const
+{
+	if (packs.getWidth() > 1) {
+		packs.intersectLeaf(scene, ray, offset, triangleCount, out, packTests, mailbox);
+		return;
+	}
+
+	const uint32_t* refsBegin = triangleRefs.data() + offset;
+	const uint32_t* refsEnd = refsBegin + triangleCount;
+	for (const uint32_t* triRef = refsBegin; triRef != refsEnd; ++triRef) {
+		if (mailbox && mailbox->checkAndRecord(*triRef)) {
+			continue;
+		}
+		const Triangle& tri = scene.triangles[*triRef];
+
+		TraceHit tryHit{};
+		tryHit.t = out.t;
+		tri.intersect(scene, ray, *triRef, tryHit);
+		if (tryHit.successful() && tryHit.t < out.t) {
+			out = tryHit;
+		}
+	}
+}
+
+void BVH::buildRecursive(std::vector<BVHNode>& outNodes, uint32_t nodeIdx, uint32_t begin, uint32_t end,
+	const std::vector<AABB>& cacheTriangleAABBs, const Settings& settings, size_t depth, ThreadPool& pool)
+{
+	const uint32_t count = end - begin;
+	// Large nodes split their triangle range into one chunk per thread. Every chunk writes only to its own slot
+	const size_t chunkSize = count > settings.parallelBuildThreshold ? (count + pool.getNumThreads() - 1) / pool.getNumThreads() : count;
+	const size_t numChunks = (count + chunkSize - 1) / chunkSize;
+
+	std::vector<AABB> chunkAabbs(numChunks, AABB::MakeEmpty());
+	std::vector<AABB> chunkCentroidAabbs(numChunks, AABB::MakeEmpty());
+	pool.parallelFor(count, chunkSize, [&](size_t chunkBegin, size_t chunkEnd) {
+		size_t chunk = chunkBegin / chunkSize;
+		for (size_t i = begin + chunkBegin; i < begin + chunkEnd; ++i) {
+			const AABB& triAabb = cacheTriangleAABBs[triangleRefs[i]];
+			chunkAabbs[chunk].expand(triAabb);
+			chunkCentroidAabbs[chunk].expand(triAabb.center());
+		}
+	});
+	AABB nodeAabb = AABB::MakeEmpty();
+	AABB centroidAabb = AABB::MakeEmpty();
+	for (size_t chunk = 0; chunk < numChunks; ++chunk) {
+		nodeAabb.expand(chunkAabbs[chunk]);
+		centroidAabb.expand(chunkCentroidAabbs[chunk]);
+	}
+
+	auto makeLeaf = [&]() {
+		outNodes[nodeIdx].aabb = nodeAabb;
+		outNodes[nodeIdx].offset = begin;
+		outNodes[nodeIdx].triangleCount = count;
+	};
+
+	// 0.1 Recursion Root (Make Leaf)
+	size_t depthLimit = std::min(settings.accelTreeMaxDepth, maxDepth);
+	const size_t maxLeafSize = std::max<size_t>(settings.maxTrianglesPerLeaf, 1);
+	float nodeArea = nodeAabb.surfaceArea();
+	if (depth >= depthLimit || count <= maxLeafSize || nodeArea <= 0.f) {
+		makeLeaf();
+		return;
+	}
+
+	// 1. Choose the split with binned SAH. Triangles are binned by their centroid, on all axes in one pass
+	struct Bin {
+		AABB aabb = AABB::MakeEmpty();
+		uint32_t count = 0;
+	};
+	const size_t numBins = settings.sahBins;
+	bool splittable[3];
+	for (int axis = 0; axis < 3; ++axis) {
+		// all centroids may coincide on this axis
+		splittable[axis] = centroidAabb.bounds[1].axis(axis) - centroidAabb.bounds[0].axis(axis) > 0.f;
+	}
+
+	auto binOf = [&](int axis, uint32_t ref) {
+		float lo = centroidAabb.bounds[0].axis(axis);
+		float extent = centroidAabb.bounds[1].axis(axis) - lo;
+		float bin = (cacheTriangleAABBs[ref].center().axis(axis) - lo) * float(numBins) / extent;
+		return std::min(size_t(std::max(bin, 0.f)), numBins - 1);
+	};
+
+	// chunkBins[(chunk * 3 + axis) * numBins + bin]
+	std::vector<Bin> chunkBins(numChunks * 3 * numBins);
+	pool.parallelFor(count, chunkSize, [&](size_t chunkBegin, size_t chunkEnd) {
+		Bin* bins = chunkBins.data() + (chunkBegin / chunkSize) * 3 * numBins;
+		for (size_t i = begin + chunkBegin; i < begin + chunkEnd; ++i) {
+			uint32_t ref = triangleRefs[i];
+			for (int axis = 0; axis < 3; ++axis) {
+				if (!splittable[axis]) {
+					continue;
+				}
+				Bin& bin = bins[axis * numBins + binOf(axis, ref)];
+				bin.aabb.expand(cacheTriangleAABBs[ref]);
+				++bin.count;
+			}
+		}
+	});
+	for (size_t chunk = 1; chunk < numChunks; ++chunk) {
+		for (size_t i = 0; i < 3 * numBins; ++i) {
+			const Bin& chunkBin = chunkBins[chunk * 3 * numBins + i];
+			if (chunkBin.count > 0) {
+				chunkBins[i].aabb.expand(chunkBin.aabb);
+				chunkBins[i].count += chunkBin.count;
+			}
+		}
+	}
+
+	// rightAreas[i], rightCounts[i]: everything in bins [i, numBins)
+	std::vector<float> rightAreas(numBins);
+	std::vector<uint32_t> rightCounts(numBins);
+
+	int bestAxis = -1;
+	size_t bestPlane = 0;
+	float bestCost = std::numeric_limits<float>::max();
+	for (int axis = 0; axis < 3; ++axis) {
+		if (!splittable[axis]) {
+			continue;
+		}
+		const Bin* bins = chunkBins.data() + axis * numBins;
+
+		// Empty bins are skipped. Expanding with their inverted AABB would make the bounds infinite
+		AABB accumulated = AABB::MakeEmpty();
+		uint32_t accumulatedCount = 0;
+		for (size_t i = numBins - 1; i > 0; --i) {
+			if (bins[i].count > 0) {
+				accumulated.expand(bins[i].aabb);
+				accumulatedCount += bins[i].count;
+			}
+			rightAreas[i] = accumulatedCount > 0 ? accumulated.surfaceArea() : 0.f;
+			rightCounts[i] = accumulatedCount;
+		}
+
+		accumulated = AABB::MakeEmpty();
+		accumulatedCount = 0;
+		for (size_t plane = 1; plane < numBins; ++plane) {
+			if (bins[plane - 1].count > 0) {
+				accumulated.expand(bins[plane - 1].aabb);
+				accumulatedCount += bins[plane - 1].count;
+			}
+			if (accumulatedCount == 0 || rightCounts[plane] == 0) {
+				continue;
+			}
+
+			float cost = settings.sahTraversalCost + settings.sahIntersectionCost *
+				(accumulated.surfaceArea() * float(accumulatedCount) + rightAreas[plane] * float(rightCounts[plane])) / nodeArea;
+			if (cost < bestCost) {
+				bestAxis = axis;
+				bestPlane = plane;
+				bestCost = cost;
+			}
+		}
+	}
+
+	// 0.2 Recursion Root 2. Stop if all centroids coincide or if splitting is more expensive than a leaf
+	float leafCost = settings.sahIntersectionCost * float(count);
+	if (bestAxis < 0 || bestCost >= leafCost) {
+		makeLeaf();
+		return;
+	}
+
+	// 2. Partition the triangle range in place. Chunks are partitioned on their own, then their halves are gathered
+	auto goesLeft = [&](uint32_t ref) { return binOf(bestAxis, ref) < bestPlane; };
+	std::vector<uint32_t> chunkLeftCounts(numChunks);
+	pool.parallelFor(count, chunkSize, [&](size_t chunkBegin, size_t chunkEnd) {
+		auto first = triangleRefs.begin() + begin + chunkBegin;
+		auto last = triangleRefs.begin() + begin + chunkEnd;
+		chunkLeftCounts[chunkBegin / chunkSize] = uint32_t(std::partition(first, last, goesLeft) - first);
+	});
+
+	uint32_t leftCount = 0;
+	for (uint32_t chunkLeftCount : chunkLeftCounts) {
+		leftCount += chunkLeftCount;
+	}
+	if (numChunks > 1) {
+		std::vector<uint32_t> gathered(count);
+		pool.parallelFor(count, chunkSize, [&](size_t chunkBegin, size_t chunkEnd) {
+			size_t chunk = chunkBegin / chunkSize;
+			size_t leftOffset = 0;
+			size_t rightOffset = leftCount;
+			for (size_t previous = 0; previous < chunk; ++previous) {
+				leftOffset += chunkLeftCounts[previous];
+				rightOffset += std::min(chunkSize, count - previous * chunkSize) - chunkLeftCounts[previous];
+			}
+			auto first = triangleRefs.begin() + begin + chunkBegin;
+			auto middle = first + chunkLeftCounts[chunk];
+			auto last = triangleRefs.begin() + begin + chunkEnd;
+			std::copy(first, middle, gathered.begin() + leftOffset);
+			std::copy(middle, last, gathered.begin() + rightOffset);
+		});
+		pool.parallelFor(count, chunkSize, [&](size_t chunkBegin, size_t chunkEnd) {
+			std::copy(gathered.begin() + chunkBegin, gathered.begin() + chunkEnd, triangleRefs.begin() + begin + chunkBegin);
+		});
+	}
+	uint32_t mid = begin + leftCount;
+	assert(mid > begin && mid < end);
+
+	// 3. Create Children. Siblings are allocated next to each other
+	uint32_t childIdx = uint32_t(outNodes.size());
+	outNodes.emplace_back();
+	outNodes.emplace_back();
+	outNodes[nodeIdx].aabb = nodeAabb;
+	outNodes[nodeIdx].offset = childIdx;
+	outNodes[nodeIdx].triangleCount = 0;
+
+	const bool fork = pool.getNumThreads() > 1 && count > settings.parallelBuildThreshold;
+	if (!fork) {
+		buildRecursive(outNodes, childIdx, begin, mid, cacheTriangleAABBs, settings, depth + 1, pool);
+		buildRecursive(outNodes, childIdx + 1, mid, end, cacheTriangleAABBs, settings, depth + 1, pool);
+		return;
+	}
+
+	// 4. Large node: build the second child on another thread. The children own disjoint ranges of `triangleRefs`,
+	// but need their own node arrays
+	std::vector<BVHNode> subNodes[2] = { std::vector<BVHNode>(1), std::vector<BVHNode>(1) };
+	std::atomic<size_t> pending{ 1 };
+	pool.submit([&]() {
+		buildRecursive(subNodes[1], 0, mid, end, cacheTriangleAABBs, settings, depth + 1, pool);
+	}, pending);
+	buildRecursive(subNodes[0], 0, begin, mid, cacheTriangleAABBs, settings, depth + 1, pool);
+	pool.wait(pending);
+
+	appendSubtree(outNodes, childIdx, subNodes[0]);
+	appendSubtree(outNodes, childIdx + 1, subNodes[1]);
+}
+
+void BVH::buildLinear(const std::vector<AABB>& cacheTriangleAABBs, const Settings& settings, ThreadPool& pool)
+{
+	const size_t count = triangleRefs.size();
+	const size_t chunkSize = count > settings.parallelBuildThreshold ? (count + pool.getNumThreads() - 1) / pool.getNumThreads() : count;
+	const size_t numChunks = (count + chunkSize - 1) / chunkSize;
+
+	// 1. Centroid bounds. The Morton grid spans them
+	std::vector<AABB> chunkCentroidAabbs(numChunks, AABB::MakeEmpty());
+	pool.parallelFor(count, chunkSize, [&](size_t chunkBegin, size_t chunkEnd) {
+		AABB& chunkCentroidAabb = chunkCentroidAabbs[chunkBegin / chunkSize];
+		for (size_t i = chunkBegin; i < chunkEnd; ++i) {
+			chunkCentroidAabb.expand(cacheTriangleAABBs[triangleRefs[i]].center());
+		}
+	});
+	AABB centroidAabb = AABB::MakeEmpty();
+	for (const AABB& chunkCentroidAabb : chunkCentroidAabbs) {
+		centroidAabb.expand(chunkCentroidAabb);
+	}
+
+	// 2. Morton code of every centroid. Axes where all centroids coincide map to 0
+	std::vector<uint32_t> mortonCodes(count);
+	pool.parallelFor(count, chunkSize, [&](size_t chunkBegin, size_t chunkEnd) {
+		for (size_t i = chunkBegin; i < chunkEnd; ++i) {
+			const Vec3 center = cacheTriangleAABBs[triangleRefs[i]].center();
+			float unit[3];
+			for (int axis = 0; axis < 3; ++axis) {
+				const float lo = centroidAabb.bounds[0].axis(axis);
+				const float extent = centroidAabb.bounds[1].axis(axis) - lo;
+				unit[axis] = extent > 0.f ? (center.axis(axis) - lo) / extent : 0.f;
+			}
+			mortonCodes[i] = Utils::mortonCode3D(unit[0], unit[1], unit[2]);
+		}
+	});
+
+	// 3. Sort the references along the curve, then split the sorted ranges
+	radixSortByKey(mortonCodes, triangleRefs, chunkSize, pool);
+	buildLinearRecursive(nodes, 0, 0, uint32_t(count), mortonCodes, cacheTriangleAABBs, settings, 0, pool);
+}
+
+void BVH::buildLinearRecursive(std::vector<BVHNode>& outNodes, uint32_t nodeIdx, uint32_t begin, uint32_t end,
+	const std::vector<uint32_t>& mortonCodes, const std::vector<AABB>& cacheTriangleAABBs, const Settings& settings,
+	size_t depth, ThreadPool& pool)
+{
+	const uint32_t count = end - begin;
+	size_t depthLimit = std::min(settings.accelTreeMaxDepth, maxDepth);
+	// A single triangle cannot be split, whatever `maxTrianglesPerLeaf` asks for
+	const size_t maxLeafSize = std::max<size_t>(settings.maxTrianglesPerLeaf, 1);
+	if (depth >= depthLimit || count <= maxLeafSize) {
+		BVHNode& leaf = outNodes[nodeIdx];
+		leaf.aabb = AABB::MakeEmpty();
+		for (uint32_t i = begin; i < end; ++i) {
+			leaf.aabb.expand(cacheTriangleAABBs[triangleRefs[i]]);
+		}
+		leaf.offset = begin;
+		leaf.triangleCount = count;
+		return;
+	}
+
+	// 1. Split where the highest differing bit of the range flips. The codes are sorted and agree above that bit,
+	// so it is 0 for a prefix of the range and 1 after. A range of equal codes is halved
+	uint32_t mid = begin + count / 2;
+	const uint32_t differing = mortonCodes[begin] ^ mortonCodes[end - 1];
+	if (differing != 0) {
+		const uint32_t splitBit = std::bit_floor(differing);
+		mid = uint32_t(std::partition_point(mortonCodes.begin() + begin, mortonCodes.begin() + end,
+			[splitBit](uint32_t code) { return (code & splitBit) == 0; }) - mortonCodes.begin());
+	}
+	assert(mid > begin && mid < end);
+
+	// 2. Create Children. Siblings are allocated next to each other
+	uint32_t childIdx = uint32_t(outNodes.size());
+	outNodes.emplace_back();
+	outNodes.emplace_back();
+	outNodes[nodeIdx].offset = childIdx;
+	outNodes[nodeIdx].triangleCount = 0;
+
+	const bool fork = pool.getNumThreads() > 1 && count > settings.parallelBuildThreshold;
+	if (!fork) {
+		buildLinearRecursive(outNodes, childIdx, begin, mid, mortonCodes, cacheTriangleAABBs, settings, depth + 1, pool);
+		buildLinearRecursive(outNodes, childIdx + 1, mid, end, mortonCodes, cacheTriangleAABBs, settings, depth + 1, pool);
+	}
+	else {
+		// Large node: build the second child on another thread, see `buildRecursive`
+		std::vector<BVHNode> subNodes[2] = { std::vector<BVHNode>(1), std::vector<BVHNode>(1) };
+		std::atomic<size_t> pending{ 1 };
+		pool.submit([&]() {
+			buildLinearRecursive(subNodes[1], 0, mid, end, mortonCodes, cacheTriangleAABBs, settings, depth + 1, pool);
+		}, pending);
+		buildLinearRecursive(subNodes[0], 0, begin, mid, mortonCodes, cacheTriangleAABBs, settings, depth + 1, pool);
+		pool.wait(pending);
+
+		appendSubtree(outNodes, childIdx, subNodes[0]);
+		appendSubtree(outNodes, childIdx + 1, subNodes[1]);
+	}
+
+	// 3. Bounds bottom-up. The children are complete now
+	outNodes[nodeIdx].aabb = outNodes[childIdx].aabb;
+	outNodes[nodeIdx].aabb.expand(outNodes[childIdx + 1].aabb);
+}
+
+void BVH::buildSpatial(const std::vector<AABB>& cacheTriangleAABBs, const std::vector<Triangle>& triangles,
+	const std::vector<Vec3>& vertices, const Settings& settings)
+{
+	std::vector<SpatialRef> refs{};
+	refs.reserve(triangleRefs.size());
+	AABB rootAabb = AABB::MakeEmpty();
+	for (uint32_t ref : triangleRefs) {
+		refs.push_back({ ref, cacheTriangleAABBs[ref] });
+		rootAabb.expand(cacheTriangleAABBs[ref]);
+	}
+
+	size_t refBudget = size_t(float(triangleRefs.size()) * (settings.sbvhDuplication - 1.f));
+	const SpatialContext context{ triangles, vertices, settings, sbvhMinOverlapRatio * rootAabb.surfaceArea() };
+	std::vector<uint32_t> outTriangleRefs{};
+	outTriangleRefs.reserve(triangleRefs.size() + refBudget);
+	buildSpatialRecursive(nodes, outTriangleRefs, 0, std::move(refs), context, refBudget, 0);
+	triangleRefs = std::move(outTriangleRefs);
+}
+
+void BVH::buildSpatialRecursive(std::vector<BVHNode>& outNodes, std::vector<uint32_t>& outTriangleRefs, uint32_t nodeIdx,
+	std::vector<SpatialRef>&& refs, const SpatialContext& context, size_t& refBudget, size_t depth)
+{
+	const Settings& settings = context.settings;
+	const uint32_t count = uint32_t(refs.size());
+	AABB nodeAabb = AABB::MakeEmpty();
+	AABB centroidAabb = AABB::MakeEmpty();
+	for (const SpatialRef& ref : refs) {
+		nodeAabb.expand(ref.bounds);
+		centroidAabb.expand(ref.bounds.center());
+	}
+
+	auto makeLeaf = [&]() {
+		BVHNode& leaf = outNodes[nodeIdx];
+		leaf.aabb = nodeAabb;
+		leaf.offset = uint32_t(outTriangleRefs.size());
+		leaf.triangleCount = count;
+		for (const SpatialRef& ref : refs) {
+			outTriangleRefs.push_back(ref.triRef);
+		}
+	};
+
+	// 0.1 Recursion Root (Make Leaf)
+	size_t depthLimit = std::min(settings.accelTreeMaxDepth, maxDepth);
+	const size_t maxLeafSize = std::max<size_t>(settings.maxTrianglesPerLeaf, 1);
+	float nodeArea = nodeAabb.surfaceArea();
+	if (depth >= depthLimit || count <= maxLeafSize || nodeArea <= 0.f) {
+		makeLeaf();
+		return;
+	}
+
+	const size_t numBins = settings.sahBins;
+	auto splitCost = [&](float leftArea, size_t leftCount, float rightArea, size_t rightCount) {
+		return settings.sahTraversalCost + settings.sahIntersectionCost *
+			(leftArea * float(leftCount) + rightArea * float(rightCount)) / nodeArea;
+	};
+
+	// 1. Object split. Binned SAH over the reference centroids, as in `buildRecursive`
+	struct Bin {
+		AABB aabb = AABB::MakeEmpty();
+		uint32_t count = 0;
+	};
+	int objectAxis = -1;
+	size_t objectPlane = 0;
+	float objectCost = std::numeric_limits<float>::max();
+	AABB objectChildAabbs[2];
+	auto objectBinOf = [&](int axis, const SpatialRef& ref) {
+		float lo = centroidAabb.bounds[0].axis(axis);
+		float extent = centroidAabb.bounds[1].axis(axis) - lo;
+		float bin = (ref.bounds.center().axis(axis) - lo) * float(numBins) / extent;
+		return std::min(size_t(std::max(bin, 0.f)), numBins - 1);
+	};
+
+	std::vector<Bin> bins(numBins);
+	// rightAabbs[i], rightCounts[i]: everything in bins [i, numBins)
+	std::vector<AABB> rightAabbs(numBins);
+	std::vector<uint32_t> rightCounts(numBins);
+	for (int axis = 0; axis < 3; ++axis) {
+		if (centroidAabb.bounds[1].axis(axis) - centroidAabb.bounds[0].axis(axis) <= 0.f) {
+			continue;
+		}
+		std::fill(bins.begin(), bins.end(), Bin{});
+		for (const SpatialRef& ref : refs) {
+			Bin& bin = bins[objectBinOf(axis, ref)];
+			bin.aabb.expand(ref.bounds);
+			++bin.count;
+		}
+
+		AABB accumulated = AABB::MakeEmpty();
+		uint32_t accumulatedCount = 0;
+		for (size_t i = numBins - 1; i > 0; --i) {
+			if (bins[i].count > 0) {
+				accumulated.expand(bins[i].aabb);
+				accumulatedCount += bins[i].count;
+			}
+			rightAabbs[i] = accumulated;
+			rightCounts[i] = accumulatedCount;
+		}
+
+		accumulated = AABB::MakeEmpty();
+		accumulatedCount = 0;
+		for (size_t plane = 1; plane < numBins; ++plane) {
+			if (bins[plane - 1].count > 0) {
+				accumulated.expand(bins[plane - 1].aabb);
+				accumulatedCount += bins[plane - 1].count;
+			}
+			if (accumulatedCount == 0 || rightCounts[plane] == 0) {
+				continue;
+			}
+			float cost = splitCost(accumulated.surfaceArea(), accumulatedCount, rightAabbs[plane].surfaceArea(), rightCounts[plane]);
+			if (cost < objectCost) {
+				objectAxis = axis;
+				objectPlane = plane;
+				objectCost = cost;
+				objectChildAabbs[0] = accumulated;
+				objectChildAabbs[1] = rightAabbs[plane];
+			}
+		}
+	}
+
+	// 2. Spatial split. Bins are slabs of the node. A reference is clipped to every slab it crosses,
+	// counted as entering the first one and leaving the last one.
+	// Clipping can lose a sliver to rounding, so a bin may count references and still have empty bounds
+	auto hasContent = [](const AABB& box) { return box.bounds[0].x <= box.bounds[1].x; };
+	struct SpatialBin {
+		AABB aabb = AABB::MakeEmpty();
+		uint32_t entries = 0;
+		uint32_t exits = 0;
+	};
+	int spatialAxis = -1;
+	float spatialPos = 0.f;
+	float spatialCost = std::numeric_limits<float>::max();
+	AABB spatialChildAabbs[2];
+	uint32_t spatialChildCounts[2] = { 0, 0 };
+
+	AABB objectOverlap = objectChildAabbs[0];
+	const bool trySpatial = refBudget > 0 && (objectAxis < 0 ||
+		(objectOverlap.intersectWith(objectChildAabbs[1]) && objectOverlap.surfaceArea() > context.minOverlapArea));
+	if (trySpatial) {
+		std::vector<SpatialBin> spatialBins(numBins);
+		std::vector<AABB> rightSpatialAabbs(numBins);
+		std::vector<uint32_t> rightExits(numBins);
+		for (int axis = 0; axis < 3; ++axis) {
+			const float lo = nodeAabb.bounds[0].axis(axis);
+			const float extent = nodeAabb.bounds[1].axis(axis) - lo;
+			if (extent <= 0.f) {
+				continue;
+			}
+			const float binWidth = extent / float(numBins);
+			auto binOf = [&](float pos) {
+				return std::min(size_t(std::max((pos - lo) / binWidth, 0.f)), numBins - 1);
+			};
+
+			std::fill(spatialBins.begin(), spatialBins.end(), SpatialBin{});
+			for (const SpatialRef& ref : refs) {
+				const size_t first = binOf(ref.bounds.bounds[0].axis(axis));
+				const size_t last = binOf(ref.bounds.bounds[1].axis(axis));
+				++spatialBins[first].entries;
+				++spatialBins[last].exits;
+				if (first == last) {
+					spatialBins[first].aabb.expand(ref.bounds);
+					continue;
+				}
+
+				const Triangle& tri = context.triangles[ref.triRef];
+				for (size_t bin = first; bin <= last; ++bin) {
+					AABB slab = ref.bounds;
+					slab.bounds[0].axis(axis) = std::max(slab.bounds[0].axis(axis), lo + binWidth * float(bin));
+					if (bin < last) {
+						slab.bounds[1].axis(axis) = std::min(slab.bounds[1].axis(axis), lo + binWidth * float(bin + 1));
+					}
+					AABB clipped;
+					if (slab.clipTriangle(context.vertices[tri.v[0]], context.vertices[tri.v[1]], context.vertices[tri.v[2]], clipped)) {
+						spatialBins[bin].aabb.expand(clipped);
+					}
+				}
+			}
+
+			AABB accumulated = AABB::MakeEmpty();
+			uint32_t accumulatedCount = 0;
+			for (size_t i = numBins - 1; i > 0; --i) {
+				if (hasContent(spatialBins[i].aabb)) {
+					accumulated.expand(spatialBins[i].aabb);
+				}
+				accumulatedCount += spatialBins[i].exits;
+				rightSpatialAabbs[i] = accumulated;
+				rightExits[i] = accumulatedCount;
+			}
+
+			accumulated = AABB::MakeEmpty();
+			accumulatedCount = 0;
+			for (size_t plane = 1; plane < numBins; ++plane) {
+				if (hasContent(spatialBins[plane - 1].aabb)) {
+					accumulated.expand(spatialBins[plane - 1].aabb);
+				}
+				accumulatedCount += spatialBins[plane - 1].entries;
+				if (accumulatedCount == 0 || rightExits[plane] == 0 ||
+					!hasContent(accumulated) || !hasContent(rightSpatialAabbs[plane])) {
+					continue;
+				}
+				float cost = splitCost(accumulated.surfaceArea(), accumulatedCount,
+					rightSpatialAabbs[plane].surfaceArea(), rightExits[plane]);
+				if (cost < spatialCost) {
+					spatialAxis = axis;
+					spatialPos = lo + binWidth * float(plane);
+					spatialCost = cost;
+					spatialChildAabbs[0] = accumulated;
+					spatialChildAabbs[1] = rightSpatialAabbs[plane];
+					spatialChildCounts[0] = accumulatedCount;
+					spatialChildCounts[1] = rightExits[plane];
+				}
+			}
+		}
+	}
+
+	// 0.2 Recursion Root 2. Stop if no split is cheaper than a leaf
+	float leafCost = settings.sahIntersectionCost * float(count);
+	if ((objectAxis < 0 && spatialAxis < 0) || std::min(objectCost, spatialCost) >= leafCost) {
+		makeLeaf();
+		return;
+	}
+
+	// 3. Distribute the references
+	std::vector<SpatialRef> leftRefs{};
+	std::vector<SpatialRef> rightRefs{};
+	auto objectPartition = [&]() {
+		for (const SpatialRef& ref : refs) {
+			(objectBinOf(objectAxis, ref) < objectPlane ? leftRefs : rightRefs).push_back(ref);
+		}
+	};
+	if (spatialCost < objectCost) {
+		// Straddling references are split, unless moving them whole to one child is cheaper ("unsplitting")
+		// or the budget is used up. The children start as if every straddler were split, and each decision updates them,
+		// so later references see the boxes and counts the earlier ones left behind
+		AABB childAabbs[2] = { spatialChildAabbs[0], spatialChildAabbs[1] };
+		float childCounts[2] = { float(spatialChildCounts[0]), float(spatialChildCounts[1]) };
+		for (const SpatialRef& ref : refs) {
+			const float refLo = ref.bounds.bounds[0].axis(spatialAxis);
+			const float refHi = ref.bounds.bounds[1].axis(spatialAxis);
+			if (refLo >= spatialPos) {
+				rightRefs.push_back(ref);
+				continue;
+			}
+			if (refHi <= spatialPos) {
+				leftRefs.push_back(ref);
+				continue;
+			}
+
+			const float leftArea = childAabbs[0].surfaceArea();
+			const float rightArea = childAabbs[1].surfaceArea();
+			const float duplicateCost = leftArea * childCounts[0] + rightArea * childCounts[1];
+			AABB leftUnion = childAabbs[0];
+			leftUnion.expand(ref.bounds);
+			AABB rightUnion = childAabbs[1];
+			rightUnion.expand(ref.bounds);
+			const float leftOnlyCost = leftUnion.surfaceArea() * childCounts[0] + rightArea * (childCounts[1] - 1.f);
+			const float rightOnlyCost = leftArea * (childCounts[0] - 1.f) + rightUnion.surfaceArea() * childCounts[1];
+			if (refBudget == 0 || std::min(leftOnlyCost, rightOnlyCost) < duplicateCost) {
+				const int side = leftOnlyCost <= rightOnlyCost ? 0 : 1;
+				(side == 0 ? leftRefs : rightRefs).push_back(ref);
+				childAabbs[side] = side == 0 ? leftUnion : rightUnion;
+				childCounts[1 - side] -= 1.f;
+				continue;
+			}
+
+			const Triangle& tri = context.triangles[ref.triRef];
+			SpatialRef halves[2] = { ref, ref };
+			halves[0].bounds.bounds[1].axis(spatialAxis) = spatialPos;
+			halves[1].bounds.bounds[0].axis(spatialAxis) = spatialPos;
+			bool kept[2];
+			for (int side = 0; side < 2; ++side) {
+				const AABB slab = halves[side].bounds;
+				kept[side] = slab.clipTriangle(context.vertices[tri.v[0]], context.vertices[tri.v[1]], context.vertices[tri.v[2]],
+					halves[side].bounds);
+			}
+			if (kept[0] && kept[1]) {
+				leftRefs.push_back(halves[0]);
+				rightRefs.push_back(halves[1]);
+				--refBudget;
+			}
+			else {
+				// Clipping lost one side to rounding. Keep the whole reference on the other
+				const int side = kept[0] ? 0 : 1;
+				(side == 0 ? leftRefs : rightRefs).push_back(ref);
+				childAabbs[side].expand(ref.bounds);
+				childCounts[1 - side] -= 1.f;
+			}
+		}
+
+		if ((leftRefs.empty() || rightRefs.empty()) && objectAxis >= 0) {
+			// Unsplitting moved everything to one side. No reference was split, so the budget is untouched
+			leftRefs.clear();
+			rightRefs.clear();
+			objectPartition();
+			GSceneMetrics.record("SBVHSpatialSplitFallback");
+		}
+		else {
+			GSceneMetrics.record("SBVHSpatialSplit");
+		}
+	}
+	else {
+		objectPartition();
+	}
+	if (leftRefs.empty() || rightRefs.empty()) {
+		// Only a spatial split without an object split to fall back to: every centroid is in one place
+		makeLeaf();
+		return;
+	}
+	refs.clear();
+	refs.shrink_to_fit();
+
+	// 4. Create Children. Siblings are allocated next to each other
+	uint32_t childIdx = uint32_t(outNodes.size());
+	outNodes.emplace_back();
+	outNodes.emplace_back();
+	outNodes[nodeIdx].aabb = nodeAabb;
+	outNodes[nodeIdx].offset = childIdx;
+	outNodes[nodeIdx].triangleCount = 0;
+	buildSpatialRecursive(outNodes, outTriangleRefs, childIdx, std::move(leftRefs), context, refBudget, depth + 1);
+	buildSpatialRecursive(outNodes, outTriangleRefs, childIdx + 1, std::move(rightRefs), context, refBudget, depth + 1);
+}
+
+void BVH::appendSubtree(std::vector<BVHNode>& outNodes, uint32_t rootIdx, const std::vector<BVHNode>& subNodes)
+{
+	// subNodes[0] replaces outNodes[rootIdx]. subNodes[i] for i > 0 goes to nodeBase + i - 1.
+	// Leaves already reference the shared `triangleRefs`
+	const uint32_t nodeBase = uint32_t(outNodes.size());
+	auto rebase = [&](BVHNode node) {
+		if (!node.isLeaf()) {
+			node.offset = nodeBase + node.offset - 1;
+		}
+		return node;
+	};
+
+	outNodes[rootIdx] = rebase(subNodes[0]);
+	outNodes.reserve(outNodes.size() + subNodes.size() - 1);
+	for (size_t i = 1; i < subNodes.size(); ++i) {
+		outNodes.push_back(rebase(subNodes[i]));
+	}
+}
+
+void BVH::alignLeaves(size_t packWidth)
+{
+	// Leaves own disjoint ranges, so every leaf is moved once. Padding keeps the ranges disjoint for `refit`
+	std::vector<uint32_t> alignedRefs{};
+	alignedRefs.reserve(triangleRefs.size() + nodes.size() * (packWidth - 1));
+	for (BVHNode& node : nodes) {
+		if (!node.isLeaf()) {
+			continue;
+		}
+		const uint32_t offset = TrianglePacks::alignLeaf(alignedRefs, packWidth);
+		auto refsBegin = triangleRefs.begin() + node.offset;
+		alignedRefs.insert(alignedRefs.end(), refsBegin, refsBegin + node.triangleCount);
+		node.offset = offset;
+	}
+	TrianglePacks::alignLeaf(alignedRefs, packWidth);
+	triangleRefs = std::move(alignedRefs);
+}
+
+void BVH::buildPacks(const Scene& scene)
+{
+	packs.build(scene, triangleRefs, scene.settings->trianglePackWidth);
+}
+
+void BVH::writeCache(CacheWriter& writer) const
+{
+	writer.write<uint64_t>(width);
+	writer.write(spatialSplits);
+	writer.write(builtSahCost);
+	writer.writeVector(nodes);
+	writer.writeVector(nodes4);
+	writer.writeVector(nodes8);
+	writer.writeVector(quantizedNodes);
+	writer.writeVector(triangleRefs);
+}
+
+void BVH::readCache(CacheReader& reader)
+{
+	width = size_t(reader.read<uint64_t>());
+	spatialSplits = reader.read<bool>();
+	builtSahCost = reader.read<float>();
+	reader.readVector(nodes);
+	reader.readVector(nodes4);
+	reader.readVector(nodes8);
+	reader.readVector(quantizedNodes);
+	reader.readVector(triangleRefs);
+}
+
+BVH::json BVH::toJson() const
+{
+	if (nodes.empty()) {
+		return json{};
+	}
+	return toJsonRecursive(0);
+}
+
+BVH::json BVH::toJsonRecursive(uint32_t nodeIdx) const
+{
+	const BVHNode& node = nodes[nodeIdx];
+
+	json j{};
+	j["min"] = { node.aabb.bounds[0].x, node.aabb.bounds[0].y, node.aabb.bounds[0].z };
+	j["max"] = { node.aabb.bounds[1].x, node.aabb.bounds[1].y, node.aabb.bounds[1].z };
+
+	if (node.isLeaf()) {
+		auto refsBegin = triangleRefs.begin() + node.offset;
+		j["triangleRefs"] = std::vector<uint32_t>(refsBegin, refsBegin + node.triangleCount);
+		return j;
+	}
+
+	j["child0"] = toJsonRecursive(node.offset);
+	j["child1"] = toJsonRecursive(node.offset + 1);
+	return j;
+}
+
+std::string BVH::toString() const
+{
+	return toJson().dump(4);
+}
@@ -106,6 +106,13 @@ void CRTSceneIO::parseSettings(const json& j, Scene& scene, const Settings& sett
 
     if (scene.useSkybox) scene.ambientLightColor = scene.skybox.calculateAmbientColor();
     else { scene.ambientLightColor = scene.bgColor; }
+
+    if (jSettings.contains("accel_structure")) {
+        scene.accelStructType = Settings::AccelStructTypeFromString(jSettings.at("accel_structure"));
+    }
+    if (jSettings.contains("bvh_builder")) {
+        scene.bvhBuilder = Settings::BVHBuilderFromString(jSettings.at("bvh_builder"));
+    }
 }
 
 void CRTSceneIO::parseImageSettings(const json& j, Scene& scene, const Settings& settings)
@@ -223,6 +230,11 @@ Vec3 CRTSceneIO::Vec3FromJson(const json& j) {
 void CRTSceneIO::parseObjects(const json& j, Scene& scene) {
     const auto& jObjects = j.at("objects");
     for (const auto& jObj : jObjects) {
+        if (jObj.contains("instance_of")) {
+            parseInstance(jObj, scene);
+            continue;
+        }
+
         std::vector<Vec3> vertices;
         std::vector<Triangle> triangles;
         std::vector<Vec3> uvs;
@@ -238,7 +250,31 @@ void CRTSceneIO::parseObjects(const json& j, Scene& scene) {
         parseUvs(jObj, vertices.size(), uvs);
 
         assert(triangles.size() > 0);
-        scene.addObject(vertices, triangles, uvs);
+        MeshObject& meshObject = scene.addObject(vertices, triangles, uvs);
+        parsePlacement(jObj, meshObject.pos, meshObject.mat);
+    }
+}
+
+void CRTSceneIO::parseInstance(const json& jObj, Scene& scene)
+{
+    size_t sourceIdx = jObj.at("instance_of");
+    if (sourceIdx >= scene.meshObjects.size()) {
+        throw std::runtime_error("Error loading instance: instance_of must reference an earlier object");
+    }
+
+    Vec3 pos{ 0.f, 0.f, 0.f };
+    Matrix3x3 mat = Matrix3x3::identity();
+    parsePlacement(jObj, pos, mat);
+    scene.addInstance(sourceIdx, pos, mat);
+}
+
+void CRTSceneIO::parsePlacement(const json& jObj, Vec3& pos, Matrix3x3& mat)
+{
+    if (jObj.contains("position")) {
+        pos = Vec3FromJson(jObj.at("position"));
+    }
+    if (jObj.contains("matrix")) {
+        mat = Matrix3x3{ jObj.at("matrix").get<std::vector<float>>() };
     }
 }
 
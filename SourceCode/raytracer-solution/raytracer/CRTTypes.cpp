@@ -132,6 +132,35 @@ bool Matrix3x3::isOrthonormal() const {
     return unitVectors && perpendicular;
 }
 
+Matrix3x3 Matrix3x3::transposed() const {
+    Matrix3x3 result;
+    for (size_t row = 0; row < 3; ++row) {
+        for (size_t col = 0; col < 3; ++col) {
+            result(row, col) = (*this)(col, row);
+        }
+    }
+    return result;
+}
+
+Matrix3x3 Matrix3x3::inverse() const {
+    const Matrix3x3& m = *this;
+    // Cofactors of the first row, reused for the determinant
+    float c00 = m(1, 1) * m(2, 2) - m(1, 2) * m(2, 1);
+    float c01 = m(1, 2) * m(2, 0) - m(1, 0) * m(2, 2);
+    float c02 = m(1, 0) * m(2, 1) - m(1, 1) * m(2, 0);
+    float det = m(0, 0) * c00 + m(0, 1) * c01 + m(0, 2) * c02;
+    if (std::abs(det) < 1e-12f) {
+        throw std::runtime_error("Matrix3x3::inverse: matrix is singular");
+    }
+
+    float invDet = 1.f / det;
+    return Matrix3x3{ {
+        c00 * invDet, (m(0, 2) * m(2, 1) - m(0, 1) * m(2, 2)) * invDet, (m(0, 1) * m(1, 2) - m(0, 2) * m(1, 1)) * invDet,
+        c01 * invDet, (m(0, 0) * m(2, 2) - m(0, 2) * m(2, 0)) * invDet, (m(0, 2) * m(1, 0) - m(0, 0) * m(1, 2)) * invDet,
+        c02 * invDet, (m(0, 1) * m(2, 0) - m(0, 0) * m(2, 1)) * invDet, (m(0, 0) * m(1, 1) - m(0, 1) * m(1, 0)) * invDet,
+    } };
+}
+
 
 /* For more, read https://leimao.github.io/blog/CPP-Float-Point-Number-Comparison/ */
 void assertFEqual(float a, float b, float atol) {
@@ -56,6 +56,12 @@ void Camera::emplaceTask(size_t maxX, size_t maxY, size_t x, size_t y, std::queu
     queue.emplace(ray, x, y);
 }
 
+void Camera::emplaceTask(size_t maxX, size_t maxY, size_t x, size_t y, std::vector<TraceTask>& tasks) const
+{
+    Ray ray = rayFromPixel(maxX, maxY, x, y);
+    tasks.emplace_back(ray, x, y);
+}
+
 Ray Camera::rayFromPixel(size_t maxX, size_t maxY, size_t x, size_t y) const {
     Vec3 coords{ static_cast<float>(x), static_cast<float>(y), 0 };
     ndcFromRaster(maxX, maxY, coords);
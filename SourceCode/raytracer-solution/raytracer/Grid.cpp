@@ -0,0 +1,255 @@
+#include "include/Grid.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "json.hpp"
+
+#include "include/TraceHit.h"
+#include "include/CRTTypes.h"
+#include "include/Scene.h"
+#include "include/Settings.h"
+#include "include/SceneCache.h"
+#include "include/Mailbox.h"
+
+void Grid::build(const std::vector<uint32_t>& newTriangleRefs, const std::vector<AABB>& cacheTriangleAABBs, const Settings& settings)
+{
+	cells.clear();
+	triangleRefs.clear();
+	resolution = { 0, 0, 0 };
+	aabb = AABB::MakeEmpty();
+	for (uint32_t triRef : newTriangleRefs) {
+		aabb.expand(cacheTriangleAABBs[triRef]);
+	}
+	if (newTriangleRefs.empty()) {
+		return;
+	}
+
+	// Cells are as close to cubes as the bounds allow. Flat axes get one cell, the others share the cell budget
+	const Vec3 extent = aabb.bounds[1] - aabb.bounds[0];
+	const float maxExtent = std::max({ extent.x, extent.y, extent.z });
+	float volume = 1.f;
+	int activeAxes = 0;
+	for (int axis = 0; axis < 3; ++axis) {
+		if (extent.axis(axis) > maxExtent * flatAxisRatio) {
+			volume *= extent.axis(axis);
+			++activeAxes;
+		}
+	}
+	const float targetCells = std::max(settings.gridDensity * float(newTriangleRefs.size()), 1.f);
+	const float cellsPerUnit = activeAxes > 0 ? std::pow(targetCells / volume, 1.f / float(activeAxes)) : 0.f;
+	for (int axis = 0; axis < 3; ++axis) {
+		const bool active = extent.axis(axis) > maxExtent * flatAxisRatio;
+		const float cellCount = active ? std::round(extent.axis(axis) * cellsPerUnit) : 1.f;
+		resolution[axis] = uint32_t(std::clamp(cellCount, 1.f, float(maxResolution)));
+		cellSize.axis(axis) = extent.axis(axis) / float(resolution[axis]);
+		invCellSize.axis(axis) = resolution[axis] > 1 ? 1.f / cellSize.axis(axis) : 0.f;
+	}
+	cells.resize(size_t(resolution[0]) * resolution[1] * resolution[2]);
+
+	// A triangle goes into every cell its AABB overlaps. Both passes walk the same cell ranges
+	auto forEachCell = [&](const AABB& triAabb, auto&& f) {
+		const uint32_t x0 = cellCoord(triAabb.bounds[0].x, 0), x1 = cellCoord(triAabb.bounds[1].x, 0);
+		const uint32_t y0 = cellCoord(triAabb.bounds[0].y, 1), y1 = cellCoord(triAabb.bounds[1].y, 1);
+		const uint32_t z0 = cellCoord(triAabb.bounds[0].z, 2), z1 = cellCoord(triAabb.bounds[1].z, 2);
+		for (uint32_t z = z0; z <= z1; ++z) {
+			for (uint32_t y = y0; y <= y1; ++y) {
+				for (uint32_t x = x0; x <= x1; ++x) {
+					f(cells[cellIdx(x, y, z)]);
+				}
+			}
+		}
+	};
+
+	// 1. Count
+	for (uint32_t triRef : newTriangleRefs) {
+		forEachCell(cacheTriangleAABBs[triRef], [](Cell& cell) { ++cell.count; });
+	}
+
+	// 2. Place. Cells start on a pack boundary, like kd-tree leaves. See `TrianglePacks::alignLeaf`
+	const uint32_t packWidth = uint32_t(settings.trianglePackWidth);
+	uint32_t refCount = 0;
+	for (Cell& cell : cells) {
+		if (cell.count > 0) {
+			refCount = (refCount + packWidth - 1) / packWidth * packWidth;
+		}
+		cell.offset = refCount;
+		refCount += cell.count;
+		cell.count = 0;
+	}
+	triangleRefs.resize((refCount + packWidth - 1) / packWidth * packWidth, 0);
+
+	// 3. Fill. `count` is the fill cursor, it ends at the counted size
+	for (uint32_t triRef : newTriangleRefs) {
+		forEachCell(cacheTriangleAABBs[triRef], [&](Cell& cell) { triangleRefs[cell.offset + cell.count++] = triRef; });
+	}
+}
+
+uint32_t Grid::cellCoord(float value, int axis) const
+{
+	const float coord = (value - aabb.bounds[0].axis(axis)) * invCellSize.axis(axis);
+	return std::min(uint32_t(std::max(coord, 0.f)), resolution[axis] - 1);
+}
+
+template <typename Visit>
+void Grid::walkCells(const Ray& ray, float tEntry, float tExit, Visit&& visit) const
+{
+	// Amanatides & Woo. tNext: where the ray crosses the next cell boundary on each axis. tDelta: the width of a cell along the ray
+	const Vec3 entry = ray.origin + ray.getDirection() * tEntry;
+	std::array<uint32_t, 3> cell;
+	std::array<float, 3> tNext;
+	std::array<float, 3> tDelta;
+	std::array<int, 3> step;
+	for (int axis = 0; axis < 3; ++axis) {
+		cell[axis] = cellCoord(entry.axis(axis), axis);
+		const float dir = ray.getDirection().axis(axis);
+		if (dir == 0.f || resolution[axis] == 1) {
+			// The ray leaves the grid before it leaves the cell on this axis
+			step[axis] = 0;
+			tNext[axis] = std::numeric_limits<float>::max();
+			tDelta[axis] = 0.f;
+			continue;
+		}
+		step[axis] = dir > 0.f ? 1 : -1;
+		const uint32_t boundary = dir > 0.f ? cell[axis] + 1 : cell[axis];
+		const float boundaryPos = aabb.bounds[0].axis(axis) + float(boundary) * cellSize.axis(axis);
+		tNext[axis] = (boundaryPos - ray.origin.axis(axis)) * ray.invdir.axis(axis);
+		tDelta[axis] = cellSize.axis(axis) * std::abs(ray.invdir.axis(axis));
+	}
+
+	ScopedCounter cellVisits{ GSceneMetrics, "GridCellVisit" };
+	while (true) {
+		const int axis = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+		cellVisits.increment();
+		if (visit(cellIdx(cell[0], cell[1], cell[2]), std::min(tNext[axis], tExit)) || tNext[axis] > tExit) {
+			return;
+		}
+		if ((step[axis] > 0 && cell[axis] + 1 == resolution[axis]) || (step[axis] < 0 && cell[axis] == 0)) {
+			return;
+		}
+		cell[axis] += step[axis];
+		tNext[axis] += tDelta[axis];
+	}
+}
+
+void Grid::traverse(const Scene& scene, const Ray& ray, TraceHit& out) const
+{
+	out.t = std::numeric_limits<float>::max();
+	out.type = TraceHitType::OUT_OF_BOUNDS;
+	float tEntry, tExit;
+	if (cells.empty() || !aabb.hasIntersection(ray, out.t, tEntry, tExit)) {
+		return;
+	}
+
+	Mailbox mailbox{};
+	ScopedCounter packTests{ GSceneMetrics, "TrianglePackIntersection" };
+	walkCells(ray, tEntry, tExit, [&](uint32_t idx, float tCellExit) {
+		intersectCell(scene, ray, cells[idx], mailbox, packTests, out);
+		// Hits beyond the cell are kept, but a closer one may still lie in the next cells
+		return out.successful() && out.t <= tCellExit;
+	});
+}
+
+bool Grid::isOccluded(const Scene& scene, const Vec3& start, const Vec3& end) const
+{
+	if (cells.empty()) {
+		return false;
+	}
+
+	Vec3 dir = end - start;
+	const float maxT = dir.length();
+	dir.normalize();
+	const Ray ray{ start, dir };
+	float tEntry, tExit;
+	if (!aabb.hasIntersection(ray, maxT, tEntry, tExit)) {
+		return false;
+	}
+
+	bool occluded = false;
+	Mailbox mailbox{};
+	walkCells(ray, tEntry, tExit, [&](uint32_t idx, float) {
+		const Cell& cell = cells[idx];
+		for (uint32_t i = cell.offset; i < cell.offset + cell.count; ++i) {
+			const uint32_t triRef = triangleRefs[i];
+			if (mailbox.checkAndRecord(triRef)) {
+				continue;
+			}
+			const Triangle& tri = scene.triangles[triRef];
+			if (scene.materials[tri.materialIndex].occludes && tri.fastIntersect(scene, start, end)) {
+				occluded = true;
+				return true;
+			}
+		}
+		return false;
+	});
+	return occluded;
+}
+
+void Grid::intersectCell(const Scene& scene, const Ray& ray, const Cell& cell, Mailbox& mailbox, ScopedCounter& packTests,
+	TraceHit& out) const
+{
+	if (packs.getWidth() > 1) {
+		packs.intersectLeaf(scene, ray, cell.offset, cell.count, out, packTests, &mailbox);
+		return;
+	}
+
+	for (uint32_t i = cell.offset; i < cell.offset + cell.count; ++i) {
+		const uint32_t triRef = triangleRefs[i];
+		if (mailbox.checkAndRecord(triRef)) {
+			continue;
+		}
+		TraceHit tryHit{};
+		tryHit.t = out.t;
+		scene.triangles[triRef].intersect(scene, ray, triRef, tryHit);
+		if (tryHit.successful() && tryHit.t < out.t) {
+			out = tryHit;
+		}
+	}
+}
+
+void Grid::buildPacks(const Scene& scene)
+{
+	packs.build(scene, triangleRefs, scene.settings->trianglePackWidth);
+}
+
+void Grid::writeCache(CacheWriter& writer) const
+{
+	writer.write(aabb);
+	writer.write(resolution);
+	writer.write(cellSize);
+	writer.write(invCellSize);
+	writer.writeVector(cells);
+	writer.writeVector(triangleRefs);
+}
+
+void Grid::readCache(CacheReader& reader)
+{
+	aabb = reader.read<AABB>();
+	resolution = reader.read<std::array<uint32_t, 3>>();
+	cellSize = reader.read<Vec3>();
+	invCellSize = reader.read<Vec3>();
+	reader.readVector(cells);
+	reader.readVector(triangleRefs);
+	if (cells.size() != size_t(resolution[0]) * resolution[1] * resolution[2]) {
+		throw std::runtime_error("Grid::readCache: cell count does not match the resolution");
+	}
+}
+
+Grid::json Grid::toJson() const
+{
+	json j{};
+	j["min"] = { aabb.bounds[0].x, aabb.bounds[0].y, aabb.bounds[0].z };
+	j["max"] = { aabb.bounds[1].x, aabb.bounds[1].y, aabb.bounds[1].z };
+	j["resolution"] = resolution;
+	size_t emptyCells = 0;
+	uint32_t maxCellCount = 0;
+	for (const Cell& cell : cells) {
+		emptyCells += cell.count == 0 ? 1 : 0;
+		maxCellCount = std::max(maxCellCount, cell.count);
+	}
+	j["emptyCells"] = emptyCells;
+	j["maxCellTriangles"] = maxCellCount;
+	j["triangleRefs"] = triangleRefs.size();
+	return j;
+}
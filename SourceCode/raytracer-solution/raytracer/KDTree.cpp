@@ -0,0 +1,822 @@
+#include "include/KDTree.h"
+
+#include <algorithm>
+
+#include "json.hpp"
+
+#include "include/TraceHit.h"
+#include "include/CRTTypes.h"
+#include "include/Scene.h"
+#include "include/Settings.h"
+#include "include/ThreadPool.h"
+#include "include/SceneCache.h"
+#include "include/RayPacket.h"
+#include "include/Mailbox.h"
+#include "include/NodeLayout.h"
+
+void KDTree::build(std::vector<uint32_t>&& newTriangleRefs, const std::vector<AABB>& cacheTriangleAABBs,
+	const std::vector<Triangle>& triangles, const std::vector<Vec3>& vertices, const Settings& settings, ThreadPool& pool)
+{
+	nodes.clear();
+	triangleRefs.clear();
+	leafRopes.clear();
+	lazySubtrees.clear();
+	triangleRefs.reserve(newTriangleRefs.size());
+
+	aabb = AABB::MakeEmpty();
+	std::vector<BuildRef> buildRefs{};
+	buildRefs.reserve(newTriangleRefs.size());
+	for (const uint32_t& ref : newTriangleRefs) {
+		aabb.expand(cacheTriangleAABBs[ref]);
+		buildRefs.push_back({ ref, cacheTriangleAABBs[ref] });
+	}
+	newTriangleRefs.clear();
+
+	std::mutex lazyMutex;
+	const BuildContext context{ triangles, vertices, settings, pool, settings.kdTreeLazyDepth, lazySubtrees, lazyMutex };
+	buildNodes(std::move(buildRefs), context, 0);
+}
+
+void KDTree::buildNodes(std::vector<BuildRef>&& buildRefs, const BuildContext& context, size_t depth)
+{
+	nodes.emplace_back();
+	buildRecursive(nodes, triangleRefs, 0, aabb, std::move(buildRefs), context, depth);
+	if (context.settings.trianglePackWidth > 1) {
+		alignLeaves(context.settings.trianglePackWidth);
+	}
+	if (context.settings.kdTreeRopes) {
+		buildRopes();
+	}
+}
+
+const KDTree& KDTree::buildLazySubtree(const Scene& scene, LazySubtree& subtree)
+{
+	std::call_once(subtree.built, [&]() {
+		GSceneMetrics.record("KDTreeLazySubtreeBuild");
+		// Runs on a render thread. The other render threads are busy, so the subtree is built serially
+		ThreadPool serial{ 0 };
+		std::unique_ptr<KDTree> tree = std::make_unique<KDTree>();
+		tree->aabb = subtree.aabb;
+		std::mutex lazyMutex;
+		const BuildContext context{ scene.triangles, scene.vertices, *scene.settings, serial, 0, tree->lazySubtrees, lazyMutex };
+		tree->buildNodes(std::move(subtree.refs), context, subtree.depth);
+		if (scene.settings->reorderNodes) {
+			tree->reorderNodes();
+		}
+		tree->buildPacks(scene);
+		subtree.refs = {};
+		subtree.tree = std::move(tree);
+	});
+	return *subtree.tree;
+}
+
+void KDTree::reorderNodes()
+{
+	if (nodes.empty()) {
+		return;
+	}
+
+	std::vector<uint32_t> firstChild(nodes.size());
+	for (size_t i = 0; i < nodes.size(); ++i) {
+		firstChild[i] = nodes[i].isLeaf() ? NodeLayout::noChild : nodes[i].getChildIdx();
+	}
+	const std::vector<uint32_t> newIdx = NodeLayout::treeletOrder(firstChild, sizeof(KDTreeNode));
+
+	std::vector<KDTreeNode> reordered(nodes.size());
+	for (size_t i = 0; i < nodes.size(); ++i) {
+		const KDTreeNode& node = nodes[i];
+		reordered[newIdx[i]] = node.isLeaf() ? node
+			: KDTreeNode::MakeInterior(node.getAxis(), node.getSplitPos(), newIdx[node.getChildIdx()]);
+	}
+	nodes = std::move(reordered);
+
+	// Ropes hold node indices, building them again is cheaper than remapping every face
+	if (!leafRopes.empty()) {
+		buildRopes();
+	}
+}
+
+void KDTree::buildRopes()
+{
+	leafRopes.assign(nodes.size(), LeafRopes{});
+	std::array<uint32_t, 6> ropes;
+	ropes.fill(noRope);
+	buildRopesRecursive(0, aabb, ropes);
+}
+
+void KDTree::buildRopesRecursive(uint32_t nodeIdx, const AABB& nodeAabb, std::array<uint32_t, 6> ropes)
+{
+	for (int face = 0; face < 6; ++face) {
+		ropes[face] = optimizeRope(ropes[face], face, nodeAabb);
+	}
+
+	const KDTreeNode& node = nodes[nodeIdx];
+	if (node.isLeaf()) {
+		leafRopes[nodeIdx] = { nodeAabb, ropes };
+		return;
+	}
+
+	// The children are each other's neighbour across the split plane
+	int axis = node.getAxis();
+	AABB childAabbs[2] = { nodeAabb, nodeAabb };
+	childAabbs[0].bounds[1].axis(axis) = node.getSplitPos();
+	childAabbs[1].bounds[0].axis(axis) = node.getSplitPos();
+	std::array<uint32_t, 6> lowerRopes = ropes;
+	lowerRopes[2 * axis + 1] = node.getChildIdx() + 1;
+	std::array<uint32_t, 6> upperRopes = ropes;
+	upperRopes[2 * axis] = node.getChildIdx();
+
+	buildRopesRecursive(node.getChildIdx(), childAabbs[0], lowerRopes);
+	buildRopesRecursive(node.getChildIdx() + 1, childAabbs[1], upperRopes);
+}
+
+uint32_t KDTree::optimizeRope(uint32_t ropeIdx, int face, const AABB& nodeAabb) const
+{
+	const int faceAxis = face / 2;
+	const int faceSide = face % 2;
+	while (ropeIdx != noRope && !nodes[ropeIdx].isLeaf()) {
+		const KDTreeNode& target = nodes[ropeIdx];
+		const int axis = target.getAxis();
+		const float splitPos = target.getSplitPos();
+		if (axis == faceAxis) {
+			// Parallel to the face. Only the child on the face's side touches it
+			ropeIdx = target.getChildIdx() + (faceSide == 0 ? 1 : 0);
+		}
+		else if (splitPos <= nodeAabb.bounds[0].axis(axis)) {
+			ropeIdx = target.getChildIdx() + 1;
+		}
+		else if (splitPos >= nodeAabb.bounds[1].axis(axis)) {
+			ropeIdx = target.getChildIdx();
+		}
+		else {
+			break; // the split plane cuts the face, both children are neighbours
+		}
+	}
+	return ropeIdx;
+}
+
+void KDTree::alignLeaves(size_t packWidth)
+{
+	std::vector<uint32_t> alignedRefs{};
+	alignedRefs.reserve(triangleRefs.size() + nodes.size() * (packWidth - 1));
+	for (KDTreeNode& node : nodes) {
+		if (!node.isLeaf() || node.isLazy()) {
+			continue;
+		}
+		const uint32_t offset = TrianglePacks::alignLeaf(alignedRefs, packWidth);
+		auto refsBegin = triangleRefs.begin() + node.getTriangleOffset();
+		alignedRefs.insert(alignedRefs.end(), refsBegin, refsBegin + node.getTriangleCount());
+		node = KDTreeNode::MakeLeaf(offset, node.getTriangleCount());
+	}
+	TrianglePacks::alignLeaf(alignedRefs, packWidth);
+	triangleRefs = std::move(alignedRefs);
+}
+
+void KDTree::buildPacks(const Scene& scene)
+{
+	packs.build(scene, triangleRefs, scene.settings->trianglePackWidth);
+	for (const std::unique_ptr<LazySubtree>& subtree : lazySubtrees) {
+		if (subtree->tree) {
+			subtree->tree->buildPacks(scene);
+		}
+	}
+}
+
+void KDTree::traverse(const Scene& scene, const Ray& ray, TraceHit& out) const {
+	Mailbox mailbox{};
+	traverse(scene, ray, mailbox, out);
+}
+
+void KDTree::traverse(const Scene& scene, const Ray& ray, Mailbox& mailbox, TraceHit& out) const {
+	out.t = std::numeric_limits<float>::max();
+	out.type = TraceHitType::OUT_OF_BOUNDS;
+	float tNear, tFar;
+	if (nodes.empty() || !aabb.hasIntersection(ray, out.t, tNear, tFar)) {
+		return;
+	}
+	if (!leafRopes.empty()) {
+		traverseRopes(scene, ray, tNear, tFar, mailbox, out);
+		return;
+	}
+
+	struct StackEntry {
+		uint32_t nodeIdx;
+		/* Part of the ray inside the node */
+		float tNear;
+		float tFar;
+	};
+	// Only far children are pushed, at most one per level
+	std::array<StackEntry, maxDepth + 1> stack;
+	size_t stackSize = 0;
+	uint32_t nodeIdx = 0;
+	/* 0: reached through near children only, 1: a far child was popped. See TraceHit::kdtreeIdx */
+	uint32_t childSlot = 0;
+	ScopedCounter nodeVisits{ GSceneMetrics, "KDTreeNodeVisit" };
+	ScopedCounter packTests{ GSceneMetrics, "TrianglePackIntersection" };
+
+	while (true) {
+		// Descend to the leaf containing tNear. Split the ray interval at every plane it crosses
+		const KDTreeNode* node = &nodes[nodeIdx];
+		while (!node->isLeaf()) {
+			nodeVisits.increment();
+			int axis = node->getAxis();
+			float splitPos = node->getSplitPos();
+			float origin = ray.origin.axis(axis);
+			float tSplit = (splitPos - origin) * ray.invdir.axis(axis);
+
+			// The near child is the one on the origin's side of the plane
+			bool belowFirst = origin < splitPos || (origin == splitPos && ray.getDirection().axis(axis) <= 0.f);
+			uint32_t nearIdx = node->getChildIdx() + (belowFirst ? 0 : 1);
+			uint32_t farIdx = node->getChildIdx() + (belowFirst ? 1 : 0);
+
+			if (!(tSplit > 0.f) || tSplit > tFar) {
+				nodeIdx = nearIdx; // the interval ends before the plane (or the ray moves away from it)
+			}
+			else if (tSplit < tNear) {
+				nodeIdx = farIdx; // the interval starts behind the plane
+			}
+			else {
+				stack[stackSize++] = { farIdx, tSplit, tFar };
+				nodeIdx = nearIdx;
+				tFar = tSplit;
+			}
+			node = &nodes[nodeIdx];
+		}
+
+		nodeVisits.increment();
+		intersectLeaf(scene, ray, *node, mailbox, packTests, out);
+		// Leaves are visited front to back. Nothing in the remaining leaves can be closer than a hit inside this one
+		if (out.successful() && out.t <= tFar) {
+			out.kdtreeIdx = childSlot;
+			return;
+		}
+
+		if (stackSize == 0) {
+			if (out.successful()) {
+				out.kdtreeIdx = childSlot;
+			}
+			return;
+		}
+		const StackEntry entry = stack[--stackSize];
+		if (out.successful() && out.t <= entry.tNear) {
+			out.kdtreeIdx = childSlot;
+			return;
+		}
+		nodeIdx = entry.nodeIdx;
+		tNear = entry.tNear;
+		tFar = entry.tFar;
+		childSlot = 1;
+	}
+}
+
+void KDTree::traverseRopes(const Scene& scene, const Ray& ray, float tEntry, float tExit, Mailbox& mailbox, TraceHit& out) const
+{
+	uint32_t nodeIdx = 0;
+	ScopedCounter leafVisits{ GSceneMetrics, "KDTreeRopeLeafVisit" };
+	ScopedCounter packTests{ GSceneMetrics, "TrianglePackIntersection" };
+	while (true) {
+		// Only the subtree behind the last rope is descended, not the whole tree
+		nodeIdx = locateLeaf(nodeIdx, ray.origin + ray.getDirection() * tEntry, ray.getDirection());
+		const LeafRopes& leaf = leafRopes[nodeIdx];
+		leafVisits.increment();
+		intersectLeaf(scene, ray, nodes[nodeIdx], mailbox, packTests, out);
+
+		// The ray leaves through the closest of the three faces ahead of it
+		float tLeafExit = std::numeric_limits<float>::max();
+		int exitFace = -1;
+		for (int axis = 0; axis < 3; ++axis) {
+			const int side = 1 - ray.sign[axis];
+			const float t = (leaf.aabb.bounds[side].axis(axis) - ray.origin.axis(axis)) * ray.invdir.axis(axis);
+			if (t < tLeafExit) {
+				tLeafExit = t;
+				exitFace = 2 * axis + side;
+			}
+		}
+
+		// Leaves are visited front to back, like in `traverse`
+		if (out.successful() && out.t <= tLeafExit) {
+			return;
+		}
+		if (exitFace < 0 || tLeafExit >= tExit) {
+			return;
+		}
+		nodeIdx = leaf.ropes[exitFace];
+		if (nodeIdx == noRope) {
+			return;
+		}
+		tEntry = std::max(tEntry, tLeafExit);
+	}
+}
+
+uint32_t KDTree::locateLeaf(uint32_t nodeIdx, const Vec3& p, const Vec3& dir) const
+{
+	while (!nodes[nodeIdx].isLeaf()) {
+		const KDTreeNode& node = nodes[nodeIdx];
+		int axis = node.getAxis();
+		float splitPos = node.getSplitPos();
+		bool below = p.axis(axis) < splitPos || (p.axis(axis) == splitPos && dir.axis(axis) <= 0.f);
+		nodeIdx = node.getChildIdx() + (below ? 0 : 1);
+	}
+	return nodeIdx;
+}
+
+void KDTree::traversePacket(const Scene& scene, const RayPacket& packet, TraceHit* outHits) const
+{
+	std::vector<Mailbox> mailboxes(packet.getRays().size());
+	traversePacket(scene, packet, mailboxes.data(), outHits);
+}
+
+void KDTree::traversePacket(const Scene& scene, const RayPacket& packet, Mailbox* mailboxes, TraceHit* outHits) const
+{
+	const std::vector<Ray>& rays = packet.getRays();
+	for (size_t i = 0; i < rays.size(); ++i) {
+		outHits[i].t = std::numeric_limits<float>::max();
+		outHits[i].type = TraceHitType::OUT_OF_BOUNDS;
+	}
+	if (nodes.empty()) {
+		return;
+	}
+
+	struct StackEntry {
+		uint32_t nodeIdx;
+		AABB aabb;
+	};
+	// Like `isOccluded`, but the far child is pushed first, so the packet visits nodes front to back along its common direction
+	std::array<StackEntry, maxDepth + 1> stack;
+	size_t stackSize = 0;
+	stack[stackSize++] = { 0, aabb };
+	/* Farthest hit of any ray. Nodes beyond it cannot improve a hit */
+	float packetMaxT = std::numeric_limits<float>::max();
+	ScopedCounter nodeVisits{ GSceneMetrics, "KDTreePacketNodeVisit" };
+	ScopedCounter packTests{ GSceneMetrics, "TrianglePackIntersection" };
+
+	while (stackSize > 0) {
+		const StackEntry entry = stack[--stackSize];
+		nodeVisits.increment();
+		if (!packet.mayHit(entry.aabb, packetMaxT)) {
+			continue;
+		}
+
+		const KDTreeNode& node = nodes[entry.nodeIdx];
+		if (node.isLazy()) {
+			// The packet goes through the subtree as a whole. Intersecting the leaf per ray would lose the packet culling below it
+			std::vector<TraceHit> subtreeHits(rays.size());
+			buildLazySubtree(scene, *lazySubtrees[node.getLazyIdx()]).traversePacket(scene, packet, mailboxes, subtreeHits.data());
+			packetMaxT = 0.f;
+			for (size_t i = 0; i < rays.size(); ++i) {
+				if (subtreeHits[i].successful() && subtreeHits[i].t < outHits[i].t) {
+					outHits[i] = subtreeHits[i];
+				}
+				packetMaxT = std::max(packetMaxT, outHits[i].t);
+			}
+			continue;
+		}
+		if (node.isLeaf()) {
+			packetMaxT = 0.f;
+			for (size_t i = 0; i < rays.size(); ++i) {
+				float tEntry;
+				if (entry.aabb.hasIntersection(rays[i], outHits[i].t, tEntry)) {
+					intersectLeaf(scene, rays[i], node, mailboxes[i], packTests, outHits[i]);
+				}
+				packetMaxT = std::max(packetMaxT, outHits[i].t);
+			}
+			continue;
+		}
+
+		int axis = node.getAxis();
+		AABB childAabbs[2] = { entry.aabb, entry.aabb };
+		childAabbs[0].bounds[1].axis(axis) = node.getSplitPos();
+		childAabbs[1].bounds[0].axis(axis) = node.getSplitPos();
+		// Rays moving in the negative direction reach the upper child first
+		const uint32_t nearSlot = uint32_t(packet.getSign(axis));
+		stack[stackSize++] = { node.getChildIdx() + 1 - nearSlot, childAabbs[1 - nearSlot] };
+		stack[stackSize++] = { node.getChildIdx() + nearSlot, childAabbs[nearSlot] };
+	}
+}
+
+bool KDTree::isOccluded(const Scene& scene, const Vec3& start, const Vec3& end) const
+{
+	Mailbox mailbox{};
+	return isOccluded(scene, start, end, mailbox);
+}
+
+bool KDTree::isOccluded(const Scene& scene, const Vec3& start, const Vec3& end, Mailbox& mailbox) const
+{
+	if (nodes.empty()) {
+		return false;
+	}
+
+	Vec3 dir = end - start;
+	const float maxT = dir.length();
+	dir.normalize();
+	const Ray ray{ start, dir };
+
+	struct StackEntry {
+		uint32_t nodeIdx;
+		AABB aabb;
+	};
+	// Children are visited in any order, the first occluder ends the query
+	std::array<StackEntry, maxDepth + 1> stack;
+	size_t stackSize = 0;
+	stack[stackSize++] = { 0, aabb };
+
+	while (stackSize > 0) {
+		const StackEntry entry = stack[--stackSize];
+		float tEntry;
+		if (!entry.aabb.hasIntersection(ray, maxT, tEntry)) {
+			continue;
+		}
+
+		const KDTreeNode& node = nodes[entry.nodeIdx];
+		if (node.isLeaf()) {
+			if (leafOccludes(scene, node, start, end, mailbox)) {
+				return true;
+			}
+			continue;
+		}
+
+		int axis = node.getAxis();
+		AABB childAabbs[2] = { entry.aabb, entry.aabb };
+		childAabbs[0].bounds[1].axis(axis) = node.getSplitPos();
+		childAabbs[1].bounds[0].axis(axis) = node.getSplitPos();
+		stack[stackSize++] = { node.getChildIdx(), childAabbs[0] };
+		stack[stackSize++] = { node.getChildIdx() + 1, childAabbs[1] };
+	}
+	return false;
+}
+
+bool KDTree::leafOccludes(const Scene& scene, const KDTreeNode& leaf, const Vec3& start, const Vec3& end, Mailbox& mailbox) const
+{
+	if (leaf.isLazy()) {
+		return buildLazySubtree(scene, *lazySubtrees[leaf.getLazyIdx()]).isOccluded(scene, start, end, mailbox);
+	}
+
+	const uint32_t* refsBegin = triangleRefs.data() + leaf.getTriangleOffset();
+	const uint32_t* refsEnd = refsBegin + leaf.getTriangleCount();
+	for (const uint32_t* triRef = refsBegin; triRef != refsEnd; ++triRef) {
+		if (mailbox.checkAndRecord(*triRef)) {
+			continue;
+		}
+		const Triangle& tri = scene.triangles[*triRef];
+		if (scene.materials[tri.materialIndex].occludes && tri.fastIntersect(scene, start, end)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void KDTree::intersectLeaf(const Scene& scene, const Ray& ray, const KDTreeNode& leaf, Mailbox& mailbox, ScopedCounter& packTests,
+	TraceHit& out) const
+{
+	if (leaf.isLazy()) {
+		// The subtree shares this traversal's mailbox. Its triangle refs index the same scene triangles
+		TraceHit subtreeHit{};
+		buildLazySubtree(scene, *lazySubtrees[leaf.getLazyIdx()]).traverse(scene, ray, mailbox, subtreeHit);
+		if (subtreeHit.successful() && subtreeHit.t < out.t) {
+			out = subtreeHit;
+		}
+		return;
+	}
+
+	if (packs.getWidth() > 1) {
+		packs.intersectLeaf(scene, ray, leaf.getTriangleOffset(), leaf.getTriangleCount(), out, packTests, &mailbox);
+		return;
+	}
+
+	const uint32_t* refsBegin = triangleRefs.data() + leaf.getTriangleOffset();
+	const uint32_t* refsEnd = refsBegin + leaf.getTriangleCount();
+	for (const uint32_t* triRef = refsBegin; triRef != refsEnd; ++triRef) {
+		// A triangle tested in an earlier leaf either hit and is in `out` already, or missed
+		if (mailbox.checkAndRecord(*triRef)) {
+			continue;
+		}
+		const Triangle& tri = scene.triangles[*triRef];
+
+		TraceHit tryHit{};
+		tryHit.t = out.t;
+		tri.intersect(scene, ray, *triRef, tryHit);
+		// Hits behind the leaf are kept too. They are valid, and `traverse` only stops once a hit lies inside the leaf
+		if (tryHit.successful() && tryHit.t < out.t) {
+			out = tryHit;
+		}
+	}
+}
+
+void KDTree::buildRecursive(std::vector<KDTreeNode>& outNodes, std::vector<uint32_t>& outTriangleRefs,
+	uint32_t nodeIdx, const AABB& nodeAabb, std::vector<BuildRef>&& nodeRefs, const BuildContext& context, size_t depth)
+{
+	// Required: nodeRefs cross nodeAabb
+	const Settings& settings = context.settings;
+	ThreadPool& pool = context.pool;
+
+	auto makeLeaf = [&]() {
+		outNodes[nodeIdx] = KDTreeNode::MakeLeaf(uint32_t(outTriangleRefs.size()), uint32_t(nodeRefs.size()));
+		for (const BuildRef& ref : nodeRefs) {
+			outTriangleRefs.push_back(ref.triRef);
+		}
+	};
+
+	// 0.1 Recursion Root (Make Leaf)
+	size_t depthLimit = std::min(settings.accelTreeMaxDepth, maxDepth);
+	if (depth >= depthLimit || nodeRefs.size() <= settings.maxTrianglesPerLeaf) {
+		makeLeaf();
+		return;
+	}
+
+	// 0.2 Lazy build: keep what the split needs and build the node on first use.
+	// Checked before the SAH, which the first use runs anyway
+	if (context.lazyDepth > 0 && depth >= context.lazyDepth) {
+		std::unique_ptr<LazySubtree> subtree = std::make_unique<LazySubtree>();
+		subtree->aabb = nodeAabb;
+		subtree->refs = std::move(nodeRefs);
+		subtree->depth = depth;
+		std::lock_guard<std::mutex> lock(context.lazyMutex);
+		outNodes[nodeIdx] = KDTreeNode::MakeLazy(uint32_t(context.lazySubtrees.size()));
+		context.lazySubtrees.push_back(std::move(subtree));
+		return;
+	}
+
+	// 1. Split Triangles in 2 Groups (Potential Children Nodes)
+	// 1.1 Choose axisSplit and splitValue with the Surface Area Heuristic
+	SplitCandidate split = findSahSplit(nodeAabb, nodeRefs, context);
+
+	// 1.2 Recursion Root 2. Stop if AABB too small or if splitting is more expensive than a leaf
+	float leafCost = settings.sahIntersectionCost * float(nodeRefs.size());
+	if (split.axis < 0 || split.cost >= leafCost) {
+		makeLeaf();
+		return;
+	}
+
+	AABB childAabbs[2] = { nodeAabb, nodeAabb };
+	childAabbs[0].bounds[1].axis(split.axis) = split.pos;
+	childAabbs[1].bounds[0].axis(split.axis) = split.pos;
+
+	std::vector<BuildRef> refs0{};
+	std::vector<BuildRef> refs1{};
+	partitionTriangles(nodeRefs, split, childAabbs, context, refs0, refs1);
+	const bool fork = pool.getNumThreads() > 1 && nodeRefs.size() > settings.parallelBuildThreshold;
+	nodeRefs.clear();
+	nodeRefs.shrink_to_fit();
+
+	// 3. Else, Create Children. Siblings are allocated next to each other
+	uint32_t childIdx = uint32_t(outNodes.size());
+	outNodes.emplace_back();
+	outNodes.emplace_back();
+	outNodes[nodeIdx] = KDTreeNode::MakeInterior(split.axis, split.pos, childIdx);
+
+	if (!fork) {
+		buildRecursive(outNodes, outTriangleRefs, childIdx, childAabbs[0], std::move(refs0), context, depth + 1);
+		buildRecursive(outNodes, outTriangleRefs, childIdx + 1, childAabbs[1], std::move(refs1), context, depth + 1);
+		return;
+	}
+
+	// 4. Large node: build the second child on another thread. Both subtrees get their own arrays
+	std::vector<KDTreeNode> subNodes[2] = { std::vector<KDTreeNode>(1), std::vector<KDTreeNode>(1) };
+	std::vector<uint32_t> subTriangleRefs[2];
+	std::atomic<size_t> pending{ 1 };
+	pool.submit([&]() {
+		buildRecursive(subNodes[1], subTriangleRefs[1], 0, childAabbs[1], std::move(refs1), context, depth + 1);
+	}, pending);
+	buildRecursive(subNodes[0], subTriangleRefs[0], 0, childAabbs[0], std::move(refs0), context, depth + 1);
+	pool.wait(pending);
+
+	appendSubtree(outNodes, outTriangleRefs, childIdx, subNodes[0], subTriangleRefs[0]);
+	appendSubtree(outNodes, outTriangleRefs, childIdx + 1, subNodes[1], subTriangleRefs[1]);
+}
+
+void KDTree::appendSubtree(std::vector<KDTreeNode>& outNodes, std::vector<uint32_t>& outTriangleRefs, uint32_t rootIdx,
+	const std::vector<KDTreeNode>& subNodes, const std::vector<uint32_t>& subTriangleRefs)
+{
+	// subNodes[0] replaces outNodes[rootIdx]. subNodes[i] for i > 0 goes to nodeBase + i - 1
+	const uint32_t nodeBase = uint32_t(outNodes.size());
+	const uint32_t refBase = uint32_t(outTriangleRefs.size());
+	auto rebase = [&](const KDTreeNode& node) {
+		if (node.isLazy()) {
+			return node; // `lazySubtrees` is shared by all build threads, its indices need no rebase
+		}
+		if (node.isLeaf()) {
+			return KDTreeNode::MakeLeaf(refBase + node.getTriangleOffset(), node.getTriangleCount());
+		}
+		return KDTreeNode::MakeInterior(node.getAxis(), node.getSplitPos(), nodeBase + node.getChildIdx() - 1);
+	};
+
+	outNodes[rootIdx] = rebase(subNodes[0]);
+	outNodes.reserve(outNodes.size() + subNodes.size() - 1);
+	for (size_t i = 1; i < subNodes.size(); ++i) {
+		outNodes.push_back(rebase(subNodes[i]));
+	}
+	outTriangleRefs.insert(outTriangleRefs.end(), subTriangleRefs.begin(), subTriangleRefs.end());
+}
+
+void KDTree::partitionTriangles(const std::vector<BuildRef>& nodeRefs, const SplitCandidate& split, const AABB* childAabbs,
+	const BuildContext& context, std::vector<BuildRef>& outRefs0, std::vector<BuildRef>& outRefs1)
+{
+	const size_t count = nodeRefs.size();
+	const size_t chunkSize = count > context.settings.parallelBuildThreshold ?
+		(count + context.pool.getNumThreads() - 1) / context.pool.getNumThreads() : count;
+	const size_t numChunks = (count + chunkSize - 1) / chunkSize;
+
+	// Every chunk fills its own lists. They are concatenated in chunk order afterwards
+	std::vector<std::vector<BuildRef>> chunkRefs0(numChunks);
+	std::vector<std::vector<BuildRef>> chunkRefs1(numChunks);
+	context.pool.parallelFor(count, chunkSize, [&](size_t begin, size_t end) {
+		size_t chunk = begin / chunkSize;
+		for (size_t i = begin; i < end; ++i) {
+			const BuildRef& ref = nodeRefs[i];
+			float lo = ref.bounds.bounds[0].axis(split.axis);
+			float hi = ref.bounds.bounds[1].axis(split.axis);
+
+			if (lo == split.pos && hi == split.pos) {
+				// Lies in the split plane
+				chunkRefs0[chunk].push_back(ref);
+				chunkRefs1[chunk].push_back(ref);
+				continue;
+			}
+			if (hi <= split.pos) {
+				chunkRefs0[chunk].push_back(ref);
+				continue;
+			}
+			if (lo >= split.pos) {
+				chunkRefs1[chunk].push_back(ref);
+				continue;
+			}
+
+			// Straddles the plane. The triangle may still miss one of the children
+			const Triangle& tri = context.triangles[ref.triRef];
+			const Vec3& v0 = context.vertices[tri.v[0]];
+			const Vec3& v1 = context.vertices[tri.v[1]];
+			const Vec3& v2 = context.vertices[tri.v[2]];
+			int keptSides = 0;
+			for (int child = 0; child < 2; ++child) {
+				AABB clipBox = childAabbs[child];
+				if (!clipBox.intersectWith(ref.bounds)) {
+					continue;
+				}
+				BuildRef clippedRef{ ref.triRef, {} };
+				if (clipBox.clipTriangle(v0, v1, v2, clippedRef.bounds)) {
+					(child == 0 ? chunkRefs0 : chunkRefs1)[chunk].push_back(clippedRef);
+					++keptSides;
+				}
+			}
+			if (keptSides == 0) {
+				// Clipping lost the triangle to rounding. Keep the conservative assignment
+				chunkRefs0[chunk].push_back(ref);
+				chunkRefs1[chunk].push_back(ref);
+			}
+		}
+	});
+
+	if (numChunks == 1) {
+		outRefs0 = std::move(chunkRefs0[0]);
+		outRefs1 = std::move(chunkRefs1[0]);
+		return;
+	}
+	for (size_t chunk = 0; chunk < numChunks; ++chunk) {
+		outRefs0.insert(outRefs0.end(), chunkRefs0[chunk].begin(), chunkRefs0[chunk].end());
+		outRefs1.insert(outRefs1.end(), chunkRefs1[chunk].begin(), chunkRefs1[chunk].end());
+	}
+}
+
+KDTree::SplitCandidate KDTree::findSahSplit(const AABB& nodeAabb, const std::vector<BuildRef>& candidateRefs,
+	const BuildContext& context)
+{
+	const Settings& settings = context.settings;
+	ThreadPool& pool = context.pool;
+	SplitCandidate best{};
+	float nodeArea = nodeAabb.surfaceArea();
+	if (nodeArea <= 0.f) {
+		return best;
+	}
+	float invNodeArea = 1.f / nodeArea;
+
+	const size_t numBins = settings.sahBins;
+	// minCounts[i]: triangles starting in bin i. maxCounts[i]: triangles ending in bin i
+	std::vector<size_t> minCounts(numBins);
+	std::vector<size_t> maxCounts(numBins);
+	const size_t count = candidateRefs.size();
+	const size_t chunkSize = count > settings.parallelBuildThreshold ? (count + pool.getNumThreads() - 1) / pool.getNumThreads() : count;
+	const size_t numChunks = (count + chunkSize - 1) / chunkSize;
+	std::vector<size_t> chunkCounts(numChunks * 2 * numBins);
+
+	for (int axis = 0; axis < 3; ++axis) {
+		float lo = nodeAabb.bounds[0].axis(axis);
+		float extent = nodeAabb.bounds[1].axis(axis) - lo;
+		if (extent <= 1.0E-4F) {
+			continue; // too thin to split
+		}
+
+		float binsPerUnit = float(numBins) / extent;
+		auto binOf = [&](float value) {
+			float bin = (value - lo) * binsPerUnit;
+			return std::min(size_t(std::max(bin, 0.f)), numBins - 1);
+		};
+
+		// Every chunk counts into its own bins, which are summed afterwards
+		std::fill(chunkCounts.begin(), chunkCounts.end(), 0);
+		pool.parallelFor(count, chunkSize, [&](size_t begin, size_t end) {
+			size_t* chunkMinCounts = chunkCounts.data() + (begin / chunkSize) * 2 * numBins;
+			size_t* chunkMaxCounts = chunkMinCounts + numBins;
+			for (size_t i = begin; i < end; ++i) {
+				const AABB& triAabb = candidateRefs[i].bounds;
+				++chunkMinCounts[binOf(triAabb.bounds[0].axis(axis))];
+				++chunkMaxCounts[binOf(triAabb.bounds[1].axis(axis))];
+			}
+		});
+		std::fill(minCounts.begin(), minCounts.end(), 0);
+		std::fill(maxCounts.begin(), maxCounts.end(), 0);
+		for (size_t chunk = 0; chunk < numChunks; ++chunk) {
+			const size_t* chunkMinCounts = chunkCounts.data() + chunk * 2 * numBins;
+			const size_t* chunkMaxCounts = chunkMinCounts + numBins;
+			for (size_t bin = 0; bin < numBins; ++bin) {
+				minCounts[bin] += chunkMinCounts[bin];
+				maxCounts[bin] += chunkMaxCounts[bin];
+			}
+		}
+
+		// Sweep the planes between bins. A triangle goes left if it starts before the plane
+		// and right if it ends after it, matching the partitioning in `buildRecursive`
+		size_t numLeft = 0;
+		size_t numRight = candidateRefs.size();
+		for (size_t plane = 1; plane < numBins; ++plane) {
+			numLeft += minCounts[plane - 1];
+			numRight -= maxCounts[plane - 1];
+
+			float pos = lo + extent * float(plane) / float(numBins);
+			AABB leftAabb = nodeAabb;
+			leftAabb.bounds[1].axis(axis) = pos;
+			AABB rightAabb = nodeAabb;
+			rightAabb.bounds[0].axis(axis) = pos;
+
+			float probLeft = leftAabb.surfaceArea() * invNodeArea;
+			float probRight = rightAabb.surfaceArea() * invNodeArea;
+			float bonus = (numLeft == 0 || numRight == 0) ? sahEmptySpaceBonus : 1.f;
+			float cost = settings.sahTraversalCost +
+				bonus * settings.sahIntersectionCost * (probLeft * float(numLeft) + probRight * float(numRight));
+
+			if (cost < best.cost) {
+				best.axis = axis;
+				best.pos = pos;
+				best.cost = cost;
+			}
+		}
+	}
+
+	return best;
+}
+
+void KDTree::writeCache(CacheWriter& writer) const
+{
+	writer.write(aabb);
+	writer.writeVector(nodes);
+	writer.writeVector(triangleRefs);
+	writer.writeVector(leafRopes);
+}
+
+void KDTree::readCache(CacheReader& reader)
+{
+	aabb = reader.read<AABB>();
+	reader.readVector(nodes);
+	reader.readVector(triangleRefs);
+	reader.readVector(leafRopes);
+}
+
+KDTree::json KDTree::toJson() const
+{
+	if (nodes.empty()) {
+		return json{};
+	}
+	return toJsonRecursive(0, aabb);
+}
+
+KDTree::json KDTree::toJsonRecursive(uint32_t nodeIdx, const AABB& nodeAabb) const
+{
+	const KDTreeNode& node = nodes[nodeIdx];
+
+	json j{};
+	j["min"] = { nodeAabb.bounds[0].x, nodeAabb.bounds[0].y, nodeAabb.bounds[0].z };
+	j["max"] = { nodeAabb.bounds[1].x, nodeAabb.bounds[1].y, nodeAabb.bounds[1].z };
+
+	if (node.isLazy()) {
+		const LazySubtree& subtree = *lazySubtrees[node.getLazyIdx()];
+		j["lazy"] = subtree.tree ? subtree.tree->toJson() : json{};
+		return j;
+	}
+	if (node.isLeaf()) {
+		auto refsBegin = triangleRefs.begin() + node.getTriangleOffset();
+		j["triangleRefs"] = std::vector<uint32_t>(refsBegin, refsBegin + node.getTriangleCount());
+		return j;
+	}
+
+	AABB child0Aabb = nodeAabb;
+	child0Aabb.bounds[1].axis(node.getAxis()) = node.getSplitPos();
+	AABB child1Aabb = nodeAabb;
+	child1Aabb.bounds[0].axis(node.getAxis()) = node.getSplitPos();
+	j["child0"] = toJsonRecursive(node.getChildIdx(), child0Aabb);
+	j["child1"] = toJsonRecursive(node.getChildIdx() + 1, child1Aabb);
+	return j;
+}
+
+std::string KDTree::toString() const
+{
+	return toJson().dump(4);
+}
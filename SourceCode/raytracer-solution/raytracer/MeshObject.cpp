@@ -4,7 +4,7 @@
 #include "include/Triangle.h"
 #include "include/Scene.h"
 
-MeshObject::MeshObject(size_t l, size_t u) : SceneObject()
+MeshObject::MeshObject(size_t l, size_t u) : SceneObject({ 0.f, 0.f, 0.f }, Matrix3x3::identity())
 {
 	triangleIndexes.reserve(u - l);
 	for (size_t i = l; i <= u; i++)
@@ -46,6 +46,7 @@ void to_json(nlohmann::json& j, const MeshObject& obj)
 {
 	j = nlohmann::json{ 
 		{"triangleIndexes", obj.triangleIndexes},
+		{"instanceOf", obj.instanceOf},
 		{"SceneObject", static_cast<SceneObject>(obj)} };
 }
 
@@ -53,4 +54,11 @@ void from_json(const nlohmann::json& j, MeshObject& obj)
 {
     j.at("SceneObject").get_to(static_cast<SceneObject&>(obj));
     j.at("triangleIndexes").get_to(obj.triangleIndexes);
+    if (j.contains("instanceOf")) {
+        j.at("instanceOf").get_to(obj.instanceOf);
+    }
+    else {
+        // Written before instancing. `mat` held the camera default and was never applied to meshes
+        obj.mat = Matrix3x3::identity();
+    }
 }
@@ -13,7 +13,16 @@ void Metrics::stopTimer(const char* timerKey) {
 }
 
 void Metrics::record(std::string s) {
-    threads[GThreadIdx].xCounts[s]++;
+    record(s, 1);
+}
+
+void Metrics::record(const std::string& s, int count) {
+    if (GThreadIdx == sharedThreadIdx) {
+        std::lock_guard<std::mutex> lock(sharedMutex);
+        shared.xCounts[s] += count;
+        return;
+    }
+    threads[GThreadIdx].xCounts[s] += count;
 }
 
 ordered_json Metrics::toJson() const {
@@ -26,7 +35,7 @@ ordered_json Metrics::toJson() const {
         j["timers"][timerName] = timer.duration.count();
     }
 
-    auto summedCounters = Counters{};
+    auto summedCounters = shared.xCounts;
     for (const PerThreadMetrics& threadMetrics : threads) {
         for (auto& [key, val] : threadMetrics.xCounts) {
             summedCounters[key] += val;
@@ -45,7 +54,9 @@ std::string Metrics::toString() const {
 }
 
 void Metrics::clear() {
-    threads.clear();
+    // Keep a slot for the main thread, which records during scene loads and updates before `reserveThread`
+    threads.assign(1, PerThreadMetrics{});
+    shared = PerThreadMetrics{};
     timers.clear();
     name.clear();
 }
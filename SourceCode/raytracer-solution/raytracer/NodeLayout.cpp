@@ -0,0 +1,82 @@
+#include "include/NodeLayout.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+std::vector<uint32_t> NodeLayout::treeletOrder(const std::vector<uint32_t>& firstChild, size_t nodeBytes)
+{
+	const uint32_t nodeCount = uint32_t(firstChild.size());
+	std::vector<uint32_t> newIdx(nodeCount, noChild);
+	if (nodeCount == 0) {
+		return newIdx;
+	}
+
+	// Nodes move in units that must stay together: the root alone, or a child pair. A unit is named by its first node
+	auto unitSize = [](uint32_t unit) { return unit == 0 ? 1u : 2u; };
+	const size_t lineNodes = std::max<size_t>(2, cacheLineBytes / nodeBytes);
+	const size_t pageNodes = std::max(lineNodes, pageBytes / nodeBytes);
+
+	// Page of each unit, to keep the line treelets of a page inside it
+	std::vector<uint32_t> pageOf(nodeCount, noChild);
+	uint32_t pageCount = 0;
+	uint32_t nextIdx = 0;
+	std::vector<uint32_t> queue{};
+
+	// Grow a treelet breadth first from `root` while its units fit in `capacity` nodes.
+	// `accept` filters the units that may join. @return the units left on the border, roots of the next treelets
+	auto growTreelet = [&](uint32_t root, size_t capacity, auto&& accept, std::vector<uint32_t>& outMembers) {
+		queue.assign(1, root);
+		size_t head = 0;
+		size_t size = 0;
+		while (head < queue.size() && size + unitSize(queue[head]) <= capacity) {
+			const uint32_t unit = queue[head++];
+			outMembers.push_back(unit);
+			size += unitSize(unit);
+			for (uint32_t node = unit; node < unit + unitSize(unit); ++node) {
+				if (firstChild[node] != noChild && accept(firstChild[node])) {
+					queue.push_back(firstChild[node]);
+				}
+			}
+		}
+		return std::vector<uint32_t>(queue.begin() + head, queue.end());
+	};
+
+	// Page treelets are visited depth first, so a subtree that spills out of a page continues right after it
+	std::vector<uint32_t> pageRoots{ 0 };
+	std::vector<uint32_t> pageMembers{};
+	std::vector<uint32_t> lineRoots{};
+	std::vector<uint32_t> lineMembers{};
+	while (!pageRoots.empty()) {
+		const uint32_t pageRoot = pageRoots.back();
+		pageRoots.pop_back();
+
+		pageMembers.clear();
+		std::vector<uint32_t> border = growTreelet(pageRoot, pageNodes, [](uint32_t) { return true; }, pageMembers);
+		pageRoots.insert(pageRoots.end(), border.rbegin(), border.rend());
+		for (uint32_t unit : pageMembers) {
+			pageOf[unit] = pageCount;
+		}
+
+		// Emit the page as cache line treelets, also depth first
+		lineRoots.assign(1, pageRoot);
+		while (!lineRoots.empty()) {
+			const uint32_t lineRoot = lineRoots.back();
+			lineRoots.pop_back();
+
+			lineMembers.clear();
+			border = growTreelet(lineRoot, lineNodes, [&](uint32_t unit) { return pageOf[unit] == pageCount; }, lineMembers);
+			lineRoots.insert(lineRoots.end(), border.rbegin(), border.rend());
+			for (uint32_t unit : lineMembers) {
+				for (uint32_t node = unit; node < unit + unitSize(unit); ++node) {
+					newIdx[node] = nextIdx++;
+				}
+			}
+		}
+		++pageCount;
+	}
+
+	if (nextIdx != nodeCount) {
+		throw std::runtime_error("NodeLayout::treeletOrder: nodes unreachable from the root");
+	}
+	return newIdx;
+}
@@ -0,0 +1,90 @@
+#include "include/OccluderBVH.h"
+
+#include <array>
+
+#include "include/BVH.h"
+#include "include/Scene.h"
+#include "include/Settings.h"
+#include "include/ThreadPool.h"
+#include "include/Triangle.h"
+
+void OccluderBVH::build(const Scene& scene, const std::vector<uint32_t>& triangleRefs)
+{
+	nodes.clear();
+	triangles.clear();
+
+	std::vector<uint32_t> occluderRefs{};
+	occluderRefs.reserve(triangleRefs.size());
+	for (uint32_t triRef : triangleRefs) {
+		if (scene.materials[scene.triangles[triRef].materialIndex].occludes) {
+			occluderRefs.push_back(triRef);
+		}
+	}
+	if (occluderRefs.empty()) {
+		return;
+	}
+
+	// Shadow queries read only the binary nodes. No wide or quantized nodes, and no pack padding in the leaves
+	Settings buildSettings = *scene.settings;
+	buildSettings.bvhWidth = 2;
+	buildSettings.quantizeBVHNodes = false;
+	buildSettings.trianglePackWidth = 1;
+	ThreadPool serial{ 0 };
+	BVH bvh{};
+	bvh.build(std::move(occluderRefs), scene.cacheTriangleAABBs, scene.triangles, scene.vertices, buildSettings,
+		BVHBuilder::SAH, serial);
+	if (buildSettings.reorderNodes) {
+		bvh.reorderNodes();
+	}
+
+	nodes = bvh.getNodes();
+	const std::vector<uint32_t>& leafRefs = bvh.getTriangleRefs();
+	triangles.reserve(leafRefs.size());
+	for (uint32_t triRef : leafRefs) {
+		triangles.push_back(scene.cacheTriangleRecords[triRef]);
+	}
+}
+
+bool OccluderBVH::isOccluded(const Vec3& start, const Vec3& end) const
+{
+	if (nodes.empty()) {
+		return false;
+	}
+
+	Vec3 dir = end - start;
+	const float maxT = dir.length();
+	dir.normalize();
+	const Ray ray{ start, dir };
+
+	float tEntry;
+	if (!nodes[0].aabb.hasIntersection(ray, maxT, tEntry)) {
+		return false;
+	}
+
+	// Children are visited in any order, the first occluder ends the query
+	std::array<uint32_t, maxDepth + 1> stack;
+	size_t stackSize = 0;
+	stack[stackSize++] = 0;
+
+	float t, baryU, baryV;
+	bool frontFacing;
+	while (stackSize > 0) {
+		const BVHNode& node = nodes[stack[--stackSize]];
+		if (node.isLeaf()) {
+			for (uint32_t i = node.offset; i < node.offset + node.triangleCount; ++i) {
+				if (triangles[i].intersect(ray, maxT, t, baryU, baryV, frontFacing)) {
+					return true;
+				}
+			}
+			continue;
+		}
+
+		if (nodes[node.offset].aabb.hasIntersection(ray, maxT, tEntry)) {
+			stack[stackSize++] = node.offset;
+		}
+		if (nodes[node.offset + 1].aabb.hasIntersection(ray, maxT, tEntry)) {
+			stack[stackSize++] = node.offset + 1;
+		}
+	}
+	return false;
+}
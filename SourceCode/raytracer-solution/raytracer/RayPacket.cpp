@@ -0,0 +1,64 @@
+#include "include/RayPacket.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "include/AABB.h"
+
+RayPacket::RayPacket(std::vector<Ray>&& _rays) : rays(std::move(_rays))
+{
+	if (rays.empty()) {
+		return;
+	}
+
+	coherent = true;
+	for (int axis = 0; axis < 3; ++axis) {
+		sign[axis] = rays[0].sign[axis];
+	}
+
+	for (const Ray& ray : rays) {
+		for (int axis = 0; axis < 3; ++axis) {
+			originMin.axis(axis) = std::min(originMin.axis(axis), ray.origin.axis(axis));
+			originMax.axis(axis) = std::max(originMax.axis(axis), ray.origin.axis(axis));
+			invdirMin.axis(axis) = std::min(invdirMin.axis(axis), ray.invdir.axis(axis));
+			invdirMax.axis(axis) = std::max(invdirMax.axis(axis), ray.invdir.axis(axis));
+			coherent = coherent && ray.sign[axis] == sign[axis];
+		}
+	}
+}
+
+bool RayPacket::mayHit(const AABB& box, float maxT) const
+{
+	// Bound the slab distances (plane - origin) * invdir of all rays with interval arithmetic.
+	// Every ray enters after `tEntry` and leaves before `tExit`, so an empty [tEntry, tExit] means every ray misses
+	float tEntry = 0.f;
+	float tExit = maxT;
+	for (int axis = 0; axis < 3; ++axis) {
+		const float invMin = invdirMin.axis(axis);
+		const float invMax = invdirMax.axis(axis);
+		if (!std::isfinite(invMin) || !std::isfinite(invMax)) {
+			continue; // a ray runs parallel to this slab. Skipping the axis keeps the test conservative
+		}
+
+		// A coherent packet enters and leaves through the same planes. Same ordering as `AABB::hasIntersection`
+		const float nearPlane = box.bounds[sign[axis]].axis(axis);
+		const float farPlane = box.bounds[1 - sign[axis]].axis(axis);
+
+		const float near0 = (nearPlane - originMax.axis(axis)) * invMin;
+		const float near1 = (nearPlane - originMax.axis(axis)) * invMax;
+		const float near2 = (nearPlane - originMin.axis(axis)) * invMin;
+		const float near3 = (nearPlane - originMin.axis(axis)) * invMax;
+		tEntry = std::max(tEntry, std::min({ near0, near1, near2, near3 }));
+
+		const float far0 = (farPlane - originMax.axis(axis)) * invMin;
+		const float far1 = (farPlane - originMax.axis(axis)) * invMax;
+		const float far2 = (farPlane - originMin.axis(axis)) * invMin;
+		const float far3 = (farPlane - originMin.axis(axis)) * invMax;
+		tExit = std::min(tExit, std::max({ far0, far1, far2, far3 }));
+
+		if (tEntry > tExit) {
+			return false;
+		}
+	}
+	return true;
+}
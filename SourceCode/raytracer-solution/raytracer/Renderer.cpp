@@ -1,5 +1,8 @@
 #include "include/Renderer.h"
 
+#include "include/RayPacket.h"
+#include "include/Utils.h"
+
 void Renderer::render()
 {
 	GSceneMetrics.startTimer(Timers::all);
@@ -8,20 +11,50 @@ void Renderer::render()
 	// Prepare Primary Queue
 	GSceneMetrics.startTimer(Timers::generateQueue);
 
-	size_t numBuckets = getNumBuckets();
-
-	queueBuckets.resize(numBuckets);
-	for (size_t y = rendererOutput.startY; y < rendererOutput.endY; ++y) {
-		for (size_t x = rendererOutput.startX; x < rendererOutput.endX; ++x) {
-			size_t bucketId = (y * rendererOutput.width + x) % numBuckets;
-			TraceQueue& queue = queueBuckets[bucketId];
-			scene->camera.emplaceTask(rendererOutput.width, rendererOutput.height, x, y, queue);
+	streamBounds = scene->getBounds();
+	tiles.clear();
+	frameWave.clear();
+	const size_t tileSize = settings->primaryPacketSize;
+	if (tileSize > 0) {
+		// Rays are generated per tile by the worker threads, see `processTile`
+		queueBuckets.clear();
+		for (size_t y = rendererOutput.startY; y < rendererOutput.endY; y += tileSize) {
+			for (size_t x = rendererOutput.startX; x < rendererOutput.endX; x += tileSize) {
+				tiles.push_back({ x, y, std::min(x + tileSize, rendererOutput.endX), std::min(y + tileSize, rendererOutput.endY) });
+			}
+		}
+	}
+	else if (settings->sortSecondaryRays) {
+		// Rays are traced one depth of the whole frame at a time, see `processFrameWaves`
+		queueBuckets.clear();
+		frameWave.reserve((rendererOutput.endX - rendererOutput.startX) * (rendererOutput.endY - rendererOutput.startY));
+		for (size_t y = rendererOutput.startY; y < rendererOutput.endY; ++y) {
+			for (size_t x = rendererOutput.startX; x < rendererOutput.endX; ++x) {
+				scene->camera.emplaceTask(rendererOutput.width, rendererOutput.height, x, y, frameWave);
+			}
+		}
+	}
+	else {
+		size_t numBuckets = getNumBuckets();
+
+		queueBuckets.resize(numBuckets);
+		for (size_t y = rendererOutput.startY; y < rendererOutput.endY; ++y) {
+			for (size_t x = rendererOutput.startX; x < rendererOutput.endX; ++x) {
+				size_t bucketId = (y * rendererOutput.width + x) % numBuckets;
+				TraceQueue& queue = queueBuckets[bucketId];
+				scene->camera.emplaceTask(rendererOutput.width, rendererOutput.height, x, y, queue);
+			}
 		}
 	}
 
 	GSceneMetrics.stopTimer(Timers::generateQueue);
 	GSceneMetrics.startTimer(Timers::processQueue);
-	launchBuckets();
+	if (!frameWave.empty()) {
+		processFrameWaves();
+	}
+	else {
+		launchBuckets();
+	}
 	GSceneMetrics.stopTimer(Timers::processQueue);
 	GSceneMetrics.stopTimer(Timers::all);
 }
@@ -52,9 +85,40 @@ void Renderer::launchBuckets()
 	}
 }
 
+void Renderer::launchWorkers(size_t numItems, const std::function<void(size_t)>& processItem)
+{
+	const size_t numThreads = std::thread::hardware_concurrency();
+	std::vector<std::thread> threads;
+	std::atomic<size_t> nextItem{ 0 };
+	GSceneMetrics.reserveThread(numThreads);
+
+	for (size_t threadId = 0; threadId < numThreads; ++threadId) {
+		threads.emplace_back([&, threadId]() {
+			GThreadIdx = threadId;
+			for (size_t item = nextItem.fetch_add(1); item < numItems; item = nextItem.fetch_add(1)) {
+				processItem(item);
+			}
+		});
+	}
+
+	for (auto& thread : threads) {
+		if (thread.joinable()) {
+			thread.join();
+		}
+	}
+}
+
 void Renderer::workerThread(size_t threadIdx, std::atomic<size_t>& nextQueueIndex) {
 	GThreadIdx = threadIdx;
 	size_t queueIndex = threadIdx;
+	if (!tiles.empty()) {
+		while (queueIndex < tiles.size()) {
+			processTile(tiles[queueIndex]);
+			queueIndex = nextQueueIndex.fetch_add(1);
+		}
+		return;
+	}
+
 	while (queueIndex < queueBuckets.size()) {
 		processTraceQueue(queueBuckets[queueIndex]);
 		queueIndex = nextQueueIndex.fetch_add(1);
@@ -63,6 +127,11 @@ void Renderer::workerThread(size_t threadIdx, std::atomic<size_t>& nextQueueInde
 
 void Renderer::processTraceQueue(TraceQueue& traceQueue)
 {
+	if (settings->sortSecondaryRays) {
+		processTraceStream(traceQueue);
+		return;
+	}
+
 	while (!traceQueue.empty()) {
 		TraceTask task = traceQueue.front();
 		Ray& ray = task.ray;
@@ -73,6 +142,144 @@ void Renderer::processTraceQueue(TraceQueue& traceQueue)
 	}
 }
 
+void Renderer::processTraceStream(TraceQueue& traceQueue)
+{
+	std::vector<TraceTask> wave;
+	std::vector<uint32_t> order;
+	std::vector<TraceHit> hits;
+	while (!traceQueue.empty()) {
+		wave.clear();
+		while (!traceQueue.empty()) {
+			wave.push_back(traceQueue.front());
+			traceQueue.pop();
+		}
+
+		sortStream(wave, order);
+		hits.assign(wave.size(), TraceHit{});
+		for (uint32_t idx : order) {
+			scene->intersect(wave[idx].ray, hits[idx]);
+		}
+		// Shading in wave order adds the samples of each pixel in the same order as `processTraceQueue`
+		for (size_t i = 0; i < wave.size(); ++i) {
+			processXData(wave[i], hits[i], traceQueue);
+		}
+	}
+}
+
+void Renderer::processFrameWaves()
+{
+	std::vector<uint32_t> order;
+	std::vector<TraceHit> hits;
+	std::vector<size_t> chunkStarts;
+	std::vector<TraceQueue> spawned;
+	bool isPrimary = true;
+	while (!frameWave.empty()) {
+		// Primary rays are already coherent in scanline order
+		if (isPrimary) {
+			order.resize(frameWave.size());
+			for (size_t i = 0; i < order.size(); ++i) {
+				order[i] = uint32_t(i);
+			}
+			isPrimary = false;
+		}
+		else {
+			sortStream(frameWave, order);
+		}
+
+		const size_t numChunks = (frameWave.size() + waveChunkSize - 1) / waveChunkSize;
+		hits.assign(frameWave.size(), TraceHit{});
+		launchWorkers(numChunks, [&](size_t chunk) {
+			const size_t end = std::min((chunk + 1) * waveChunkSize, order.size());
+			for (size_t i = chunk * waveChunkSize; i < end; ++i) {
+				scene->intersect(frameWave[order[i]].ray, hits[order[i]]);
+			}
+		});
+
+		// The wave is in pixel order and shaded in that order, so the samples of each pixel are added in the same order as
+		// `processTraceQueue`. Chunks end between pixels, so no two threads add samples to the same pixel
+		chunkStarts.assign(1, 0);
+		for (size_t start = waveChunkSize; start < frameWave.size(); start += waveChunkSize) {
+			size_t pixelStart = start;
+			while (pixelStart < frameWave.size() && frameWave[pixelStart].pixelX == frameWave[pixelStart - 1].pixelX &&
+				frameWave[pixelStart].pixelY == frameWave[pixelStart - 1].pixelY) {
+				++pixelStart;
+			}
+			if (pixelStart < frameWave.size() && pixelStart > chunkStarts.back()) {
+				chunkStarts.push_back(pixelStart);
+			}
+		}
+		chunkStarts.push_back(frameWave.size());
+
+		spawned.assign(chunkStarts.size() - 1, TraceQueue{});
+		launchWorkers(spawned.size(), [&](size_t chunk) {
+			for (size_t i = chunkStarts[chunk]; i < chunkStarts[chunk + 1]; ++i) {
+				processXData(frameWave[i], hits[i], spawned[chunk]);
+			}
+		});
+
+		frameWave.clear();
+		for (TraceQueue& queue : spawned) {
+			while (!queue.empty()) {
+				frameWave.push_back(queue.front());
+				queue.pop();
+			}
+		}
+	}
+}
+
+void Renderer::sortStream(const std::vector<TraceTask>& wave, std::vector<uint32_t>& order) const
+{
+	const Vec3 extent = streamBounds.bounds[1] - streamBounds.bounds[0];
+	const Vec3 invExtent{
+		extent.x > 0.f ? 1.f / extent.x : 0.f,
+		extent.y > 0.f ? 1.f / extent.y : 0.f,
+		extent.z > 0.f ? 1.f / extent.z : 0.f };
+
+	// (key, index into `wave`). Sorting the keys is cheaper than moving whole tasks around.
+	// Origin first: rays leaving neighbouring hit points stay together even when their directions fall in different octants
+	std::vector<std::pair<uint64_t, uint32_t>> keys(wave.size());
+	for (size_t i = 0; i < wave.size(); ++i) {
+		const Ray& ray = wave[i].ray;
+		const uint64_t octant = uint64_t(ray.sign[0] | (ray.sign[1] << 1) | (ray.sign[2] << 2));
+		const Vec3 local = ray.origin - streamBounds.bounds[0];
+		const uint32_t morton = Utils::mortonCode3D(local.x * invExtent.x, local.y * invExtent.y, local.z * invExtent.z);
+		keys[i] = { (uint64_t(morton) << 3) | octant, uint32_t(i) };
+	}
+	std::sort(keys.begin(), keys.end());
+
+	order.resize(wave.size());
+	for (size_t i = 0; i < keys.size(); ++i) {
+		order[i] = keys[i].second;
+	}
+}
+
+void Renderer::processTile(const Tile& tile)
+{
+	std::vector<TraceTask> tasks;
+	tasks.reserve((tile.endX - tile.startX) * (tile.endY - tile.startY));
+	for (size_t y = tile.startY; y < tile.endY; ++y) {
+		for (size_t x = tile.startX; x < tile.endX; ++x) {
+			scene->camera.emplaceTask(rendererOutput.width, rendererOutput.height, x, y, tasks);
+		}
+	}
+
+	std::vector<Ray> rays;
+	rays.reserve(tasks.size());
+	for (const TraceTask& task : tasks) {
+		rays.push_back(task.ray);
+	}
+	const RayPacket packet{ std::move(rays) };
+	std::vector<TraceHit> hits(tasks.size());
+	scene->intersectPacket(packet, hits.data());
+
+	// Secondary rays scatter, they are traced one by one
+	TraceQueue traceQueue;
+	for (size_t i = 0; i < tasks.size(); ++i) {
+		processXData(tasks[i], hits[i], traceQueue);
+	}
+	processTraceQueue(traceQueue);
+}
+
 void Renderer::processXData(TraceTask& task, TraceHit& hit, TraceQueue& traceQueue) {
 	if (task.depth >= settings->maxDepth) {
 		shadeSky(task, hit);
@@ -1,5 +1,6 @@
 #pragma warning( disable : 4365 )
 #include<limits>
+#include <algorithm>
 
 #include "include/Scene.h"
 #include "include/AnimationComponent.h"
@@ -13,27 +14,49 @@
 #include "include/Utils.h"
 #include "include/AABB.h"
 #include "include/Index.h"
+#include "include/ThreadPool.h"
+#include "include/SceneCache.h"
+#include "include/RayPacket.h"
 
 bool Scene::isOccluded(const Vec3& start, const Vec3& end) const {
-	for (const Triangle& tri : triangles) {
-		TraceHit hit{};
-		auto& material = materials[tri.materialIndex];
-		if (!material.occludes) {
-			continue;
-		}
+	if (!settings->forceNoAccelStructure) {
+		return tlas.isOccluded(*this, start, end);
+	}
 
-		if (tri.fastIntersect(*this, start, end)) {
-			return true;
-		}
-		else {
-			continue;
+	for (const MeshObject& meshObject : meshObjects) {
+		// Triangles are in the object's local space
+		Matrix3x3 localFromWorld = meshObject.mat.inverse();
+		Vec3 localStart = localFromWorld * (start - meshObject.pos);
+		Vec3 localEnd = localFromWorld * (end - meshObject.pos);
+		for (size_t triIdx : meshObject.triangleIndexes) {
+			const Triangle& tri = triangles[triIdx];
+			auto& material = materials[tri.materialIndex];
+			if (!material.occludes) {
+				continue;
+			}
+
+			if (tri.fastIntersect(*this, localStart, localEnd)) {
+				return true;
+			}
 		}
 	}
 	return false;
 }
 
 void Scene::intersect(const Ray& ray, TraceHit& out) const {
-	accelStruct.traverse(*this, ray, out);
+	tlas.traverse(*this, ray, out);
+}
+
+void Scene::intersectPacket(const RayPacket& packet, TraceHit* outHits) const {
+	const std::vector<Ray>& rays = packet.getRays();
+	if (!packet.isCoherent()) {
+		GSceneMetrics.record("RayPacketDiverged");
+		for (size_t i = 0; i < rays.size(); ++i) {
+			intersect(rays[i], outHits[i]);
+		}
+		return;
+	}
+	tlas.traversePacket(*this, packet, outHits);
 }
 
 MeshObject& Scene::addObject(
@@ -54,7 +77,7 @@ MeshObject& Scene::addObject(
 		tri.v[2] += vertexIdxPadding;
 	}
 
-	size_t trianglesIdxStart = triangles.size() == 0 ? 0 : triangles.size() - 1;
+	size_t trianglesIdxStart = triangles.size();
 	Utils::move_back(triangles, objTriangles);
 	size_t trianglesIdxEnd = triangles.size() - 1;
 	Utils::move_back(uvs, objUvs);
@@ -68,9 +91,65 @@ MeshObject& Scene::addObject(
 	return ref;
 }
 
+MeshObject& Scene::addInstance(size_t sourceIdx, const Vec3& pos, const Matrix3x3& mat)
+{
+	assert(sourceIdx < meshObjects.size());
+	// Instance the mesh that owns the triangles, so that TLAS can look up the BLAS directly
+	if (meshObjects[sourceIdx].isInstance()) {
+		sourceIdx = meshObjects[sourceIdx].instanceOf;
+	}
+
+	MeshObject instance{};
+	instance.triangleIndexes = meshObjects[sourceIdx].triangleIndexes;
+	instance.instanceOf = sourceIdx;
+	instance.pos = pos;
+	instance.mat = mat;
+	MeshObject& ref = meshObjects.emplace_back(std::move(instance));
+
+	isDirty = true;
+	return ref;
+}
+
+void Scene::moveObject(size_t meshObjectIdx, const Vec3& pos, const Matrix3x3& mat)
+{
+	assert(!isDirty);
+	MeshObject& meshObject = meshObjects[meshObjectIdx];
+	meshObject.pos = pos;
+	meshObject.mat = mat;
+	tlas.buildTopLevel(*this);
+}
+
+void Scene::removeObject(size_t meshObjectIdx)
+{
+	assert(!isDirty);
+	for (const MeshObject& meshObject : meshObjects) {
+		if (meshObject.instanceOf == meshObjectIdx) {
+			throw std::runtime_error("Scene::removeObject: the object is instanced by other objects");
+		}
+	}
+
+	meshObjects.erase(meshObjects.begin() + meshObjectIdx);
+	for (MeshObject& meshObject : meshObjects) {
+		if (meshObject.isInstance() && meshObject.instanceOf > meshObjectIdx) {
+			--meshObject.instanceOf;
+		}
+	}
+	// Animations are keyed by object index
+	std::unordered_map<int, AnimationComponent> shiftedAnimations{};
+	for (auto& [index, animComponent] : meshAnimations) {
+		if (size_t(index) != meshObjectIdx) {
+			shiftedAnimations.emplace(size_t(index) > meshObjectIdx ? index - 1 : index, std::move(animComponent));
+		}
+	}
+	meshAnimations = std::move(shiftedAnimations);
+
+	tlas.removeMeshObject(*this, meshObjectIdx);
+	--builtMeshObjectCount;
+}
+
 void Scene::buildVertexNormals() {
-	// Vec3{0.f, 0.f, 0.f} is important for summation
-	cacheVertexNormals.resize(vertices.size(), Vec3{ 0.f, 0.f, 0.f });
+	// Vec3{0.f, 0.f, 0.f} is important for summation. A rebuild must not add to the normals of the last build
+	cacheVertexNormals.assign(vertices.size(), Vec3{ 0.f, 0.f, 0.f });
 	for (size_t vertIdx = 0; vertIdx < vertices.size(); ++vertIdx) {
 		std::vector<size_t> attachedTris = genAttachedTriangles(vertIdx);
 		for (size_t triIdx : attachedTris) {
@@ -91,6 +170,15 @@ void Scene::buildTriangleNormals()
 	}
 }
 
+void Scene::buildTriangleRecords()
+{
+	cacheTriangleRecords.resize(triangles.size());
+	for (size_t i = 0; i < triangles.size(); ++i) {
+		const Triangle& tri = triangles[i];
+		cacheTriangleRecords[i] = TriangleRecord{ vertices[tri.v[0]], vertices[tri.v[1]], vertices[tri.v[2]] };
+	}
+}
+
 std::vector<size_t> Scene::genAttachedTriangles(const size_t vertexIndex) const
 {
 	std::vector<size_t> triRefs{};
@@ -107,30 +195,156 @@ void Scene::build()
 {
 	GSceneMetrics.startTimer(Timers::buildScene);
 	buildTriangleNormals();
+	buildTriangleRecords();
+
+	// Triangle normals and records are linear in the triangle count. Everything else the build derives is cached.
+	// Lazy kd-trees are not: their unbuilt subtrees only exist in memory
+	const bool useSceneCache = settings->useSceneCache &&
+		!(accelStructType == AccelStructType::KDTREE && settings->kdTreeLazyDepth > 0);
+	if (useSceneCache && SceneCache::load(*this, tlas)) {
+		GSceneMetrics.record("SceneCacheHit");
+		reportNodeMemory();
+		markBuilt();
+		GSceneMetrics.stopTimer(Timers::buildScene);
+		return;
+	}
+
 	buildVertexNormals();
 
+	ThreadPool pool{ numBuildWorkers() };
+
 	cacheTriangleAABBs.clear();
 	cacheTriangleAABBs.resize(triangles.size());
 
-	for (size_t i = 0; i < triangles.size(); ++i) {
-		const Triangle& tri = triangles[i];
-		tri.buildAABB(vertices, cacheTriangleAABBs[i].bounds);
+	size_t aabbChunkSize = (triangles.size() + pool.getNumThreads() - 1) / pool.getNumThreads();
+	pool.parallelFor(triangles.size(), aabbChunkSize, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			const Triangle& tri = triangles[i];
+			tri.buildAABB(vertices, cacheTriangleAABBs[i].bounds);
+		}
+	});
+
+	GSceneMetrics.startTimer(Timers::buildAccelStructure);
+	tlas.build(*this, accelStructType, pool);
+	GSceneMetrics.stopTimer(Timers::buildAccelStructure);
+	if (settings->reorderNodes) {
+		GSceneMetrics.startTimer(Timers::reorderNodes);
+		tlas.reorderNodes();
+		GSceneMetrics.stopTimer(Timers::reorderNodes);
+	}
+	if (settings->debugAccelStructure) {
+		std::cout << tlas.toString();
+	}
+	reportNodeMemory();
+	if (useSceneCache) {
+		SceneCache::write(*this, tlas);
 	}
 
-	std::vector<size_t> triangleRefs = std::vector<size_t>(triangles.size());
-	for (size_t i = 0; i < triangles.size(); ++i) {
-		triangleRefs[i] = i;
+	markBuilt();
+
+	GSceneMetrics.stopTimer(Timers::buildScene);
+}
+
+void Scene::buildAdded()
+{
+	if (builtMeshObjectCount == 0 || tlas.getType() != accelStructType) {
+		build();
+		return;
 	}
 
-	accelStruct = KDTreeNode(AABB::MakeEnclosingAABB(cacheTriangleAABBs), 0);
-	accelStruct.build(std::move(triangleRefs), cacheTriangleAABBs, settings->maxTrianglesPerLeaf, settings->accelTreeMaxDepth);
+	GSceneMetrics.startTimer(Timers::buildAdded);
 
-	std::cout << accelStruct.toString();
+	// Objects do not share vertices, see `addObject`. The new vertices are only attached to the new triangles
+	cacheTriangleAABBs.resize(triangles.size());
+	cacheTriangleRecords.resize(triangles.size());
+	cacheVertexNormals.resize(vertices.size(), Vec3{ 0.f, 0.f, 0.f });
+	for (size_t triIdx = builtTriangleCount; triIdx < triangles.size(); ++triIdx) {
+		Triangle& tri = triangles[triIdx];
+		tri.buildNormal(vertices);
+		tri.buildAABB(vertices, cacheTriangleAABBs[triIdx].bounds);
+		cacheTriangleRecords[triIdx] = TriangleRecord{ vertices[tri.v[0]], vertices[tri.v[1]], vertices[tri.v[2]] };
+		for (size_t vertIdx : tri.v) {
+			cacheVertexNormals[vertIdx] += tri.getNormal();
+		}
+	}
+	for (size_t vertIdx = builtVertexCount; vertIdx < vertices.size(); ++vertIdx) {
+		cacheVertexNormals[vertIdx].normalize();
+	}
+
+	// The cache stores whole scenes. It is written by full builds only
+	ThreadPool pool{ numBuildWorkers() };
+	tlas.addMeshObjects(*this, builtMeshObjectCount, pool);
+	markBuilt();
 
+	GSceneMetrics.stopTimer(Timers::buildAdded);
+}
+
+void Scene::markBuilt()
+{
+	builtMeshObjectCount = meshObjects.size();
+	builtTriangleCount = triangles.size();
+	builtVertexCount = vertices.size();
 	triangleAABBsDirty = false;
 	isDirty = false;
+}
 
-	GSceneMetrics.stopTimer(Timers::buildScene);
+void Scene::reportNodeMemory() const
+{
+	if (!settings->quantizeBVHNodes || accelStructType != AccelStructType::BVH) {
+		return;
+	}
+	size_t traversalBytes, binaryBytes;
+	tlas.getBVHNodeBytes(traversalBytes, binaryBytes);
+	std::cout << "Quantized BVH nodes: " << traversalBytes << " bytes, " << binaryBytes - traversalBytes << " bytes saved\n";
+}
+
+void Scene::updateGeometry(const std::vector<size_t>& meshObjectIdxs)
+{
+	assert(!isDirty);
+	GSceneMetrics.startTimer(Timers::updateGeometry);
+
+	// Instances share the triangles of their source, so each mesh is updated once
+	std::vector<bool> updated(meshObjects.size(), false);
+	for (size_t meshIdx : meshObjectIdxs) {
+		const MeshObject& meshObject = meshObjects[meshIdx];
+		size_t ownerIdx = meshObject.isInstance() ? meshObject.instanceOf : meshIdx;
+		if (updated[ownerIdx]) {
+			continue;
+		}
+		updated[ownerIdx] = true;
+
+		// Objects do not share vertices, see `addObject`. Summing the normals of the object's triangles is enough
+		for (size_t triIdx : meshObject.triangleIndexes) {
+			Triangle& tri = triangles[triIdx];
+			tri.buildNormal(vertices);
+			tri.buildAABB(vertices, cacheTriangleAABBs[triIdx].bounds);
+			cacheTriangleRecords[triIdx] = TriangleRecord{ vertices[tri.v[0]], vertices[tri.v[1]], vertices[tri.v[2]] };
+			for (size_t vertIdx : tri.v) {
+				cacheVertexNormals[vertIdx] = Vec3{ 0.f, 0.f, 0.f };
+			}
+		}
+		for (size_t triIdx : meshObject.triangleIndexes) {
+			const Triangle& tri = triangles[triIdx];
+			for (size_t vertIdx : tri.v) {
+				cacheVertexNormals[vertIdx] += tri.getNormal();
+			}
+		}
+		for (size_t triIdx : meshObject.triangleIndexes) {
+			for (size_t vertIdx : triangles[triIdx].v) {
+				cacheVertexNormals[vertIdx].normalize();
+			}
+		}
+	}
+
+	ThreadPool pool{ numBuildWorkers() };
+	tlas.updateGeometry(*this, meshObjectIdxs, pool);
+
+	GSceneMetrics.stopTimer(Timers::updateGeometry);
+}
+
+size_t Scene::numBuildWorkers() const
+{
+	return settings->forceSingleThreaded ? 0 : std::max<size_t>(std::thread::hardware_concurrency(), 1) - 1;
 }
 
 void Scene::updateAnimations() {
@@ -151,19 +365,21 @@ void Scene::updateAnimations() {
 		camera.setDir(newDir);
 	}
 
+	// Rigid motion only changes placements, so neither triangles nor BLASes are touched. See `updateGeometry` for deformations
 	for (auto& [index, animComponent] : meshAnimations) {
 		MeshObject& meshObject = meshObjects[index];
-		Vec3 pos = meshObject.pos;
-		animComponent.pos.evaluateLerp(pos);
-		meshObject.translateTo(pos);
-
-		std::cerr << "updateAnimations not fully implemented\n";
+		animComponent.pos.evaluateLerp(meshObject.pos);
+	}
+	if (!meshAnimations.empty()) {
+		tlas.buildTopLevel(*this);
 	}
 }
 
 Scene Scene::cut(const std::vector<size_t> trianglesToCut) const
 {
 	Scene newScene{ sceneName, settings };
+	newScene.accelStructType = accelStructType;
+	newScene.bvhBuilder = bvhBuilder;
 	newScene.ambientLightColor = ambientLightColor;
 	newScene.bgColor = bgColor;
 	newScene.bucketSize = bucketSize;
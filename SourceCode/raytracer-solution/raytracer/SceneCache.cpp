@@ -0,0 +1,172 @@
+#include "include/SceneCache.h"
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <filesystem>
+
+#include "include/Scene.h"
+#include "include/TLAS.h"
+#include "include/Settings.h"
+#include "include/MeshObject.h"
+#include "include/Triangle.h"
+
+namespace {
+	/* 64 bit FNV-1a over raw bytes */
+	class Fnv1a {
+	public:
+		void add(const void* data, size_t size)
+		{
+			const unsigned char* bytes = static_cast<const unsigned char*>(data);
+			for (size_t i = 0; i < size; ++i) {
+				hash ^= bytes[i];
+				hash *= prime;
+			}
+		}
+
+		template <typename T>
+		void add(const T& value)
+		{
+			static_assert(std::is_trivially_copyable_v<T>, "Fnv1a: T must be trivially copyable");
+			add(&value, sizeof(T));
+		}
+
+		uint64_t get() const { return hash; }
+
+	private:
+		static constexpr uint64_t prime = 0x100000001b3ull;
+		uint64_t hash = 0xcbf29ce484222325ull;
+	};
+}
+
+CacheReader::CacheReader(const Path& path) : stream(path, std::ios::in | std::ios::binary)
+{
+	if (!stream) {
+		throw std::runtime_error("CacheReader: cannot open " + path.string());
+	}
+	remaining = std::filesystem::file_size(path);
+}
+
+void CacheReader::readBytes(char* dst, size_t count)
+{
+	if (count > remaining || !stream.read(dst, std::streamsize(count))) {
+		throw std::runtime_error("CacheReader: unexpected end of file");
+	}
+	remaining -= count;
+}
+
+uint64_t SceneCache::hashScene(const Scene& scene)
+{
+	Fnv1a hash{};
+	hash.add(formatVersion);
+
+	hash.add(scene.vertices.size());
+	hash.add(scene.vertices.data(), scene.vertices.size() * sizeof(Vec3));
+
+	// Materials do not affect the build. Only the vertex indices are hashed
+	hash.add(scene.triangles.size());
+	for (const Triangle& tri : scene.triangles) {
+		hash.add(tri.v);
+	}
+
+	// Placements (`pos`, `mat`) only affect the top level, which is always rebuilt
+	hash.add(scene.meshObjects.size());
+	for (const MeshObject& meshObject : scene.meshObjects) {
+		hash.add(meshObject.instanceOf);
+		hash.add(meshObject.triangleIndexes.size());
+		hash.add(meshObject.triangleIndexes.data(), meshObject.triangleIndexes.size() * sizeof(size_t));
+	}
+
+	const Settings& settings = *scene.settings;
+	hash.add(scene.accelStructType);
+	hash.add(scene.bvhBuilder);
+	hash.add(settings.maxTrianglesPerLeaf);
+	hash.add(settings.accelTreeMaxDepth);
+	hash.add(settings.sahTraversalCost);
+	hash.add(settings.sahIntersectionCost);
+	hash.add(settings.sahBins);
+	hash.add(settings.gridDensity);
+	hash.add(settings.sbvhDuplication);
+	hash.add(settings.bvhWidth);
+	hash.add(settings.quantizeBVHNodes);
+	hash.add(settings.trianglePackWidth);
+	hash.add(settings.kdTreeRopes);
+	hash.add(settings.reorderNodes);
+	return hash.get();
+}
+
+Path SceneCache::getCachePath(const Settings& settings, uint64_t hash)
+{
+	std::ostringstream name{};
+	name << std::hex << std::setw(16) << std::setfill('0') << hash << ".scenecache";
+	return settings.getSceneCacheDir() / name.str();
+}
+
+bool SceneCache::load(Scene& scene, TLAS& tlas)
+{
+	const uint64_t hash = hashScene(scene);
+	const Path path = getCachePath(*scene.settings, hash);
+	if (!std::filesystem::exists(path)) {
+		return false;
+	}
+
+	try {
+		CacheReader reader{ path };
+		if (reader.read<uint32_t>() != magic || reader.read<uint32_t>() != formatVersion || reader.read<uint64_t>() != hash) {
+			throw std::runtime_error("header mismatch");
+		}
+
+		std::vector<Vec3> vertexNormals{};
+		std::vector<AABB> triangleAABBs{};
+		reader.readVector(vertexNormals);
+		reader.readVector(triangleAABBs);
+		if (vertexNormals.size() != scene.vertices.size() || triangleAABBs.size() != scene.triangles.size()) {
+			throw std::runtime_error("size mismatch");
+		}
+
+		TLAS newTlas{};
+		newTlas.readCache(reader, scene.accelStructType);
+		scene.cacheVertexNormals = std::move(vertexNormals);
+		scene.cacheTriangleAABBs = std::move(triangleAABBs);
+		tlas = std::move(newTlas);
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Ignoring scene cache " << path.string() << ": " << e.what() << "\n";
+		return false;
+	}
+
+	tlas.buildPacks(scene);
+	tlas.buildTopLevel(scene);
+	return true;
+}
+
+void SceneCache::write(const Scene& scene, const TLAS& tlas)
+{
+	const uint64_t hash = hashScene(scene);
+	const Path path = getCachePath(*scene.settings, hash);
+
+	std::error_code error{};
+	std::filesystem::create_directories(path.parent_path(), error);
+
+	// Write to a temporary file first, so that a crash never leaves a truncated cache behind
+	Path tmpPath = path;
+	tmpPath += ".tmp";
+	{
+		CacheWriter writer{ tmpPath };
+		writer.write(magic);
+		writer.write(formatVersion);
+		writer.write(hash);
+		writer.writeVector(scene.cacheVertexNormals);
+		writer.writeVector(scene.cacheTriangleAABBs);
+		tlas.writeCache(writer);
+		if (!writer.good()) {
+			std::cerr << "Failed to write scene cache " << tmpPath.string() << "\n";
+			return;
+		}
+	}
+
+	std::filesystem::rename(tmpPath, path, error);
+	if (error) {
+		std::cerr << "Failed to write scene cache " << path.string() << ": " << error.message() << "\n";
+	}
+}
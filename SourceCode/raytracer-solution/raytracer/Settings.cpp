@@ -28,10 +28,29 @@ Settings Settings::load(const std::string& filename) {
     settings.resolutionY = json.at("resolutionY");
     settings.bWritePng = json.at("bWritePng");
     settings.bWriteBmp = json.at("bWriteBmp");
+    settings.accelStructure = AccelStructTypeFromString(json.at("accelStructure"));
     settings.forceNoAccelStructure = json.at("forceNoAccelStructure");
     settings.forceSingleThreaded = json.at("forceSingleThreaded");
     settings.maxTrianglesPerLeaf = json.at("maxTrianglesPerLeaf");
     settings.accelTreeMaxDepth = json.at("accelTreeMaxDepth");
+    settings.kdTreeRopes = json.at("kdTreeRopes");
+    settings.kdTreeLazyDepth = json.at("kdTreeLazyDepth");
+    settings.sahTraversalCost = json.at("sahTraversalCost");
+    settings.sahIntersectionCost = json.at("sahIntersectionCost");
+    settings.sahBins = json.at("sahBins");
+    settings.bvhBuilder = BVHBuilderFromString(json.at("bvhBuilder"));
+    settings.gridDensity = json.at("gridDensity");
+    settings.sbvhDuplication = json.at("sbvhDuplication");
+    settings.bvhWidth = json.at("bvhWidth");
+    settings.quantizeBVHNodes = json.at("quantizeBVHNodes");
+    settings.reorderNodes = json.at("reorderNodes");
+    settings.occluderStructure = json.at("occluderStructure");
+    settings.parallelBuildThreshold = json.at("parallelBuildThreshold");
+    settings.refitRebuildThreshold = json.at("refitRebuildThreshold");
+    settings.useSceneCache = json.at("useSceneCache");
+    settings.trianglePackWidth = json.at("trianglePackWidth");
+    settings.primaryPacketSize = json.at("primaryPacketSize");
+    settings.sortSecondaryRays = json.at("sortSecondaryRays");
 
     settings.checkSettings();
 
@@ -58,14 +77,92 @@ std::string Settings::toString() const {
     json["resolutionY"] = resolutionY;
     json["bWritePng"] = bWritePng;
     json["bWriteBmp"] = bWriteBmp;
+    json["accelStructure"] = StringFromAccelStructType(accelStructure);
     json["forceNoAccelStructure"] = forceNoAccelStructure;
     json["forceSingleThreaded"] = forceSingleThreaded;
     json["maxTrianglesPerLeaf"] = maxTrianglesPerLeaf;
     json["accelTreeMaxDepth"] = accelTreeMaxDepth;
+    json["kdTreeRopes"] = kdTreeRopes;
+    json["kdTreeLazyDepth"] = kdTreeLazyDepth;
+    json["sahTraversalCost"] = sahTraversalCost;
+    json["sahIntersectionCost"] = sahIntersectionCost;
+    json["sahBins"] = sahBins;
+    json["bvhBuilder"] = StringFromBVHBuilder(bvhBuilder);
+    json["gridDensity"] = gridDensity;
+    json["sbvhDuplication"] = sbvhDuplication;
+    json["bvhWidth"] = bvhWidth;
+    json["quantizeBVHNodes"] = quantizeBVHNodes;
+    json["reorderNodes"] = reorderNodes;
+    json["occluderStructure"] = occluderStructure;
+    json["parallelBuildThreshold"] = parallelBuildThreshold;
+    json["refitRebuildThreshold"] = refitRebuildThreshold;
+    json["useSceneCache"] = useSceneCache;
+    json["trianglePackWidth"] = trianglePackWidth;
+    json["primaryPacketSize"] = primaryPacketSize;
+    json["sortSecondaryRays"] = sortSecondaryRays;
 
     return json.dump();
 }
 
+AccelStructType Settings::AccelStructTypeFromString(const std::string& type)
+{
+    if (type == "kdtree") {
+        return AccelStructType::KDTREE;
+    }
+    else if (type == "bvh") {
+        return AccelStructType::BVH;
+    }
+    else if (type == "grid") {
+        return AccelStructType::GRID;
+    }
+    else {
+        throw std::runtime_error("Unknown acceleration structure: " + type);
+    }
+}
+
+std::string Settings::StringFromAccelStructType(AccelStructType type)
+{
+    switch (type) {
+    case AccelStructType::KDTREE:
+        return "kdtree";
+    case AccelStructType::BVH:
+        return "bvh";
+    case AccelStructType::GRID:
+        return "grid";
+    default:
+        throw std::runtime_error("Unknown acceleration structure");
+    }
+}
+
+BVHBuilder Settings::BVHBuilderFromString(const std::string& builder)
+{
+    if (builder == "sah") {
+        return BVHBuilder::SAH;
+    }
+    else if (builder == "lbvh") {
+        return BVHBuilder::LBVH;
+    }
+    else if (builder == "sbvh") {
+        return BVHBuilder::SBVH;
+    }
+    else {
+        throw std::runtime_error("Unknown BVH builder: " + builder);
+    }
+}
+
+std::string Settings::StringFromBVHBuilder(BVHBuilder builder)
+{
+    switch (builder) {
+    case BVHBuilder::SAH:
+        return "sah";
+    case BVHBuilder::LBVH:
+        return "lbvh";
+    case BVHBuilder::SBVH:
+        return "sbvh";
+    default:
+        throw std::runtime_error("Unknown BVH builder");
+    }
+}
 
 std::string Settings::projectPath() const
 {
@@ -149,6 +246,30 @@ void Settings::checkSettings() const {
             throw std::runtime_error("no such pixel to debug");
         }
     }
+    if (sahBins < 2) {
+        throw std::runtime_error("sahBins must be at least 2");
+    }
+    if (kdTreeLazyDepth > 0 && kdTreeRopes) {
+        throw std::runtime_error("kdTreeLazyDepth does not support kdTreeRopes");
+    }
+    if (gridDensity <= 0.f) {
+        throw std::runtime_error("gridDensity must be positive");
+    }
+    if (sbvhDuplication < 1.f) {
+        throw std::runtime_error("sbvhDuplication must be at least 1");
+    }
+    if (bvhWidth != 2 && bvhWidth != 4 && bvhWidth != 8) {
+        throw std::runtime_error("bvhWidth must be 2, 4 or 8");
+    }
+    if (quantizeBVHNodes && bvhWidth != 2) {
+        throw std::runtime_error("quantizeBVHNodes requires bvhWidth 2");
+    }
+    if (trianglePackWidth != 1 && trianglePackWidth != 4 && trianglePackWidth != 8) {
+        throw std::runtime_error("trianglePackWidth must be 1, 4 or 8");
+    }
+    if (refitRebuildThreshold < 1.f) {
+        throw std::runtime_error("refitRebuildThreshold must be at least 1");
+    }
 }
 
 Path Settings::getDiffFile(std::filesystem::path file) const
@@ -160,3 +281,8 @@ Path Settings::getSceneOutput() const
 {
     return Path(sceneLibraryDir) / "outputScenes";
 }
+
+Path Settings::getSceneCacheDir() const
+{
+    return Path(outputDir) / "sceneCache";
+}
@@ -0,0 +1,627 @@
+#include "include/TLAS.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <limits>
+
+#include "json.hpp"
+
+#include "include/TraceHit.h"
+#include "include/CRTTypes.h"
+#include "include/Scene.h"
+#include "include/Settings.h"
+#include "include/ThreadPool.h"
+#include "include/SceneCache.h"
+#include "include/RayPacket.h"
+
+void TLAS::build(const Scene& scene, AccelStructType newType, ThreadPool& pool)
+{
+	type = newType;
+	blases.clear();
+	blasFromMeshObject.clear();
+	buildBLASes(scene, 0, pool);
+	buildTopLevel(scene);
+}
+
+void TLAS::addMeshObjects(const Scene& scene, size_t firstMeshIdx, ThreadPool& pool)
+{
+	const size_t firstBLAS = blases.size();
+	buildBLASes(scene, firstMeshIdx, pool);
+	if (scene.settings->reorderNodes) {
+		for (size_t blasIdx = firstBLAS; blasIdx < blases.size(); ++blasIdx) {
+			reorderBLASNodes(blases[blasIdx]);
+		}
+	}
+	buildTopLevel(scene);
+}
+
+void TLAS::removeMeshObject(const Scene& scene, size_t meshIdx)
+{
+	const uint32_t blasIdx = blasFromMeshObject[meshIdx];
+	blasFromMeshObject.erase(blasFromMeshObject.begin() + meshIdx);
+	if (std::find(blasFromMeshObject.begin(), blasFromMeshObject.end(), blasIdx) == blasFromMeshObject.end()) {
+		blases.erase(blases.begin() + blasIdx);
+		for (uint32_t& idx : blasFromMeshObject) {
+			if (idx > blasIdx) {
+				--idx;
+			}
+		}
+	}
+	buildTopLevel(scene);
+}
+
+void TLAS::buildBLASes(const Scene& scene, size_t firstMeshIdx, ThreadPool& pool)
+{
+	// Allocate every BLAS before the builds start, so that `blases` does not reallocate under them
+	blasFromMeshObject.resize(scene.meshObjects.size(), 0);
+	std::vector<size_t> builtMeshIdxs{};
+	for (size_t meshIdx = firstMeshIdx; meshIdx < scene.meshObjects.size(); ++meshIdx) {
+		if (scene.meshObjects[meshIdx].isInstance()) {
+			continue;
+		}
+		blasFromMeshObject[meshIdx] = uint32_t(blases.size());
+		blases.emplace_back();
+		builtMeshIdxs.push_back(meshIdx);
+	}
+
+	// One task per mesh, so that scenes of many small meshes build in parallel too. Large meshes fork inside their own build
+	std::atomic<size_t> pending{ 0 };
+	for (size_t meshIdx : builtMeshIdxs) {
+		pending.fetch_add(1);
+		pool.submit([this, &scene, &pool, meshIdx]() {
+			buildBLAS(scene, scene.meshObjects[meshIdx], blases[blasFromMeshObject[meshIdx]], pool);
+		}, pending);
+	}
+	pool.wait(pending);
+
+	// Instances of instances were resolved by `Scene::addInstance`
+	for (size_t meshIdx = firstMeshIdx; meshIdx < scene.meshObjects.size(); ++meshIdx) {
+		const MeshObject& meshObject = scene.meshObjects[meshIdx];
+		if (meshObject.isInstance()) {
+			blasFromMeshObject[meshIdx] = blasFromMeshObject[meshObject.instanceOf];
+		}
+	}
+}
+
+void TLAS::buildBLAS(const Scene& scene, const MeshObject& meshObject, BLAS& blas, ThreadPool& pool) const
+{
+	std::vector<uint32_t> triangleRefs{};
+	triangleRefs.reserve(meshObject.triangleIndexes.size());
+	blas.bounds = AABB::MakeEmpty();
+	for (size_t triIdx : meshObject.triangleIndexes) {
+		triangleRefs.push_back(uint32_t(triIdx));
+		blas.bounds.expand(scene.cacheTriangleAABBs[triIdx]);
+	}
+
+	switch (type) {
+	case AccelStructType::KDTREE:
+		blas.kdTree.build(std::move(triangleRefs), scene.cacheTriangleAABBs, scene.triangles, scene.vertices, *scene.settings, pool);
+		break;
+	case AccelStructType::BVH:
+		blas.bvh.build(std::move(triangleRefs), scene.cacheTriangleAABBs, scene.triangles, scene.vertices, *scene.settings,
+			scene.bvhBuilder, pool);
+		break;
+	case AccelStructType::GRID:
+		blas.grid.build(triangleRefs, scene.cacheTriangleAABBs, *scene.settings);
+		break;
+	default:
+		throw std::runtime_error("TLAS::buildBLAS: unknown AccelStructType");
+	}
+	buildBLASPacks(scene, blas);
+	buildBLASOccluders(scene, meshObject, blas);
+}
+
+void TLAS::buildBLASPacks(const Scene& scene, BLAS& blas) const
+{
+	switch (type) {
+	case AccelStructType::KDTREE:
+		blas.kdTree.buildPacks(scene);
+		break;
+	case AccelStructType::BVH:
+		blas.bvh.buildPacks(scene);
+		break;
+	case AccelStructType::GRID:
+		blas.grid.buildPacks(scene);
+		break;
+	default:
+		throw std::runtime_error("TLAS::buildBLASPacks: unknown AccelStructType");
+	}
+}
+
+void TLAS::buildBLASOccluders(const Scene& scene, const MeshObject& meshObject, BLAS& blas) const
+{
+	if (!scene.settings->occluderStructure) {
+		return;
+	}
+	std::vector<uint32_t> triangleRefs(meshObject.triangleIndexes.begin(), meshObject.triangleIndexes.end());
+	blas.occluders.build(scene, triangleRefs);
+}
+
+void TLAS::reorderBLASNodes(BLAS& blas) const
+{
+	// Grids have no nodes. Their cells are already in memory order
+	if (type == AccelStructType::BVH) {
+		blas.bvh.reorderNodes();
+	}
+	else if (type == AccelStructType::KDTREE) {
+		blas.kdTree.reorderNodes();
+	}
+}
+
+void TLAS::reorderNodes()
+{
+	for (BLAS& blas : blases) {
+		reorderBLASNodes(blas);
+	}
+}
+
+void TLAS::buildPacks(const Scene& scene)
+{
+	for (BLAS& blas : blases) {
+		buildBLASPacks(scene, blas);
+	}
+	for (size_t meshIdx = 0; meshIdx < scene.meshObjects.size(); ++meshIdx) {
+		const MeshObject& meshObject = scene.meshObjects[meshIdx];
+		if (!meshObject.isInstance()) {
+			buildBLASOccluders(scene, meshObject, blases[blasFromMeshObject[meshIdx]]);
+		}
+	}
+}
+
+void TLAS::updateGeometry(const Scene& scene, const std::vector<size_t>& meshObjectIdxs, ThreadPool& pool)
+{
+	std::vector<bool> updated(blases.size(), false);
+	for (size_t meshIdx : meshObjectIdxs) {
+		const uint32_t blasIdx = blasFromMeshObject[meshIdx];
+		if (updated[blasIdx]) {
+			continue; // another instance of the same mesh
+		}
+		updated[blasIdx] = true;
+
+		const MeshObject& meshObject = scene.meshObjects[meshIdx];
+		BLAS& blas = blases[blasIdx];
+		if (type == AccelStructType::BVH) {
+			blas.bounds = AABB::MakeEmpty();
+			for (size_t triIdx : meshObject.triangleIndexes) {
+				blas.bounds.expand(scene.cacheTriangleAABBs[triIdx]);
+			}
+			if (blas.bvh.refit(scene.cacheTriangleAABBs, *scene.settings) <= scene.settings->refitRebuildThreshold) {
+				GSceneMetrics.record("BLASRefit");
+				buildBLASPacks(scene, blas);
+				buildBLASOccluders(scene, meshObject, blas);
+				continue;
+			}
+		}
+		GSceneMetrics.record("BLASRebuild");
+		buildBLAS(scene, meshObject, blas, pool);
+		if (scene.settings->reorderNodes) {
+			reorderBLASNodes(blas);
+		}
+	}
+
+	buildTopLevel(scene);
+}
+
+void TLAS::buildTopLevel(const Scene& scene)
+{
+	instances.clear();
+	instances.reserve(scene.meshObjects.size());
+	for (size_t meshIdx = 0; meshIdx < scene.meshObjects.size(); ++meshIdx) {
+		const MeshObject& meshObject = scene.meshObjects[meshIdx];
+		Instance& instance = instances.emplace_back();
+		instance.blasIdx = blasFromMeshObject[meshIdx];
+		instance.pos = meshObject.pos;
+		instance.isIdentity = meshObject.mat.isIdentity() && meshObject.pos.lengthSquared() == 0.f;
+
+		Matrix3x3 localFromWorld = meshObject.mat.inverse();
+		instance.localFromWorld = localFromWorld;
+		instance.normalToWorld = localFromWorld.transposed();
+
+		// World bounds enclose the 8 transformed corners of the local bounds
+		const AABB& localBounds = blases[instance.blasIdx].bounds;
+		instance.worldBounds = AABB::MakeEmpty();
+		for (int corner = 0; corner < 8; ++corner) {
+			Vec3 local{
+				localBounds.bounds[corner & 1].x,
+				localBounds.bounds[(corner >> 1) & 1].y,
+				localBounds.bounds[(corner >> 2) & 1].z };
+			instance.worldBounds.expand(meshObject.mat * local + meshObject.pos);
+		}
+	}
+
+	nodes.clear();
+	instanceRefs.resize(instances.size());
+	for (size_t i = 0; i < instances.size(); ++i) {
+		instanceRefs[i] = uint32_t(i);
+	}
+	if (instances.empty()) {
+		return;
+	}
+
+	nodes.reserve(2 * instances.size());
+	nodes.emplace_back();
+	buildTopLevelRecursive(0, 0, uint32_t(instances.size()), 0);
+}
+
+void TLAS::buildTopLevelRecursive(uint32_t nodeIdx, uint32_t begin, uint32_t end, size_t depth)
+{
+	AABB nodeAabb = AABB::MakeEmpty();
+	AABB centerBounds = AABB::MakeEmpty();
+	for (uint32_t i = begin; i < end; ++i) {
+		const AABB& instanceBounds = instances[instanceRefs[i]].worldBounds;
+		nodeAabb.expand(instanceBounds);
+		centerBounds.expand(instanceBounds.center());
+	}
+	nodes[nodeIdx].aabb = nodeAabb;
+
+	if (end - begin <= maxInstancesPerLeaf || depth >= maxDepth - 1) {
+		nodes[nodeIdx].offset = begin;
+		nodes[nodeIdx].triangleCount = end - begin;
+		return;
+	}
+
+	const size_t axis = centerBounds.getMaxAxis();
+	const uint32_t mid = begin + (end - begin) / 2;
+	std::nth_element(instanceRefs.begin() + begin, instanceRefs.begin() + mid, instanceRefs.begin() + end,
+		[&](uint32_t a, uint32_t b) {
+			return instances[a].worldBounds.center().axis(axis) < instances[b].worldBounds.center().axis(axis);
+		});
+
+	// Siblings are stored next to each other, see `BVHNode::offset`
+	const uint32_t firstChild = uint32_t(nodes.size());
+	nodes[nodeIdx].offset = firstChild;
+	nodes[nodeIdx].triangleCount = 0;
+	nodes.emplace_back();
+	nodes.emplace_back();
+	buildTopLevelRecursive(firstChild, begin, mid, depth + 1);
+	buildTopLevelRecursive(firstChild + 1, mid, end, depth + 1);
+}
+
+void TLAS::traverse(const Scene& scene, const Ray& ray, TraceHit& out) const
+{
+	out.t = std::numeric_limits<float>::max();
+	out.type = TraceHitType::OUT_OF_BOUNDS;
+	float rootEntry;
+	if (nodes.empty() || !nodes[0].aabb.hasIntersection(ray, out.t, rootEntry)) {
+		return;
+	}
+
+	struct StackEntry {
+		uint32_t nodeIdx;
+		/* Distance at which the ray enters the node */
+		float tEntry;
+	};
+	std::array<StackEntry, maxDepth + 1> stack;
+	size_t stackSize = 0;
+	stack[stackSize++] = { 0, rootEntry };
+
+	while (stackSize > 0) {
+		const StackEntry entry = stack[--stackSize];
+		if (entry.tEntry > out.t) {
+			continue; // a closer hit was found after this node was pushed
+		}
+
+		const BVHNode& node = nodes[entry.nodeIdx];
+		if (node.isLeaf()) {
+			for (uint32_t i = node.offset; i < node.offset + node.triangleCount; ++i) {
+				intersectInstance(scene, ray, instances[instanceRefs[i]], out);
+			}
+			continue;
+		}
+
+		// Instances may overlap, so both children have to be visited. Visit the closer one first
+		float tEntry0, tEntry1;
+		bool hit0 = nodes[node.offset].aabb.hasIntersection(ray, out.t, tEntry0);
+		bool hit1 = nodes[node.offset + 1].aabb.hasIntersection(ray, out.t, tEntry1);
+		if (hit0 && hit1) {
+			if (tEntry0 <= tEntry1) {
+				stack[stackSize++] = { node.offset + 1, tEntry1 };
+				stack[stackSize++] = { node.offset, tEntry0 };
+			}
+			else {
+				stack[stackSize++] = { node.offset, tEntry0 };
+				stack[stackSize++] = { node.offset + 1, tEntry1 };
+			}
+		}
+		else if (hit0) {
+			stack[stackSize++] = { node.offset, tEntry0 };
+		}
+		else if (hit1) {
+			stack[stackSize++] = { node.offset + 1, tEntry1 };
+		}
+	}
+}
+
+void TLAS::traverseBLAS(const Scene& scene, const BLAS& blas, const Ray& ray, TraceHit& out) const
+{
+	switch (type) {
+	case AccelStructType::KDTREE:
+		blas.kdTree.traverse(scene, ray, out);
+		break;
+	case AccelStructType::BVH:
+		blas.bvh.traverse(scene, ray, out);
+		break;
+	case AccelStructType::GRID:
+		blas.grid.traverse(scene, ray, out);
+		break;
+	default:
+		throw std::runtime_error("TLAS::traverseBLAS: unknown AccelStructType");
+	}
+}
+
+void TLAS::intersectInstance(const Scene& scene, const Ray& ray, const Instance& instance, TraceHit& out) const
+{
+	const BLAS& blas = blases[instance.blasIdx];
+	TraceHit hit{};
+	if (instance.isIdentity) {
+		traverseBLAS(scene, blas, ray, hit);
+		if (hit.successful() && hit.t < out.t) {
+			out = hit;
+		}
+		return;
+	}
+
+	float scale;
+	const Ray localRay = toLocalRay(ray, instance, scale);
+	traverseBLAS(scene, blas, localRay, hit);
+	mergeLocalHit(ray, instance, scale, hit, out);
+}
+
+Ray TLAS::toLocalRay(const Ray& ray, const Instance& instance, float& scale)
+{
+	// Triangle::intersect expects a unit direction. `scale` converts local distances back to world distances
+	Vec3 localDir = instance.localFromWorld * ray.getDirection();
+	scale = localDir.length();
+	localDir = localDir / scale;
+	return { instance.localFromWorld * (ray.origin - instance.pos), localDir };
+}
+
+void TLAS::mergeLocalHit(const Ray& ray, const Instance& instance, float scale, const TraceHit& localHit, TraceHit& out)
+{
+	if (!localHit.successful()) {
+		return;
+	}
+	const float t = localHit.t / scale;
+	if (t >= out.t) {
+		return;
+	}
+
+	out = localHit;
+	out.t = t;
+	out.p = ray.origin + ray.getDirection() * t;
+	out.n = instance.normalToWorld * localHit.n;
+	out.n.normalize();
+}
+
+void TLAS::traversePacket(const Scene& scene, const RayPacket& packet, TraceHit* outHits) const
+{
+	const std::vector<Ray>& rays = packet.getRays();
+	for (size_t i = 0; i < rays.size(); ++i) {
+		outHits[i].t = std::numeric_limits<float>::max();
+		outHits[i].type = TraceHitType::OUT_OF_BOUNDS;
+	}
+	if (nodes.empty()) {
+		return;
+	}
+
+	// Instances may overlap and the packet has no single entry distance, so children are visited in any order
+	std::array<uint32_t, maxDepth + 1> stack;
+	size_t stackSize = 0;
+	stack[stackSize++] = 0;
+	float packetMaxT = std::numeric_limits<float>::max();
+
+	while (stackSize > 0) {
+		const BVHNode& node = nodes[stack[--stackSize]];
+		if (!packet.mayHit(node.aabb, packetMaxT)) {
+			continue;
+		}
+
+		if (node.isLeaf()) {
+			for (uint32_t i = node.offset; i < node.offset + node.triangleCount; ++i) {
+				intersectInstancePacket(scene, packet, instances[instanceRefs[i]], outHits);
+			}
+			packetMaxT = 0.f;
+			for (size_t i = 0; i < rays.size(); ++i) {
+				packetMaxT = std::max(packetMaxT, outHits[i].t);
+			}
+			continue;
+		}
+
+		stack[stackSize++] = node.offset + 1;
+		stack[stackSize++] = node.offset;
+	}
+}
+
+void TLAS::intersectInstancePacket(const Scene& scene, const RayPacket& packet, const Instance& instance, TraceHit* outHits) const
+{
+	const std::vector<Ray>& rays = packet.getRays();
+	auto intersectEach = [&]() {
+		for (size_t i = 0; i < rays.size(); ++i) {
+			intersectInstance(scene, rays[i], instance, outHits[i]);
+		}
+	};
+
+	// Only kd-trees have a packet traversal
+	if (type != AccelStructType::KDTREE) {
+		intersectEach();
+		return;
+	}
+
+	const BLAS& blas = blases[instance.blasIdx];
+	std::vector<TraceHit> localHits(rays.size());
+	if (instance.isIdentity) {
+		blas.kdTree.traversePacket(scene, packet, localHits.data());
+		for (size_t i = 0; i < rays.size(); ++i) {
+			if (localHits[i].successful() && localHits[i].t < outHits[i].t) {
+				outHits[i] = localHits[i];
+			}
+		}
+		return;
+	}
+
+	std::vector<Ray> localRays;
+	std::vector<float> scales(rays.size());
+	localRays.reserve(rays.size());
+	for (size_t i = 0; i < rays.size(); ++i) {
+		localRays.push_back(toLocalRay(rays[i], instance, scales[i]));
+	}
+	// A rotated placement can turn some directions across an axis of the local space
+	const RayPacket localPacket{ std::move(localRays) };
+	if (!localPacket.isCoherent()) {
+		GSceneMetrics.record("RayPacketDiverged");
+		intersectEach();
+		return;
+	}
+
+	blas.kdTree.traversePacket(scene, localPacket, localHits.data());
+	for (size_t i = 0; i < rays.size(); ++i) {
+		mergeLocalHit(rays[i], instance, scales[i], localHits[i], outHits[i]);
+	}
+}
+
+bool TLAS::isOccluded(const Scene& scene, const Vec3& start, const Vec3& end) const
+{
+	if (nodes.empty()) {
+		return false;
+	}
+
+	Vec3 dir = end - start;
+	const float maxT = dir.length();
+	dir.normalize();
+	const Ray ray{ start, dir };
+
+	float tEntry;
+	if (!nodes[0].aabb.hasIntersection(ray, maxT, tEntry)) {
+		return false;
+	}
+
+	std::array<uint32_t, maxDepth + 1> stack;
+	size_t stackSize = 0;
+	stack[stackSize++] = 0;
+
+	while (stackSize > 0) {
+		const BVHNode& node = nodes[stack[--stackSize]];
+		if (node.isLeaf()) {
+			for (uint32_t i = node.offset; i < node.offset + node.triangleCount; ++i) {
+				if (instanceOccludes(scene, instances[instanceRefs[i]], start, end)) {
+					return true;
+				}
+			}
+			continue;
+		}
+
+		if (nodes[node.offset].aabb.hasIntersection(ray, maxT, tEntry)) {
+			stack[stackSize++] = node.offset;
+		}
+		if (nodes[node.offset + 1].aabb.hasIntersection(ray, maxT, tEntry)) {
+			stack[stackSize++] = node.offset + 1;
+		}
+	}
+	return false;
+}
+
+bool TLAS::instanceOccludes(const Scene& scene, const Instance& instance, const Vec3& start, const Vec3& end) const
+{
+	// The placement is affine, so the transformed segment crosses exactly the triangles the world segment crosses
+	Vec3 localStart = start;
+	Vec3 localEnd = end;
+	if (!instance.isIdentity) {
+		localStart = instance.localFromWorld * (start - instance.pos);
+		localEnd = instance.localFromWorld * (end - instance.pos);
+	}
+
+	const BLAS& blas = blases[instance.blasIdx];
+	if (scene.settings->occluderStructure) {
+		return blas.occluders.isOccluded(localStart, localEnd);
+	}
+	switch (type) {
+	case AccelStructType::KDTREE:
+		return blas.kdTree.isOccluded(scene, localStart, localEnd);
+	case AccelStructType::BVH:
+		return blas.bvh.isOccluded(scene, localStart, localEnd);
+	case AccelStructType::GRID:
+		return blas.grid.isOccluded(scene, localStart, localEnd);
+	default:
+		throw std::runtime_error("TLAS::instanceOccludes: unknown AccelStructType");
+	}
+}
+
+void TLAS::getBVHNodeBytes(size_t& traversalBytes, size_t& binaryBytes) const
+{
+	traversalBytes = 0;
+	binaryBytes = 0;
+	if (type != AccelStructType::BVH) {
+		return;
+	}
+	for (const BLAS& blas : blases) {
+		traversalBytes += blas.bvh.getTraversalNodeBytes();
+		binaryBytes += blas.bvh.getBinaryNodeBytes();
+	}
+}
+
+void TLAS::writeCache(CacheWriter& writer) const
+{
+	writer.write(type);
+	writer.writeVector(blasFromMeshObject);
+	writer.write<uint64_t>(blases.size());
+	for (const BLAS& blas : blases) {
+		writer.write(blas.bounds);
+		if (type == AccelStructType::BVH) {
+			blas.bvh.writeCache(writer);
+		}
+		else if (type == AccelStructType::GRID) {
+			blas.grid.writeCache(writer);
+		}
+		else {
+			blas.kdTree.writeCache(writer);
+		}
+	}
+}
+
+void TLAS::readCache(CacheReader& reader, AccelStructType expectedType)
+{
+	type = reader.read<AccelStructType>();
+	if (type != expectedType) {
+		throw std::runtime_error("TLAS::readCache: AccelStructType mismatch");
+	}
+	reader.readVector(blasFromMeshObject);
+
+	blases.clear();
+	blases.resize(size_t(reader.read<uint64_t>()));
+	for (BLAS& blas : blases) {
+		blas.bounds = reader.read<AABB>();
+		if (type == AccelStructType::BVH) {
+			blas.bvh.readCache(reader);
+		}
+		else if (type == AccelStructType::GRID) {
+			blas.grid.readCache(reader);
+		}
+		else {
+			blas.kdTree.readCache(reader);
+		}
+	}
+
+	for (uint32_t blasIdx : blasFromMeshObject) {
+		if (blasIdx >= blases.size()) {
+			throw std::runtime_error("TLAS::readCache: BLAS index out of range");
+		}
+	}
+}
+
+TLAS::json TLAS::toJson() const
+{
+	json j{};
+	j["instanceCount"] = instances.size();
+	j["blases"] = json::array();
+	for (const BLAS& blas : blases) {
+		j["blases"].push_back(type == AccelStructType::BVH ? blas.bvh.toJson() :
+			type == AccelStructType::GRID ? blas.grid.toJson() : blas.kdTree.toJson());
+	}
+	return j;
+}
+
+std::string TLAS::toString() const
+{
+	return toJson().dump(4);
+}
@@ -0,0 +1,108 @@
+#include "include/ThreadPool.h"
+
+#include <algorithm>
+
+#include "include/Globals.h"
+
+ThreadPool::ThreadPool(size_t numWorkers)
+{
+	workers.reserve(numWorkers);
+	for (size_t i = 0; i < numWorkers; ++i) {
+		workers.emplace_back(&ThreadPool::workerLoop, this);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock{ tasksMutex };
+		stopping = true;
+	}
+	tasksAvailable.notify_all();
+	for (auto& worker : workers) {
+		if (worker.joinable()) {
+			worker.join();
+		}
+	}
+}
+
+void ThreadPool::submit(std::function<void()> task, std::atomic<size_t>& pending)
+{
+	auto wrapped = [task = std::move(task), &pending]() {
+		task();
+		pending.fetch_sub(1);
+	};
+
+	if (workers.empty()) {
+		wrapped();
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock{ tasksMutex };
+		tasks.emplace_back(std::move(wrapped));
+	}
+	tasksAvailable.notify_one();
+}
+
+void ThreadPool::wait(const std::atomic<size_t>& pending)
+{
+	while (pending.load() > 0) {
+		if (!runOne()) {
+			std::this_thread::yield(); // our tasks are running on other threads
+		}
+	}
+}
+
+void ThreadPool::parallelFor(size_t count, size_t chunkSize, const std::function<void(size_t, size_t)>& body)
+{
+	chunkSize = std::max<size_t>(chunkSize, 1);
+	if (count <= chunkSize) {
+		body(0, count);
+		return;
+	}
+
+	std::atomic<size_t> pending{ 0 };
+	// The calling thread takes the first chunk
+	for (size_t begin = chunkSize; begin < count; begin += chunkSize) {
+		size_t end = std::min(begin + chunkSize, count);
+		pending.fetch_add(1);
+		submit([&body, begin, end]() { body(begin, end); }, pending);
+	}
+	body(0, chunkSize);
+	wait(pending);
+}
+
+bool ThreadPool::runOne()
+{
+	std::function<void()> task;
+	{
+		std::lock_guard<std::mutex> lock{ tasksMutex };
+		if (tasks.empty()) {
+			return false;
+		}
+		task = std::move(tasks.front());
+		tasks.pop_front();
+	}
+	task();
+	return true;
+}
+
+void ThreadPool::workerLoop()
+{
+	// Several pools may run at once, e.g. during a build and a render. Their workers share one metrics slot
+	GThreadIdx = Metrics::sharedThreadIdx;
+	while (true) {
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock{ tasksMutex };
+			tasksAvailable.wait(lock, [this]() { return stopping || !tasks.empty(); });
+			if (stopping && tasks.empty()) {
+				return;
+			}
+			task = std::move(tasks.front());
+			tasks.pop_front();
+		}
+		task();
+	}
+}
@@ -55,33 +55,52 @@ bool Triangle::hasVertex(size_t vertexIndex) const {
 void Triangle::intersect(const Scene& scene, const Ray& ray, size_t triRef, TraceHit& hit) const {
     assertFEqual(ray.getDirection().lengthSquared(), 1.f);
     GSceneMetrics.record("TriangleIntersection");
-    if (!scene.cacheTriangleAABBs[triRef].hasIntersection(ray)) return;
 
-	hit.triRef = triRef;
-    float rayProj = ray.getDirection().dot(normal);
-
-    if (rayProj < -1e-6) { // normal is facing ray
-        computeHit(scene, ray, rayProj, hit);
+    bool frontFacing;
+    float t, baryU, baryV;
+    if (!scene.cacheTriangleRecords[triRef].intersect(ray, hit.t, t, baryU, baryV, frontFacing)) {
+        hit.type = TraceHitType::OUT_OF_BOUNDS;
+        return;
     }
-    else if (rayProj > 1e-6) { // normal is facing away from ray
-        auto& material = scene.materials[materialIndex];
-        if (material.type == Material::Type::REFRACTIVE) {
-            Triangle swapT = swappedTriangle();
-            swapT.intersect(scene, ray, triRef, hit);
-            if (hit.type == TraceHitType::SUCCESS) {
-                hit.type = TraceHitType::INSIDE_REFRACTIVE;
-                hit.n = -hit.n;
-                assert(dot(hit.n, ray.getDirection()) > 1e-6); // ray is exiting refractive material
-            }
-        }
-        else {
-            hit.type = TraceHitType::PLANE_BACKFACE;
-        }
+    if (!frontFacing && scene.materials[materialIndex].type != Material::Type::REFRACTIVE) {
+        hit.type = TraceHitType::PLANE_BACKFACE;
+        return;
     }
-    else {
-        hit.type = TraceHitType::PARALLEL;
+    computeHit(scene, ray, triRef, t, baryU, baryV, frontFacing, hit);
+}
+
+void Triangle::computeHit(const Scene& scene, const Ray& ray, size_t triRef, float t, float baryU, float baryV, bool frontFacing,
+    TraceHit& hit) const {
+    hit.triRef = triRef;
+    hit.t = t;
+    hit.p = ray.origin + ray.getDirection() * t;
+    hit.baryU = baryU;
+    hit.baryV = baryV;
+    float baryW = 1.0f - baryU - baryV;
+    const Vec3& uvMap0 = scene.uvs[v[0]];
+    const Vec3& uvMap1 = scene.uvs[v[1]];
+    const Vec3& uvMap2 = scene.uvs[v[2]];
+    hit.u = uvMap0.x * baryW + uvMap1.x * baryU + uvMap2.x * baryV;
+    hit.v = uvMap0.y * baryW + uvMap1.y * baryU + uvMap2.y * baryV;
+    hit.materialIndex = materialIndex;
+
+    if (frontFacing) {
+        hit.n = hitNormal(scene, hit);
+        hit.type = getTraceHitType(hit.n, ray.getDirection());
+        assertHit(scene, hit);
+        return;
     }
 
+    // Ray is exiting a refractive object. Classify with the normal of the reversed face, then report the outward normal
+    Vec3 exitN = scene.materials[materialIndex].smoothShading ? hitNormal(scene, hit) : -normal;
+    hit.type = getTraceHitType(exitN, ray.getDirection());
+    if (hit.type == TraceHitType::SUCCESS) {
+        hit.type = TraceHitType::INSIDE_REFRACTIVE;
+        exitN = -exitN;
+        assert(dot(exitN, ray.getDirection()) > 1e-6); // ray is exiting refractive material
+    }
+    hit.n = exitN;
+    assertHit(scene, hit);
 }
 
 bool Triangle::fastIntersect(const Scene& scene, const Vec3& start, const Vec3& end) const
@@ -99,58 +118,6 @@ bool Triangle::fastIntersect(const Scene& scene, const Vec3& start, const Vec3&
     return false;
 }
 
-void Triangle::computeHit(const Scene& scene, const Ray& ray, float rProj, TraceHit& hit) const {
-    const Vec3& n = normal;
-    const Vec3& v0 = scene.vertices[v[0]];
-    const Vec3& v1 = scene.vertices[v[1]];
-    const Vec3& v2 = scene.vertices[v[2]];
-
-    // Here assuming counter-clockwise order
-    Vec3 e0 = v1 - v0;
-    Vec3 e1 = v2 - v0;
-    float rpDist = dot(n, v0 - ray.origin); // Ray-Plane distance
-    hit.t = rpDist / rProj;
-    if (hit.t < 0) {
-        hit.type = TraceHitType::PLANE_BEHIND_RAY_ORIGIN;
-        return;
-    }
-    hit.p = ray.origin + ray.getDirection() * hit.t;
-
-    // check if `p` is inside triangle
-    Vec3 v0p = hit.p - v0;
-    Vec3 e2 = v2 - v1;
-    Vec3 c0 = cross(e0, v0p);
-    Vec3 c1 = cross(v0p, e1);
-    Vec3 c2 = cross(e2, hit.p - v1);
-
-    bool inside = dot(n, c0) > -1e-6 &&
-        dot(n, c1) > -1e-6 &&
-        dot(n, c2) > -1e-6;
-
-    if (inside) {
-        float area_inv = 1.f / e0.crossLength(e1);
-        hit.baryU = c1.length() * area_inv;
-        hit.baryV = c0.length() * area_inv;
-        float baryW = 1.0f - hit.baryU - hit.baryV;
-        const Vec3& uvMap0 = scene.uvs[v[0]];
-        const Vec3& uvMap1 = scene.uvs[v[1]];
-        const Vec3& uvMap2 = scene.uvs[v[2]];
-
-        hit.u = uvMap0.x * baryW + uvMap1.x * hit.baryU + uvMap2.x * hit.baryV;
-        hit.v = uvMap0.y * baryW + uvMap1.y * hit.baryU + uvMap2.y * hit.baryV;
-
-        hit.materialIndex = this->materialIndex;
-        hit.n = hitNormal(scene, hit);
-        hit.type = getTraceHitType(hit.n, ray.getDirection());
-        assertHit(scene, hit);
-        return;
-    }
-    else {
-        hit.type = TraceHitType::OUT_OF_BOUNDS;
-        return;
-    }
-}
-
 TraceHitType Triangle::getTraceHitType(const Vec3& n, const Vec3& rayDir) {
     float rProj = dot(rayDir, n);
     if (rProj < -epsilon) {
@@ -180,20 +147,6 @@ void Triangle::assertHit(const Scene& scene, const TraceHit& hit) {
 #endif
 }
 
-Triangle Triangle::swappedTriangle() const
-{
-    Triangle t = *this;
-    t.swapFace();
-    return t;
-}
-
-void Triangle::swapFace() {
-    auto v2buff = v[2];
-    v[2] = v[1];
-    v[1] = v2buff;
-    normal = -normal;
-}
-
 bool Triangle::intersect_plane(const std::vector<Vec3>& vertices, const Ray& ray, float& t, Vec3& p) const {
     const Vec3& v0 = vertices[v[0]];
     const Vec3& v1 = vertices[v[1]];
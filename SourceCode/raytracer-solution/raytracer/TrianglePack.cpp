@@ -0,0 +1,256 @@
+#include "include/TrianglePack.h"
+
+#include <algorithm>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <immintrin.h>
+#define TRIANGLE_PACK_SSE
+#endif
+
+#include "include/TraceHit.h"
+#include "include/CRTTypes.h"
+#include "include/Scene.h"
+#include "include/Triangle.h"
+#include "include/TriangleRecord.h"
+#include "include/Mailbox.h"
+
+/* Rays this close to a triangle's plane miss it. Same as `TriangleRecord::intersect` */
+static constexpr float packParallelEpsilon = 1e-12f;
+
+/* Two-sided Moller-Trumbore test of a ray against all lanes of a pack. See `TriangleRecord::intersect`.
+*  @return bit i is set if the ray hits lane i in [0, maxT) from a side the lane accepts, see `TrianglePack::backfaceMask`.
+*  `tHits[i]`, `baryUs[i]`, `baryVs[i]` and bit i of `frontMask` are only meaningful for set bits */
+template <size_t Width>
+static uint32_t intersectPack(const TrianglePack<Width>& pack, const Ray& ray, float maxT,
+	float* tHits, float* baryUs, float* baryVs, uint32_t& frontMask)
+{
+	uint32_t hitMask = 0;
+	frontMask = 0;
+	for (size_t lane = 0; lane < Width; ++lane) {
+		TriangleRecord record{};
+		for (int axis = 0; axis < 3; ++axis) {
+			record.v0.axis(axis) = pack.v0[axis][lane];
+			record.e1.axis(axis) = pack.e1[axis][lane];
+			record.e2.axis(axis) = pack.e2[axis][lane];
+		}
+		bool frontFacing;
+		if (record.intersect(ray, maxT, tHits[lane], baryUs[lane], baryVs[lane], frontFacing)) {
+			frontMask |= uint32_t(frontFacing) << lane;
+			hitMask |= 1u << lane;
+		}
+	}
+	return hitMask & (frontMask | pack.backfaceMask);
+}
+
+#ifdef TRIANGLE_PACK_SSE
+static uint32_t intersectPack(const TrianglePack<4>& pack, const Ray& ray, float maxT,
+	float* tHits, float* baryUs, float* baryVs, uint32_t& frontMask)
+{
+	const Vec3& dir = ray.getDirection();
+	const __m128 dx = _mm_set1_ps(dir.x);
+	const __m128 dy = _mm_set1_ps(dir.y);
+	const __m128 dz = _mm_set1_ps(dir.z);
+	const __m128 e1x = _mm_load_ps(pack.e1[0]);
+	const __m128 e1y = _mm_load_ps(pack.e1[1]);
+	const __m128 e1z = _mm_load_ps(pack.e1[2]);
+	const __m128 e2x = _mm_load_ps(pack.e2[0]);
+	const __m128 e2y = _mm_load_ps(pack.e2[1]);
+	const __m128 e2z = _mm_load_ps(pack.e2[2]);
+
+	// pvec = dir x e2, det = e1 . pvec
+	const __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+	const __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+	const __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+	const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+	const __m128 invDet = _mm_div_ps(_mm_set1_ps(1.f), det);
+
+	// tvec = origin - v0, u = (tvec . pvec) / det
+	const __m128 tx = _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_load_ps(pack.v0[0]));
+	const __m128 ty = _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_load_ps(pack.v0[1]));
+	const __m128 tz = _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_load_ps(pack.v0[2]));
+	const __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+
+	// qvec = tvec x e1, v = (dir . qvec) / det, t = (e2 . qvec) / det
+	const __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+	const __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+	const __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+	const __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+	const __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+
+	// Ordered comparisons are false for the NaNs of parallel lanes
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 absDet = _mm_andnot_ps(_mm_set1_ps(-0.f), det);
+	__m128 valid = _mm_cmpgt_ps(absDet, _mm_set1_ps(packParallelEpsilon));
+	valid = _mm_and_ps(valid, _mm_cmpge_ps(u, zero));
+	valid = _mm_and_ps(valid, _mm_cmpge_ps(v, zero));
+	valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.f)));
+	valid = _mm_and_ps(valid, _mm_cmpge_ps(t, zero));
+	valid = _mm_and_ps(valid, _mm_cmplt_ps(t, _mm_set1_ps(maxT)));
+
+	_mm_storeu_ps(tHits, t);
+	_mm_storeu_ps(baryUs, u);
+	_mm_storeu_ps(baryVs, v);
+	frontMask = uint32_t(_mm_movemask_ps(_mm_cmpgt_ps(det, zero)));
+	return uint32_t(_mm_movemask_ps(valid)) & (frontMask | pack.backfaceMask);
+}
+#endif
+
+#ifdef __AVX__
+static uint32_t intersectPack(const TrianglePack<8>& pack, const Ray& ray, float maxT,
+	float* tHits, float* baryUs, float* baryVs, uint32_t& frontMask)
+{
+	const Vec3& dir = ray.getDirection();
+	const __m256 dx = _mm256_set1_ps(dir.x);
+	const __m256 dy = _mm256_set1_ps(dir.y);
+	const __m256 dz = _mm256_set1_ps(dir.z);
+	const __m256 e1x = _mm256_load_ps(pack.e1[0]);
+	const __m256 e1y = _mm256_load_ps(pack.e1[1]);
+	const __m256 e1z = _mm256_load_ps(pack.e1[2]);
+	const __m256 e2x = _mm256_load_ps(pack.e2[0]);
+	const __m256 e2y = _mm256_load_ps(pack.e2[1]);
+	const __m256 e2z = _mm256_load_ps(pack.e2[2]);
+
+	// pvec = dir x e2, det = e1 . pvec
+	const __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+	const __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+	const __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+	const __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+	const __m256 invDet = _mm256_div_ps(_mm256_set1_ps(1.f), det);
+
+	// tvec = origin - v0, u = (tvec . pvec) / det
+	const __m256 tx = _mm256_sub_ps(_mm256_set1_ps(ray.origin.x), _mm256_load_ps(pack.v0[0]));
+	const __m256 ty = _mm256_sub_ps(_mm256_set1_ps(ray.origin.y), _mm256_load_ps(pack.v0[1]));
+	const __m256 tz = _mm256_sub_ps(_mm256_set1_ps(ray.origin.z), _mm256_load_ps(pack.v0[2]));
+	const __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz)), invDet);
+
+	// qvec = tvec x e1, v = (dir . qvec) / det, t = (e2 . qvec) / det
+	const __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+	const __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+	const __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+	const __m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), invDet);
+	const __m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), invDet);
+
+	// Ordered comparisons are false for the NaNs of parallel lanes
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 absDet = _mm256_andnot_ps(_mm256_set1_ps(-0.f), det);
+	__m256 valid = _mm256_cmp_ps(absDet, _mm256_set1_ps(packParallelEpsilon), _CMP_GT_OQ);
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(_mm256_add_ps(u, v), _mm256_set1_ps(1.f), _CMP_LE_OQ));
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, zero, _CMP_GE_OQ));
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, _mm256_set1_ps(maxT), _CMP_LT_OQ));
+
+	_mm256_storeu_ps(tHits, t);
+	_mm256_storeu_ps(baryUs, u);
+	_mm256_storeu_ps(baryVs, v);
+	frontMask = uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(det, zero, _CMP_GT_OQ)));
+	return uint32_t(_mm256_movemask_ps(valid)) & (frontMask | pack.backfaceMask);
+}
+#endif
+
+template <size_t Width>
+static void buildPacks(const Scene& scene, const std::vector<uint32_t>& triangleRefs, std::vector<TrianglePack<Width>>& packs)
+{
+	packs.clear();
+	packs.resize((triangleRefs.size() + Width - 1) / Width);
+	for (size_t i = 0; i < triangleRefs.size(); ++i) {
+		TrianglePack<Width>& pack = packs[i / Width];
+		const size_t lane = i % Width;
+		const uint32_t triRef = triangleRefs[i];
+		const TriangleRecord& record = scene.cacheTriangleRecords[triRef];
+		for (int axis = 0; axis < 3; ++axis) {
+			pack.v0[axis][lane] = record.v0.axis(axis);
+			pack.e1[axis][lane] = record.e1.axis(axis);
+			pack.e2[axis][lane] = record.e2.axis(axis);
+		}
+		pack.triRef[lane] = triRef;
+		const Material& material = scene.materials[scene.triangles[triRef].materialIndex];
+		if (material.type == Material::Type::REFRACTIVE) {
+			pack.backfaceMask |= 1u << lane;
+		}
+	}
+}
+
+template <size_t Width>
+static void intersectPacks(const std::vector<TrianglePack<Width>>& packs, const Scene& scene, const Ray& ray,
+	uint32_t offset, uint32_t count, TraceHit& out, ScopedCounter& packTests, Mailbox* mailbox)
+{
+	alignas(32) float tHits[Width];
+	alignas(32) float baryUs[Width];
+	alignas(32) float baryVs[Width];
+	const TrianglePack<Width>* pack = packs.data() + offset / Width;
+	for (uint32_t first = 0; first < count; first += uint32_t(Width), ++pack) {
+		// Lanes past the end of the leaf are padding, see `alignLeaf`
+		const uint32_t laneCount = std::min(uint32_t(Width), count - first);
+		uint32_t laneMask = (1u << laneCount) - 1;
+		if (mailbox) {
+			for (uint32_t lane = 0; lane < laneCount; ++lane) {
+				if (mailbox->checkAndRecord(pack->triRef[lane])) {
+					laneMask &= ~(1u << lane);
+				}
+			}
+			if (laneMask == 0) {
+				continue;
+			}
+		}
+
+		packTests.increment();
+		uint32_t frontMask;
+		uint32_t hitMask = intersectPack(*pack, ray, out.t, tHits, baryUs, baryVs, frontMask) & laneMask;
+
+		// Closest lane first. A geometric hit still fails if its shading normal faces away, then the next lane is tried
+		while (hitMask != 0) {
+			uint32_t closest = 0;
+			float closestT = std::numeric_limits<float>::max();
+			for (uint32_t lane = 0; lane < Width; ++lane) {
+				if ((hitMask & (1u << lane)) && tHits[lane] < closestT) {
+					closest = lane;
+					closestT = tHits[lane];
+				}
+			}
+			hitMask &= ~(1u << closest);
+
+			const uint32_t triRef = pack->triRef[closest];
+			TraceHit hit{};
+			scene.triangles[triRef].computeHit(scene, ray, triRef, tHits[closest], baryUs[closest], baryVs[closest],
+				(frontMask & (1u << closest)) != 0, hit);
+			if (hit.successful()) {
+				out = hit; // closer than `out`, `intersectPack` was limited to out.t
+				break;
+			}
+		}
+	}
+}
+
+void TrianglePacks::build(const Scene& scene, const std::vector<uint32_t>& triangleRefs, size_t newWidth)
+{
+	width = newWidth;
+	packs4.clear();
+	packs8.clear();
+	if (width == 4) {
+		buildPacks(scene, triangleRefs, packs4);
+	}
+	else if (width == 8) {
+		buildPacks(scene, triangleRefs, packs8);
+	}
+}
+
+void TrianglePacks::intersectLeaf(const Scene& scene, const Ray& ray, uint32_t offset, uint32_t count, TraceHit& out,
+	ScopedCounter& packTests, Mailbox* mailbox) const
+{
+	if (width == 4) {
+		intersectPacks(packs4, scene, ray, offset, count, out, packTests, mailbox);
+	}
+	else if (width == 8) {
+		intersectPacks(packs8, scene, ray, offset, count, out, packTests, mailbox);
+	}
+}
+
+uint32_t TrianglePacks::alignLeaf(std::vector<uint32_t>& triangleRefs, size_t width)
+{
+	// Padding is never read as a triangle, `intersectPacks` masks lanes past the end of the leaf
+	const size_t aligned = (triangleRefs.size() + width - 1) / width * width;
+	triangleRefs.resize(aligned, 0);
+	return uint32_t(aligned);
+}
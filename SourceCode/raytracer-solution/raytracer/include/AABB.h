@@ -21,6 +21,12 @@ public:
     /* @brief Check if this AABB has an intersection with a ray */
     bool hasIntersection(const Ray& ray) const;
 
+    /* @brief Check if the ray enters this AABB before `maxT`. Write the entry distance to `tEntry` */
+    bool hasIntersection(const Ray& ray, float maxT, float& tEntry) const;
+
+    /* @brief Clip the ray against this AABB. [tEntry, tExit] is the part of the ray inside, clamped to [0, maxT] */
+    bool hasIntersection(const Ray& ray, float maxT, float& tEntry, float& tExit) const;
+
     /* @brief Get the distance to the nearest intersection with the AABB on the given axis */
     float distanceToAxis(size_t axis, const Vec3& point) const;
 
@@ -31,12 +37,31 @@ public:
     /* @brief box volume */
     float volume() const;
 
+    /* @brief box surface area. Used by the Surface Area Heuristic */
+    float surfaceArea() const;
+
     /* @brief Check if the AABB contains a point */
     bool contains(const Vec3& point) const;
 
     /* @brief Expand the AABB to include the point */
     void expand(const Vec3& point);
 
+    /* @brief Expand the AABB to include another AABB */
+    void expand(const AABB& other);
+
+    /* @brief Shrink the AABB to its overlap with `other`
+       @return false if they do not overlap */
+    bool intersectWith(const AABB& other);
+
+    /* @brief Bounds of the part of triangle (v0, v1, v2) inside this box. Used by builds that split triangles
+       @return false if no part of the triangle is inside. `out` is then unspecified */
+    bool clipTriangle(const Vec3& v0, const Vec3& v1, const Vec3& v2, AABB& out) const;
+
+    Vec3 center() const { return (bounds[0] + bounds[1]) * 0.5f; }
+
+    /* @brief An inverted AABB. Expanding it with anything yields that thing's bounds */
+    static AABB MakeEmpty() { return { Vec3::MakeMax(), Vec3::MakeLowest() }; }
+
     std::string toString() const;
 
     Vec3 bounds[2]{ Vec3{0.f, 0.f, 0.f}, Vec3{0.f, 0.f, 0.f} };
@@ -0,0 +1,162 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <cstdint>
+
+#include "json.hpp"
+
+#include "include/AABB.h"
+#include "include/BVHNode.h"
+#include "include/TrianglePack.h"
+#include "include/Settings.h"
+
+class Scene;
+class Triangle;
+class TraceHit;
+class Ray;
+class Mailbox;
+class ScopedCounter;
+class ThreadPool;
+class CacheWriter;
+class CacheReader;
+
+/* Bounding Volume Hierarchy built with binned SAH, from Morton codes or with spatial splits, see `BVHBuilder`.
+*  Unlike `KDTree`, every triangle is referenced by exactly one leaf, except for the duplicates of spatial splits.
+*  With `Settings::bvhWidth` 4 or 8 the binary tree is collapsed into a wide tree whose child boxes are tested with SIMD.
+*  With `Settings::quantizeBVHNodes` a binary tree is traversed through half-size `QuantizedBVHNode`s */
+class BVH
+{
+    using json = nlohmann::json;
+public:
+    BVH() = default;
+
+    /* @brief Build the hierarchy over `triangleRefs`. The SAH builders use the same SAH settings as `KDTree`.
+       Nodes larger than `parallelBuildThreshold` are processed on `pool`, except by the sequential SBVH build */
+    void build(std::vector<uint32_t>&& triangleRefs, const std::vector<AABB>& cacheTriangleAABBs,
+        const std::vector<Triangle>& triangles, const std::vector<Vec3>& vertices, const Settings& settings,
+        BVHBuilder builder, ThreadPool& pool);
+    /* @brief Update node bounds bottom-up after the referenced triangles moved. The tree topology is kept.
+       @return SAH cost of the refit tree divided by its cost right after `build`. Refitting degrades the tree when triangles move apart */
+    float refit(const std::vector<AABB>& cacheTriangleAABBs, const Settings& settings);
+    /* @brief Move the binary nodes into cache line and page sized treelets, see `NodeLayout`. Parents stay before children,
+       so `refit` still works. Wide trees are left as built */
+    void reorderNodes();
+    /* @brief intersect the BVH with a ray. Write the closest hit to `out` */
+    void traverse(const Scene& scene, const Ray& ray, TraceHit& out) const;
+    /* @brief Any-hit query for shadow rays. Returns on the first occluding triangle on the segment. No hit attributes are computed */
+    bool isOccluded(const Scene& scene, const Vec3& start, const Vec3& end) const;
+    /* @brief Pack the leaf triangles for SIMD intersection. Call after `build`, `refit`, `readCache` or whenever materials change */
+    void buildPacks(const Scene& scene);
+    /* @brief 2, 4 or 8. Decides which node array `traverse` uses */
+    size_t getWidth() const { return width; }
+    /* @brief Size of the node array that `traverse` reads */
+    size_t getTraversalNodeBytes() const;
+    /* @brief Binary nodes, parents before children. Leaves index `getTriangleRefs` */
+    const std::vector<BVHNode>& getNodes() const { return nodes; }
+    const std::vector<uint32_t>& getTriangleRefs() const { return triangleRefs; }
+    /* @brief Size the binary `BVHNode` array would have, for comparison with `getTraversalNodeBytes` */
+    size_t getBinaryNodeBytes() const { return nodes.size() * sizeof(BVHNode); }
+    void writeCache(CacheWriter& writer) const;
+    void readCache(CacheReader& reader);
+    json toJson() const;
+    std::string toString() const;
+
+private:
+    /* Hard limit on tree depth. Bounds the traversal stack */
+    static constexpr size_t maxDepth = 64;
+
+    /* SBVH: spatial splits are only tried where the children of the best object split overlap by more than this
+    *  fraction of the root's surface area. Elsewhere clipping triangles cannot pay off */
+    static constexpr float sbvhMinOverlapRatio = 1e-5f;
+
+    /* Triangle reference of the SBVH build. `bounds` is the part of the triangle inside the current node */
+    struct SpatialRef {
+        uint32_t triRef;
+        AABB bounds;
+    };
+
+    /* Read-only input of `buildSpatialRecursive` */
+    struct SpatialContext {
+        const std::vector<Triangle>& triangles;
+        const std::vector<Vec3>& vertices;
+        const Settings& settings;
+        float minOverlapArea;
+    };
+
+    /* @brief Build the subtree rooted at `outNodes[nodeIdx]`
+       @param [begin, end): range in `triangleRefs` owned by the node. Subtrees on other threads own disjoint ranges */
+    void buildRecursive(std::vector<BVHNode>& outNodes, uint32_t nodeIdx, uint32_t begin, uint32_t end,
+        const std::vector<AABB>& cacheTriangleAABBs, const Settings& settings, size_t depth, ThreadPool& pool);
+
+    /* @brief LBVH build. Sort `triangleRefs` along the Morton curve of their centroids, then split ranges where the codes
+       first differ. Linear in the triangle count apart from the sort */
+    void buildLinear(const std::vector<AABB>& cacheTriangleAABBs, const Settings& settings, ThreadPool& pool);
+
+    /* @brief Build the subtree of `buildLinear` rooted at `outNodes[nodeIdx]`. Bounds are merged bottom-up
+       @param mortonCodes: parallel to the sorted `triangleRefs` */
+    void buildLinearRecursive(std::vector<BVHNode>& outNodes, uint32_t nodeIdx, uint32_t begin, uint32_t end,
+        const std::vector<uint32_t>& mortonCodes, const std::vector<AABB>& cacheTriangleAABBs, const Settings& settings,
+        size_t depth, ThreadPool& pool);
+
+    /* @brief SBVH build. Every node takes the cheaper of the binned object split and a binned spatial split,
+       which clips the triangles crossing its plane into both children. Duplicates are limited by `Settings::sbvhDuplication` */
+    void buildSpatial(const std::vector<AABB>& cacheTriangleAABBs, const std::vector<Triangle>& triangles,
+        const std::vector<Vec3>& vertices, const Settings& settings);
+
+    /* @brief Build the subtree of `buildSpatial` rooted at `outNodes[nodeIdx]`. Leaves append to `outTriangleRefs`
+       @param refBudget: duplicates the rest of the build may still create */
+    static void buildSpatialRecursive(std::vector<BVHNode>& outNodes, std::vector<uint32_t>& outTriangleRefs, uint32_t nodeIdx,
+        std::vector<SpatialRef>&& refs, const SpatialContext& context, size_t& refBudget, size_t depth);
+
+    /* @brief Move a subtree that was built into a separate array under `outNodes[rootIdx]`. Rebases child indices */
+    static void appendSubtree(std::vector<BVHNode>& outNodes, uint32_t rootIdx, const std::vector<BVHNode>& subNodes);
+
+    /* @brief Collapse `nodes` into `wideNodes`. Each wide node adopts the grandchildren of its largest interior children
+       until all `Width` slots are used */
+    template <size_t Width>
+    void buildWide(std::vector<WideBVHNode<Width>>& wideNodes) const;
+
+    /* @brief Fill `quantizedNodes` from `nodes`. Top-down, children are quantized within the decoded bounds of their parent */
+    void buildQuantized();
+
+    void traverseQuantized(const Scene& scene, const Ray& ray, TraceHit& out) const;
+
+    bool isOccludedQuantized(const Scene& scene, const Ray& ray, float maxT, const Vec3& start, const Vec3& end) const;
+
+    template <size_t Width>
+    void traverseWide(const std::vector<WideBVHNode<Width>>& wideNodes, const Scene& scene, const Ray& ray, TraceHit& out) const;
+
+    template <size_t Width>
+    bool isOccludedWide(const std::vector<WideBVHNode<Width>>& wideNodes, const Scene& scene, const Ray& ray, float maxT,
+        const Vec3& start, const Vec3& end) const;
+
+    /* @param mailbox: triangles already tested by this query, or nullptr when no triangle is in two leaves */
+    bool leafOccludes(const Scene& scene, uint32_t offset, uint32_t triangleCount, const Vec3& start, const Vec3& end,
+        Mailbox* mailbox) const;
+
+    /* @param mailbox: as in `leafOccludes`
+       @param packTests: see `TrianglePacks::intersectLeaf` */
+    void intersectLeaf(const Scene& scene, const Ray& ray, uint32_t offset, uint32_t triangleCount, Mailbox* mailbox,
+        ScopedCounter& packTests, TraceHit& out) const;
+
+    /* @brief Move every leaf's triangle range to a multiple of `packWidth`, see `TrianglePacks::alignLeaf`. Before `buildWide` */
+    void alignLeaves(size_t packWidth);
+
+    json toJsonRecursive(uint32_t nodeIdx) const;
+
+    /* @brief Expected cost of a ray query by the Surface Area Heuristic, relative to the root's surface area */
+    float sahCost(const Settings& settings) const;
+
+    size_t width = 2;
+    /* Built by SBVH: leaves may share triangles, so traversals skip repeated tests with a `Mailbox` */
+    bool spatialSplits = false;
+    float builtSahCost = 0.f;
+    std::vector<BVHNode> nodes{};
+    /* Only the array matching `width` is filled */
+    std::vector<WideBVHNode<4>> nodes4{};
+    std::vector<WideBVHNode<8>> nodes8{};
+    /* Parallel to `nodes`. Empty unless `Settings::quantizeBVHNodes` */
+    std::vector<QuantizedBVHNode> quantizedNodes{};
+    std::vector<uint32_t> triangleRefs{};
+    TrianglePacks packs{};
+};
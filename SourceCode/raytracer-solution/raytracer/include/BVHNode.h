@@ -0,0 +1,174 @@
+#pragma once
+#include <cstdint>
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <cmath>
+#include <cstring>
+
+#include "include/AABB.h"
+
+/* Binary BVH node. 32 bytes. Lives in `BVH::nodes`.
+*  Siblings are stored next to each other, so only the first child index is stored */
+class BVHNode
+{
+public:
+    AABB aabb{};
+    /* leaf: offset into `BVH::triangleRefs`. interior: index of the first child. The second child is at `offset + 1` */
+    uint32_t offset = 0;
+    /* 0 for interior nodes */
+    uint32_t triangleCount = 0;
+
+    bool isLeaf() const { return triangleCount > 0; }
+};
+
+/* Binary BVH node whose two children's bounds are quantized to 8 bits within this node's own bounds. 16 bytes.
+*  Lives in `BVH::quantizedNodes`, parallel to `BVH::nodes`. Traversal decodes a node's bounds from its parent,
+*  so only the root's bounds are stored in full precision. Rounding is outward: a decoded box encloses the exact one */
+class QuantizedBVHNode
+{
+public:
+    static constexpr float steps = 255.f;
+
+    static QuantizedBVHNode MakeLeaf(uint32_t triangleOffset, uint32_t triangleCount)
+    {
+        QuantizedBVHNode node{};
+        node.payload = triangleOffset | leafFlag;
+        std::memcpy(node.childBounds, &triangleCount, sizeof(uint32_t));
+        return node;
+    }
+
+    /* @param box: decoded bounds of this node. @param children: exact bounds of its children, inside `box`.
+       Each step is checked with `dequantize`, the expression `decodeChild` uses, so the decoded children enclose the exact ones */
+    static QuantizedBVHNode MakeInterior(const AABB& box, const AABB* children, uint32_t firstChild)
+    {
+        QuantizedBVHNode node{};
+        node.payload = firstChild;
+        for (int axis = 0; axis < 3; ++axis) {
+            const float origin = box.bounds[0].axis(axis);
+            const float boxMax = box.bounds[1].axis(axis);
+            const float scale = getScale(box, axis);
+            for (int child = 0; child < 2; ++child) {
+                node.childBounds[child][0][axis] = quantizeMin(children[child].bounds[0].axis(axis), origin, scale);
+                node.childBounds[child][1][axis] = quantizeMax(children[child].bounds[1].axis(axis), origin, boxMax, scale);
+            }
+        }
+        return node;
+    }
+
+    bool isLeaf() const { return (payload & leafFlag) != 0; }
+
+    /* Interior nodes only. The second child is at `getChildIdx() + 1` */
+    uint32_t getChildIdx() const { return payload; }
+
+    /* Leaf nodes only */
+    uint32_t getTriangleOffset() const { return payload & ~leafFlag; }
+
+    /* Leaf nodes only */
+    uint32_t getTriangleCount() const
+    {
+        uint32_t triangleCount;
+        std::memcpy(&triangleCount, childBounds, sizeof(uint32_t));
+        return triangleCount;
+    }
+
+    /* Interior nodes only. @param box: decoded bounds of this node */
+    AABB decodeChild(const AABB& box, int child) const
+    {
+        AABB out{};
+        for (int axis = 0; axis < 3; ++axis) {
+            const float origin = box.bounds[0].axis(axis);
+            const float boxMax = box.bounds[1].axis(axis);
+            const float scale = getScale(box, axis);
+            out.bounds[0].axis(axis) = dequantize(childBounds[child][0][axis], origin, scale);
+            out.bounds[1].axis(axis) = dequantizeMax(childBounds[child][1][axis], origin, boxMax, scale);
+        }
+        return out;
+    }
+
+private:
+    static constexpr uint32_t leafFlag = 0x80000000u;
+
+    static float getScale(const AABB& box, int axis)
+    {
+        return (box.bounds[1].axis(axis) - box.bounds[0].axis(axis)) / steps;
+    }
+
+    /* Step 0 is `origin` exactly. The only decode expression, shared by the encoder checks and `decodeChild` */
+    static float dequantize(uint8_t step, float origin, float scale)
+    {
+        return origin + float(step) * scale;
+    }
+
+    /* The last step is the parent's max corner exactly. `origin + steps * scale` may fall short of it after rounding,
+       by far more than an ulp of the boxMax when the box is small and far from the origin */
+    static float dequantizeMax(uint8_t step, float origin, float boxMax, float scale)
+    {
+        return step == uint8_t(steps) ? boxMax : dequantize(step, origin, scale);
+    }
+
+    /* Largest step that decodes to at most `value`. Step 0 always qualifies, `value` is inside the parent */
+    static uint8_t quantizeMin(float value, float origin, float scale)
+    {
+        if (!(scale > 0.f)) {
+            return 0;
+        }
+        uint8_t step = uint8_t(std::clamp(std::floor((value - origin) / scale), 0.f, steps));
+        while (step > 0 && dequantize(step, origin, scale) > value) {
+            --step;
+        }
+        while (step < uint8_t(steps) && dequantize(step + 1, origin, scale) <= value) {
+            ++step;
+        }
+        return step;
+    }
+
+    /* Smallest step that decodes to at least `value`. The last step always qualifies, `value` is inside the parent */
+    static uint8_t quantizeMax(float value, float origin, float boxMax, float scale)
+    {
+        if (!(scale > 0.f)) {
+            return uint8_t(steps);
+        }
+        uint8_t step = uint8_t(std::clamp(std::ceil((value - origin) / scale), 0.f, steps));
+        while (step < uint8_t(steps) && dequantizeMax(step, origin, boxMax, scale) < value) {
+            ++step;
+        }
+        while (step > 0 && dequantizeMax(step - 1, origin, boxMax, scale) >= value) {
+            --step;
+        }
+        return step;
+    }
+
+    /* [child][0: min, 1: max][axis] in steps of `getScale`. Leaves store their triangle count here */
+    uint8_t childBounds[2][2][3] = {};
+    /* interior: index of the first child. leaf: `leafFlag` | offset into `BVH::triangleRefs` */
+    uint32_t payload = 0;
+};
+
+static_assert(sizeof(QuantizedBVHNode) == 16, "QuantizedBVHNode must stay half the size of BVHNode");
+
+/* `Width` children per node with their bounds in SoA layout, so that one SIMD instruction handles one axis of all children.
+*  Leaf children are stored inline: their slot references `BVH::triangleRefs` directly instead of another node */
+template <size_t Width>
+struct alignas(32) WideBVHNode
+{
+    /* bounds[0]: min corner, bounds[1]: max corner. Then axis, then child slot. Unused slots are inverted and never hit */
+    float bounds[2][3][Width];
+    /* interior child: index in the wide node array. leaf child: offset into `BVH::triangleRefs` */
+    uint32_t child[Width];
+    /* 0 for interior children */
+    uint32_t triangleCount[Width];
+    uint32_t childCount = 0;
+
+    WideBVHNode()
+    {
+        for (size_t slot = 0; slot < Width; ++slot) {
+            for (int axis = 0; axis < 3; ++axis) {
+                bounds[0][axis][slot] = std::numeric_limits<float>::max();
+                bounds[1][axis][slot] = std::numeric_limits<float>::lowest();
+            }
+            child[slot] = 0;
+            triangleCount[slot] = 0;
+        }
+    }
+};
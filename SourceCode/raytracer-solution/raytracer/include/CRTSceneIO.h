@@ -10,6 +10,7 @@ class Triangle;
 class Image;
 class Scene;
 class Vec3;
+class Matrix3x3;
 
 using json = nlohmann::json;
 
@@ -27,6 +28,10 @@ private:
     static void parseTextures(const json& j, Scene& scene, const Settings& settings, std::map<std::string, size_t>& idxFromTextureName);
     static void parseMaterials(const json& j, Scene& scene, const std::map<std::string, size_t>& idxFromTextureName);
     static void parseObjects(const json& j, Scene& scene);
+    /* @brief Objects with "instance_of": <index in "objects"> reuse the geometry and material of that object */
+    static void parseInstance(const json& jObj, Scene& scene);
+    /* @brief Optional object "position" and row-major "matrix": world = matrix * vertex + position */
+    static void parsePlacement(const json& jObj, Vec3& pos, Matrix3x3& mat);
     static void parseVertices(const json& jObj, std::vector<Vec3>& vertices);
     static void parseUvs(const json& jObj, const size_t expectedSize, std::vector<Vec3>& uvs);
     static void parseTriangles(const json& jObj, const size_t materialIdx, std::vector<Triangle>& triangles);
@@ -413,6 +413,13 @@ public:
 
 	bool isOrthonormal() const;
 
+	Matrix3x3 transposed() const;
+
+	/* @brief Throws if the matrix is singular */
+	Matrix3x3 inverse() const;
+
+	bool isIdentity() const { return data == identity().data; }
+
 	std::string toString() const {
 		std::string result = "";
 		for (size_t row = 0; row < 3; ++row) {
@@ -1,6 +1,7 @@
 #pragma once
 #include <tuple>
 #include <queue>
+#include <vector>
 
 #include "json_fwd.h"
 
@@ -27,6 +28,8 @@ public:
     nlohmann::ordered_json toJson() const;
     /* Adds ray to `queue` with direction (`x`, `y`) on the image plane */
     void emplaceTask(size_t maxX, size_t maxY, size_t x, size_t y, std::queue<TraceTask>& queue) const;
+    /* Adds ray to `tasks` with direction (`x`, `y`) on the image plane */
+    void emplaceTask(size_t maxX, size_t maxY, size_t x, size_t y, std::vector<TraceTask>& tasks) const;
 
 private:
     /* creates ray with direction (`x`, `y`) on the image plane */
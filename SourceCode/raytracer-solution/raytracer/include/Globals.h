@@ -17,7 +17,7 @@ extern Metrics GSceneMetrics;
 extern uint64_t GBestTriangleIntersect;
 extern std::string GBestSettings;
 
-// Modified by Renderer worker threads on thread boot
+// Modified by Renderer and ThreadPool worker threads on thread boot
 extern thread_local size_t GThreadIdx;
 
 static constexpr float PI = static_cast<float>(std::numbers::pi);
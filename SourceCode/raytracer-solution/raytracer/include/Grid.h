@@ -0,0 +1,80 @@
+#pragma once
+#include <vector>
+#include <array>
+#include <string>
+#include <cstdint>
+
+#include "json.hpp"
+
+#include "include/AABB.h"
+#include "include/TrianglePack.h"
+
+class Scene;
+class Settings;
+class TraceHit;
+class Ray;
+class Mailbox;
+class ScopedCounter;
+class CacheWriter;
+class CacheReader;
+
+/* Uniform grid over the triangles of one mesh. Cells are stored flat, x fastest, and each references a range in one shared
+*  triangle reference array. A triangle is listed in every cell its AABB overlaps. Rays step from cell to cell with a 3D-DDA.
+*  Suits meshes of evenly spread small triangles, like tessellated terrain, where a tree spends its depth cutting uniform space */
+class Grid
+{
+    using json = nlohmann::json;
+public:
+    Grid() = default;
+
+    /* @brief Build over `triangleRefs` with about `Settings::gridDensity` cells per triangle.
+       Linear in the triangle and reference count: one pass counts the references of each cell, a prefix sum places the cells
+       and a second pass fills them. No sorting and no recursion */
+    void build(const std::vector<uint32_t>& triangleRefs, const std::vector<AABB>& cacheTriangleAABBs, const Settings& settings);
+    /* @brief intersect the grid with a ray. Write output to `out`.
+       Cells are visited front to back, so traversal stops at the first cell that contains a hit */
+    void traverse(const Scene& scene, const Ray& ray, TraceHit& out) const;
+    /* @brief Any-hit query for shadow rays. Returns on the first occluding triangle on the segment */
+    bool isOccluded(const Scene& scene, const Vec3& start, const Vec3& end) const;
+    /* @brief Pack the cell triangles for SIMD intersection. Call after `build`, `readCache` or whenever vertices or materials change */
+    void buildPacks(const Scene& scene);
+    void writeCache(CacheWriter& writer) const;
+    void readCache(CacheReader& reader);
+    json toJson() const;
+
+    AABB aabb{};
+private:
+    /* Range in `triangleRefs`, like a kd-tree leaf */
+    struct Cell {
+        uint32_t offset = 0;
+        uint32_t count = 0;
+    };
+
+    /* Cap on the cells along one axis. Bounds the memory of meshes with a few huge triangles */
+    static constexpr uint32_t maxResolution = 512;
+    /* Axes thinner than this fraction of the longest one get a single cell, e.g. the height of a flat terrain */
+    static constexpr float flatAxisRatio = 1.0E-3F;
+
+    /* @brief Cell coordinate of `value` along `axis`, clamped to the grid */
+    uint32_t cellCoord(float value, int axis) const;
+
+    uint32_t cellIdx(uint32_t x, uint32_t y, uint32_t z) const { return (z * resolution[1] + y) * resolution[0] + x; }
+
+    /* @brief Step along `ray` through the cells between `tEntry` and `tExit`, front to back.
+       `visit(cellIdx, tCellExit)` returns true to stop */
+    template <typename Visit>
+    void walkCells(const Ray& ray, float tEntry, float tExit, Visit&& visit) const;
+
+    /* @param mailbox: triangles already tested by this query. Triangles larger than a cell are listed in several
+       @param packTests: see `TrianglePacks::intersectLeaf` */
+    void intersectCell(const Scene& scene, const Ray& ray, const Cell& cell, Mailbox& mailbox, ScopedCounter& packTests,
+        TraceHit& out) const;
+
+    std::array<uint32_t, 3> resolution{ 0, 0, 0 };
+    Vec3 cellSize{ 0.f, 0.f, 0.f };
+    /* 0 on single cell axes, so every point maps to cell 0 */
+    Vec3 invCellSize{ 0.f, 0.f, 0.f };
+    std::vector<Cell> cells{};
+    std::vector<uint32_t> triangleRefs{};
+    TrianglePacks packs{};
+};
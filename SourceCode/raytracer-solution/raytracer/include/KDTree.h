@@ -0,0 +1,182 @@
+#pragma once
+#include <vector>
+#include <array>
+#include <string>
+#include <limits>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+#include "json.hpp"
+
+#include "include/AABB.h"
+#include "include/KDTreeNode.h"
+#include "include/TrianglePack.h"
+
+class Scene;
+class Settings;
+class TraceHit;
+class Ray;
+class RayPacket;
+class Mailbox;
+class ScopedCounter;
+class ThreadPool;
+class Triangle;
+class CacheWriter;
+class CacheReader;
+
+/* Flattened kd-tree. All nodes live in one contiguous array with the root at index 0.
+*  Leaf triangle references are stored in one shared array */
+class KDTree
+{
+    using json = nlohmann::json;
+public:
+    KDTree() = default;
+
+    /* @brief Build the tree over `triangleRefs` using the Surface Area Heuristic.
+       A node becomes a leaf when splitting is estimated to cost more than intersecting all of its triangles,
+       or when `maxTrianglesPerLeaf` / `accelTreeMaxDepth` are reached.
+       Triangles are clipped against split planes, so a leaf only references triangles that really cross it.
+       Subtrees larger than `parallelBuildThreshold` are built on `pool`.
+       With `kdTreeLazyDepth`, nodes at that depth are left as lazy leaves and built on first use, see `LazySubtree` */
+    void build(std::vector<uint32_t>&& triangleRefs, const std::vector<AABB>& cacheTriangleAABBs,
+        const std::vector<Triangle>& triangles, const std::vector<Vec3>& vertices, const Settings& settings, ThreadPool& pool);
+    /* @brief intersect the KDTree with a ray. Write output to `out`.
+       Leaves are visited front to back along the ray, so traversal stops at the first leaf that contains a hit.
+       Walks leaf to leaf along ropes instead of using a stack if they were built, see `Settings::kdTreeRopes` */
+    void traverse(const Scene& scene, const Ray& ray, TraceHit& out) const;
+    /* @brief `traverse` for every ray of a coherent packet. `outHits` is parallel to `RayPacket::getRays`.
+       Nodes are culled for the whole packet with `RayPacket::mayHit`, leaves are intersected per ray */
+    void traversePacket(const Scene& scene, const RayPacket& packet, TraceHit* outHits) const;
+    /* @brief Any-hit query for shadow rays. Returns on the first occluding triangle on the segment. No hit attributes are computed */
+    bool isOccluded(const Scene& scene, const Vec3& start, const Vec3& end) const;
+    /* @brief Pack the leaf triangles for SIMD intersection. Call after `build`, `readCache` or whenever vertices or materials change.
+       Also repacks the lazy subtrees built so far */
+    void buildPacks(const Scene& scene);
+    /* @brief Move the nodes into cache line and page sized treelets, see `NodeLayout`. Traversal results do not change */
+    void reorderNodes();
+    void writeCache(CacheWriter& writer) const;
+    void readCache(CacheReader& reader);
+    json toJson() const;
+    std::string toString() const;
+
+    AABB aabb{};
+private:
+    struct SplitCandidate {
+        int axis = -1;
+        float pos = 0.f;
+        float cost = std::numeric_limits<float>::max();
+    };
+
+    /* Hard limit on tree depth. Bounds the traversal stack */
+    static constexpr size_t maxDepth = 64;
+
+    /* Leaf bounds and neighbours across each face, for `traverseRopes`. Face `2 * axis + side`, side 0 is the min face.
+    *  A rope points at the adjacent node, pushed down as far as that node still covers the whole face, see `optimizeRope` */
+    struct LeafRopes {
+        AABB aabb;
+        std::array<uint32_t, 6> ropes;
+    };
+    /* Rope of a face on the border of the tree */
+    static constexpr uint32_t noRope = std::numeric_limits<uint32_t>::max();
+
+    /* Cost multiplier for splits that cut off empty space. Favors tight nodes around geometry */
+    static constexpr float sahEmptySpaceBonus = 0.8f;
+
+    /* Triangle reference used during the build. `bounds` is the part of the triangle inside the current node */
+    struct BuildRef {
+        uint32_t triRef;
+        AABB bounds;
+    };
+
+    /* Subtree below a lazy leaf, see `KDTreeNode::MakeLazy`. Keeps the build input until a ray enters the leaf.
+    *  The first thread to get there builds it, the others wait on `built` */
+    struct LazySubtree {
+        std::once_flag built;
+        AABB aabb;
+        std::vector<BuildRef> refs;
+        /* Depth of the lazy leaf, counts towards `accelTreeMaxDepth` */
+        size_t depth = 0;
+        std::unique_ptr<KDTree> tree;
+    };
+
+    /* Input of the recursive build. Shared by all build threads. Only `lazySubtrees` is written, under `lazyMutex` */
+    struct BuildContext {
+        const std::vector<Triangle>& triangles;
+        const std::vector<Vec3>& vertices;
+        const Settings& settings;
+        ThreadPool& pool;
+        /* Nodes this deep become lazy leaves. 0 builds everything */
+        size_t lazyDepth;
+        std::vector<std::unique_ptr<LazySubtree>>& lazySubtrees;
+        std::mutex& lazyMutex;
+    };
+
+    /* @brief Build `nodes` and `triangleRefs` below `aabb`. The root is at depth `depth` */
+    void buildNodes(std::vector<BuildRef>&& buildRefs, const BuildContext& context, size_t depth);
+
+    /* @brief Build `subtree` unless another thread did already. @return the built tree */
+    static const KDTree& buildLazySubtree(const Scene& scene, LazySubtree& subtree);
+
+    /* @brief Build the subtree rooted at `outNodes[nodeIdx]`. Leaves append to `outTriangleRefs`.
+       Forked subtrees are built into their own arrays, see `appendSubtree` */
+    static void buildRecursive(std::vector<KDTreeNode>& outNodes, std::vector<uint32_t>& outTriangleRefs,
+        uint32_t nodeIdx, const AABB& nodeAabb, std::vector<BuildRef>&& nodeRefs, const BuildContext& context, size_t depth);
+
+    /* @brief Move a subtree that was built into separate arrays under `outNodes[rootIdx]`. Rebases child and triangle offsets */
+    static void appendSubtree(std::vector<KDTreeNode>& outNodes, std::vector<uint32_t>& outTriangleRefs, uint32_t rootIdx,
+        const std::vector<KDTreeNode>& subNodes, const std::vector<uint32_t>& subTriangleRefs);
+
+    /* @brief Distribute `nodeRefs` to the children they cross. Triangles that straddle the split plane are clipped
+       against both children. Large nodes are processed in parallel chunks */
+    static void partitionTriangles(const std::vector<BuildRef>& nodeRefs, const SplitCandidate& split, const AABB* childAabbs,
+        const BuildContext& context, std::vector<BuildRef>& outRefs0, std::vector<BuildRef>& outRefs1);
+
+    /* @brief Evaluate `sahBins` candidate planes on each axis. Uses the clipped bounds of each reference.
+       Bins of large nodes are filled in parallel chunks.
+       @return the cheapest split, or axis == -1 if the node is too small to split */
+    static SplitCandidate findSahSplit(const AABB& nodeAabb, const std::vector<BuildRef>& candidateRefs, const BuildContext& context);
+
+    /* @param mailbox: triangles already tested by this query, see `Mailbox`. Shared by all leaves of one traversal */
+    bool leafOccludes(const Scene& scene, const KDTreeNode& leaf, const Vec3& start, const Vec3& end, Mailbox& mailbox) const;
+
+    /* @param packTests: see `TrianglePacks::intersectLeaf` */
+    void intersectLeaf(const Scene& scene, const Ray& ray, const KDTreeNode& leaf, Mailbox& mailbox, ScopedCounter& packTests,
+        TraceHit& out) const;
+
+    /* @brief Fill `leafRopes` from `nodes` */
+    void buildRopes();
+
+    void buildRopesRecursive(uint32_t nodeIdx, const AABB& nodeAabb, std::array<uint32_t, 6> ropes);
+
+    /* @brief Descend from `ropeIdx` while a single child still covers the face `face` of `nodeAabb` */
+    uint32_t optimizeRope(uint32_t ropeIdx, int face, const AABB& nodeAabb) const;
+
+    /* @brief `traverse` with the caller's mailbox. Lazy leaves continue into their subtree with the same one */
+    void traverse(const Scene& scene, const Ray& ray, Mailbox& mailbox, TraceHit& out) const;
+
+    /* @brief `traversePacket` with the callers' mailboxes, parallel to `RayPacket::getRays` */
+    void traversePacket(const Scene& scene, const RayPacket& packet, Mailbox* mailboxes, TraceHit* outHits) const;
+
+    /* @brief `isOccluded` with the caller's mailbox */
+    bool isOccluded(const Scene& scene, const Vec3& start, const Vec3& end, Mailbox& mailbox) const;
+
+    /* @brief Stackless `traverse`. The ray enters the tree at `tEntry` and leaves at `tExit` */
+    void traverseRopes(const Scene& scene, const Ray& ray, float tEntry, float tExit, Mailbox& mailbox, TraceHit& out) const;
+
+    /* @brief Descend from `nodeIdx` to the leaf containing `p`. Points on a split plane go to the side `dir` points to */
+    uint32_t locateLeaf(uint32_t nodeIdx, const Vec3& p, const Vec3& dir) const;
+
+    /* @brief Move every leaf's triangle range to a multiple of `packWidth`, see `TrianglePacks::alignLeaf` */
+    void alignLeaves(size_t packWidth);
+
+    json toJsonRecursive(uint32_t nodeIdx, const AABB& nodeAabb) const;
+
+    std::vector<KDTreeNode> nodes{};
+    std::vector<uint32_t> triangleRefs{};
+    /* Parallel to `nodes`, only leaf entries are used. Empty unless `Settings::kdTreeRopes` */
+    std::vector<LeafRopes> leafRopes{};
+    TrianglePacks packs{};
+    /* Indexed by lazy leaves. Entries stay at their address, so rays can build them while others traverse */
+    std::vector<std::unique_ptr<LazySubtree>> lazySubtrees{};
+};
@@ -1,46 +1,77 @@
 #pragma once
-#include <vector>
-#include <array>
-#include <memory>
-#include <string>
+#include <cstdint>
+#include <cstring>
 
-#include "json.hpp"
-
-#include "include/AABB.h"
-
-class Scene;
-class TraceHit;
-class Ray;
+/* Compact, pointer-free kd-tree node. 8 bytes. Lives in `KDTree::nodes`.
+*  Interior nodes store only their first child. The second child is always at `getChildIdx() + 1`.
+*  Leaf nodes reference a range in `KDTree::triangleRefs` */
 class KDTreeNode
 {
-    using ordered_json = nlohmann::ordered_json;
-    using json = nlohmann::json;
 public:
     KDTreeNode() = default;
-    KDTreeNode(const AABB& aabb, size_t childId) : aabb(aabb), childId(childId) {}
-    KDTreeNode(KDTreeNode&&) = default;
-    KDTreeNode& operator=(KDTreeNode&&) = default;
-    ~KDTreeNode() = default;
-
-    void build(std::vector<size_t>&& triangleRefs, const std::vector<AABB>& cacheTriangleAABBs, size_t maxTrianglesPerLeaf, size_t maxDepth, size_t depth = 0);
-    /* @brief intersect the KDTree with a ray. Write output to `out` */
-    void traverse(const Scene& scene, const Ray& ray, TraceHit& out) const;
-    json toJson() const;
-    std::string toString() const;
-
-    std::array<std::unique_ptr<KDTreeNode>, 2> child {nullptr, nullptr};
-    AABB aabb{};
+
+    static KDTreeNode MakeLeaf(uint32_t triangleOffset, uint32_t triangleCount)
+    {
+        KDTreeNode node{};
+        node.payload = triangleOffset;
+        node.flags = (triangleCount << 2) | leafFlag;
+        return node;
+    }
+
+    /* Leaf whose subtree is not built yet. `lazyIdx` indexes `KDTree::lazySubtrees` */
+    static KDTreeNode MakeLazy(uint32_t lazyIdx)
+    {
+        KDTreeNode node{};
+        node.payload = lazyIdx;
+        node.flags = (lazyCount << 2) | leafFlag;
+        return node;
+    }
+
+    static KDTreeNode MakeInterior(int axis, float splitPos, uint32_t childIdx)
+    {
+        KDTreeNode node{};
+        std::memcpy(&node.payload, &splitPos, sizeof(float));
+        node.flags = (childIdx << 2) | uint32_t(axis);
+        return node;
+    }
+
+    bool isLeaf() const { return (flags & leafFlag) == leafFlag; }
+
+    /* Leaf nodes only. Lazy leaves have no triangle range */
+    bool isLazy() const { return (flags >> 2) == lazyCount; }
+
+    /* 0: x Axis, 1: y Axis, 2: z Axis. Interior nodes only */
+    int getAxis() const { return int(flags & leafFlag); }
+
+    /* Interior nodes only */
+    float getSplitPos() const
+    {
+        float splitPos;
+        std::memcpy(&splitPos, &payload, sizeof(float));
+        return splitPos;
+    }
+
+    /* Interior nodes only. Index of the child below the split plane */
+    uint32_t getChildIdx() const { return flags >> 2; }
+
+    /* Leaf nodes only */
+    uint32_t getTriangleOffset() const { return payload; }
+
+    /* Leaf nodes only */
+    uint32_t getTriangleCount() const { return flags >> 2; }
+
+    /* Lazy leaves only */
+    uint32_t getLazyIdx() const { return payload; }
+
 private:
-    bool isLeaf() const { return child[0] == nullptr; }
-    void traverseRecursive(const Scene& scene, const Ray& ray, TraceHit& out) const;
-    /* @return sorted array of children closest to the point */
-    std::array<const KDTreeNode*, 2> closestChildren(const Vec3& point) const;
-    void intersectMyTriangles(const Scene& scene, const Ray& ray, TraceHit& out) const;
-
-    std::vector<size_t> triangleRefs {};
-    /* 0: x Axis, 1: y Axis, 2: z Axis */
-    int axisSplit = -1;
-    /* if we are a child, which child are we? */
-    size_t childId = 0;
+    static constexpr uint32_t leafFlag = 3;
+    /* Triangle count field of lazy leaves. No real leaf comes close to it */
+    static constexpr uint32_t lazyCount = 0x3FFFFFFF;
+
+    /* interior: split position (float bits). leaf: offset into `KDTree::triangleRefs`. lazy leaf: index into `KDTree::lazySubtrees` */
+    uint32_t payload = 0;
+    /* low 2 bits: axis or `leafFlag`. high 30 bits: child index or triangle count */
+    uint32_t flags = leafFlag;
 };
 
+static_assert(sizeof(KDTreeNode) == 8, "KDTreeNode must stay compact");
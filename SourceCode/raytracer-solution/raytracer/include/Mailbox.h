@@ -0,0 +1,34 @@
+#pragma once
+#include <array>
+#include <cstdint>
+
+#include "include/Globals.h"
+
+/* Triangle refs recently tested by one ray. kd-tree leaves share the triangles that straddle split planes,
+*  so a ray can reach the same triangle in several leaves. Lives on the stack of one traversal, so threads never share it.
+*  Direct mapped: a ref evicts the older ref in its slot, which only costs a repeated test.
+*  Skipped tests are recorded as MailboxSkippedTest once, when the mailbox goes out of scope */
+class Mailbox
+{
+public:
+    Mailbox() { slots.fill(emptySlot); }
+
+    /* @return true if `triRef` was already tested. Otherwise record it and return false */
+    bool checkAndRecord(uint32_t triRef)
+    {
+        uint32_t& slot = slots[triRef & (slotCount - 1)];
+        if (slot == triRef) {
+            skippedTests.increment();
+            return true;
+        }
+        slot = triRef;
+        return false;
+    }
+
+private:
+    static constexpr uint32_t slotCount = 16; // power of 2
+    static constexpr uint32_t emptySlot = UINT32_MAX; // never a valid triangle ref
+
+    std::array<uint32_t, slotCount> slots;
+    ScopedCounter skippedTests{ GSceneMetrics, "MailboxSkippedTest" };
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <vector>
+#include <limits>
 
 #include "json_fwd.h"
 
@@ -13,9 +14,16 @@ class Scene;
 class MeshObject : public SceneObject
 {
 public:
-    MeshObject() = default; // required by from_json
+    MeshObject() : SceneObject({ 0.f, 0.f, 0.f }, Matrix3x3::identity()) {} // required by from_json
     std::vector<size_t> triangleIndexes; // indices into the triangle array
 
+    static constexpr size_t NotInstanced = std::numeric_limits<size_t>::max();
+    /* Index in `Scene::meshObjects` of the object whose triangles this one reuses. See `Scene::addInstance`.
+    *  Triangles are stored in the mesh's local space. `pos` and `mat` place them in the world: world = mat * local + pos */
+    size_t instanceOf = NotInstanced;
+
+    bool isInstance() const { return instanceOf != NotInstanced; }
+
     /* Construct a mesh object from a range of triangles. `l` and `u` inclusive. */
     MeshObject(size_t l, size_t u);
 
@@ -5,6 +5,7 @@
 #include <unordered_map>
 #include <mutex>
 #include <chrono>
+#include <cstdint>
 
 #include "json_fwd.h"
 
@@ -39,6 +40,8 @@ public:
 
     /* thread-safe */
     void record(std::string s);
+    /* thread-safe. Adds `count` at once, see `ScopedCounter` */
+    void record(const std::string& s, int count);
 
     ordered_json toJson() const;
 
@@ -49,9 +52,36 @@ public:
     /* non-thread safe, must call before launching threads. Must be called before calling `record` */
     void reserveThread(size_t numThreads);
 
+    /* `GThreadIdx` of threads without a slot of their own, i.e. `ThreadPool` workers. Their records share one locked slot */
+    static constexpr size_t sharedThreadIdx = SIZE_MAX;
+
 private:
     std::vector<PerThreadMetrics> threads{};
+    PerThreadMetrics shared{};
+    std::mutex sharedMutex;
     std::unordered_map<std::string, Timer> timers {};
     std::mutex reserveThreadMutex;
     std::string name {};
 };
+
+/* Counts events of one kind in a local integer and records the total when it goes out of scope.
+*  For traversal loops, where a `Metrics::record` per node or triangle would cost more than the work it counts */
+class ScopedCounter {
+public:
+    ScopedCounter(Metrics& metrics, const char* name) : metrics(metrics), name(name) {}
+    ~ScopedCounter() {
+        if (count > 0) {
+            metrics.record(name, count);
+        }
+    }
+
+    ScopedCounter(const ScopedCounter&) = delete;
+    ScopedCounter& operator=(const ScopedCounter&) = delete;
+
+    void increment() { ++count; }
+
+private:
+    Metrics& metrics;
+    const char* name;
+    int count = 0;
+};
@@ -0,0 +1,25 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <limits>
+
+/* Memory order for the node array of a binary tree whose children are stored as adjacent pairs, like `KDTree` and `BVH`.
+*  Builds emit nodes depth first, so a root-to-leaf path deep in the tree jumps across the whole array.
+*  The treelet order packs each subtree that fits in a cache line next to each other, and those into subtrees that fit in a page,
+*  so a traversal path touches few lines and pages. Parents stay before their children and the root stays at index 0 */
+class NodeLayout
+{
+public:
+    /* Child pair entry of a leaf */
+    static constexpr uint32_t noChild = std::numeric_limits<uint32_t>::max();
+
+    /* @param firstChild: index of the first child of each node, the second child follows it. `noChild` for leaves
+       @param nodeBytes: size of one node, decides how many nodes share a cache line and a page
+       @return the new index of each node */
+    static std::vector<uint32_t> treeletOrder(const std::vector<uint32_t>& firstChild, size_t nodeBytes);
+
+private:
+    static constexpr size_t cacheLineBytes = 64;
+    static constexpr size_t pageBytes = 4096;
+};
@@ -0,0 +1,33 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+
+#include "include/CRTTypes.h"
+#include "include/BVHNode.h"
+#include "include/TriangleRecord.h"
+
+class Scene;
+
+/* Shadow ray structure over the triangles of one mesh whose material `occludes`. Leaves store a `TriangleRecord` in place,
+*  so a query reads no `Triangle`, material, UV or normal data, and non-occluding geometry is not in the tree at all.
+*  Depends on materials, so like `TrianglePacks` it is rebuilt rather than cached. See `Settings::occluderStructure` */
+class OccluderBVH
+{
+public:
+    /* @brief Build over the occluding triangles among `triangleRefs`. Always a binary SAH BVH with
+       `Settings::maxTrianglesPerLeaf`, laid out in treelets if `Settings::reorderNodes` */
+    void build(const Scene& scene, const std::vector<uint32_t>& triangleRefs);
+    /* @brief Any-hit query with the `TriangleRecord` test that camera and secondary rays use, on the segment up to `end`.
+       Not `Triangle::fastIntersect` like the other structures: its volume signs lose precision on long segments such as
+       the sun's, so the shadow of an edge can differ by a pixel */
+    bool isOccluded(const Vec3& start, const Vec3& end) const;
+    size_t getMemoryBytes() const { return nodes.size() * sizeof(BVHNode) + triangles.size() * sizeof(TriangleRecord); }
+
+private:
+    /* Hard limit on tree depth, see `BVH` */
+    static constexpr size_t maxDepth = 64;
+
+    std::vector<BVHNode> nodes{};
+    /* Leaves index this array directly */
+    std::vector<TriangleRecord> triangles{};
+};
@@ -0,0 +1,36 @@
+#pragma once
+#include <vector>
+
+#include "include/CRTTypes.h"
+
+class AABB;
+
+/* Rays that are traced together, see `Scene::intersectPacket`. Used for tiles of primary rays.
+*  The packet is bounded by intervals of its origins and inverse directions. A box that the intervals miss is missed by every ray,
+*  so one test culls a subtree for the whole packet */
+class RayPacket
+{
+public:
+    explicit RayPacket(std::vector<Ray>&& rays);
+
+    /* @brief true if all rays share the direction sign on every axis. Only coherent packets are traversed together */
+    bool isCoherent() const { return coherent; }
+
+    /* @brief Conservative frustum test. false only if no ray enters `box` in [0, maxT]. Coherent packets only */
+    bool mayHit(const AABB& box, float maxT) const;
+
+    /* @brief minus = 1; plus = 0, like `Ray::sign`. Shared by all rays of a coherent packet */
+    int getSign(int axis) const { return sign[axis]; }
+
+    const std::vector<Ray>& getRays() const { return rays; }
+    size_t size() const { return rays.size(); }
+
+private:
+    std::vector<Ray> rays;
+    Vec3 originMin = Vec3::MakeMax();
+    Vec3 originMax = Vec3::MakeLowest();
+    Vec3 invdirMin = Vec3::MakeMax();
+    Vec3 invdirMax = Vec3::MakeLowest();
+    int sign[3] = { 0, 0, 0 };
+    bool coherent = false;
+};
@@ -30,6 +30,25 @@ private:
     // TODO perf: reserve space for the queue
     using TraceQueue = std::queue<TraceTask>;
     std::vector<TraceQueue> queueBuckets {};
+
+    /* Square block of pixels whose primary rays are traced as one `RayPacket`. See `Settings::primaryPacketSize` */
+    struct Tile {
+        size_t startX;
+        size_t startY;
+        size_t endX;
+        size_t endY;
+    };
+    /* Used instead of `queueBuckets` when packets are enabled */
+    std::vector<Tile> tiles {};
+
+    /* Used instead of `queueBuckets` when secondary rays are sorted without packets. The rays of one depth of the whole frame,
+    *  in pixel order. See `processFrameWaves` */
+    std::vector<TraceTask> frameWave {};
+    /* Rays per work item of `processFrameWaves` */
+    static constexpr size_t waveChunkSize = 4096;
+
+    /* Scene bounds at the start of `render`. Origins are quantized within them, see `sortStream` */
+    AABB streamBounds {};
     
     // Renderer Output:
     RendererOutput& rendererOutput;
@@ -54,10 +73,27 @@ private:
     /* starts multithreading */
     void launchBuckets();
 
+    /* @brief Call `processItem` for each item in [0, numItems) on the render threads. Returns when all items are done */
+    void launchWorkers(size_t numItems, const std::function<void(size_t)>& processItem);
+
     void workerThread(size_t threadIdx, std::atomic<size_t>& nextQueueIndex);
 
     void processTraceQueue(TraceQueue& traceQueue);
 
+    /* @brief `processTraceQueue` in waves. Each wave holds the rays spawned by the previous one and is traced in sorted order,
+    *  so that consecutive rays share nodes and triangles. Used for the secondary rays of a tile. See `Settings::sortSecondaryRays` */
+    void processTraceStream(TraceQueue& traceQueue);
+
+    /* @brief `processTraceStream` over `frameWave`. A wave is a whole depth of the frame, so sorting finds rays from all
+    *  over the image that travel together. Tracing and shading are each split across the render threads */
+    void processFrameWaves();
+
+    /* @brief Write to `order` the indices of `wave`, ordered by the Morton code of the origin, then by direction octant */
+    void sortStream(const std::vector<TraceTask>& wave, std::vector<uint32_t>& order) const;
+
+    /* @brief Trace the primary rays of `tile` as one packet, then its secondary rays one by one */
+    void processTile(const Tile& tile);
+
     void processXData(TraceTask& task, TraceHit& hit, TraceQueue& traceQueue);
 
     void shadeSky(const TraceTask& task, const TraceHit& hit);
@@ -5,7 +5,7 @@
 
 #include "json.hpp"
 
-#include "include/KDTreeNode.h"
+#include "include/TLAS.h"
 #include "include/AnimationComponent.h"
 #include "include/CRTTypes.h"
 #include "include/Camera.h"
@@ -17,16 +17,19 @@
 #include "include/Metrics.h"
 #include "include/Settings.h"
 #include "include/Triangle.h"
+#include "include/TriangleRecord.h"
 #include "include/Texture.h"
 #include "include/Globals.h"
 
 using json = nlohmann::json;
 
 class TraceHit;
+class RayPacket;
 class Scene
 {
 public:
-    Scene(const std::string& name, const Settings* settings) : sceneName(name), settings(settings) {}
+    Scene(const std::string& name, const Settings* settings) :
+        sceneName(name), settings(settings), accelStructType(settings->accelStructure), bvhBuilder(settings->bvhBuilder) {}
 
     Scene(Scene&&) noexcept = default;
     Scene& operator=(Scene&&) noexcept = default;
@@ -39,6 +42,8 @@ public:
     std::string sceneName = "";
     Camera camera{};
     const Settings* settings;
+    AccelStructType accelStructType; /* Defaults to `Settings::accelStructure`, see CRTSceneIO::parseSettings */
+    BVHBuilder bvhBuilder; /* Defaults to `Settings::bvhBuilder`, see CRTSceneIO::parseSettings */
     Cubemap skybox{};
     Vec3 bgColor = { 0.f, 0.f, 0.f };
     bool useSkybox = false;
@@ -46,7 +51,7 @@ public:
 
     // Entities
     std::vector<Light> lights {};
-    std::vector<MeshObject> meshObjects {}; /* meshObjects reference trinagles. Triangles reference vertices */
+    std::vector<MeshObject> meshObjects {}; /* meshObjects reference trinagles. Triangles reference vertices. Instances share triangles */
     std::vector<Material> materials {};
     std::vector<Texture> textures {};
     std::vector<Triangle> triangles {};
@@ -54,6 +59,7 @@ public:
     std::vector<Vec3> vertices {};
 
     std::vector<AABB> cacheTriangleAABBs {};
+    std::vector<TriangleRecord> cacheTriangleRecords {}; /* Parallel to `triangles`. See `Triangle::intersect` */
     std::vector<Vec3> cacheVertexNormals {};
 
     // Components
@@ -63,37 +69,89 @@ public:
     // IMPORTANT: update `Scene::addObjects()` if adding new members
     // IMPORTANT: keep alphabetical order
 
+    /* @brief Any-hit query: is there an occluding triangle between `start` and `end`? */
     bool isOccluded(const Vec3& start, const Vec3& end) const;
     void intersect(const Ray& ray, TraceHit& out) const;
+    /* @brief `intersect` every ray of `packet`. `outHits` is parallel to `RayPacket::getRays`.
+       Incoherent packets are traced one ray at a time */
+    void intersectPacket(const RayPacket& packet, TraceHit* outHits) const;
 
-    /* @brief: Marks scene dirty. Do not forget to `build` the scene after addObject! */
+    /* @brief: Marks scene dirty. Do not forget to `build` the scene after addObject!
+       On a built scene `buildAdded` processes only the objects added since */
     MeshObject& addObject(
         std::vector<Vec3>& objVertices,
         std::vector<Triangle>& objTriangles,
         std::vector<Vec3>& objUvs);
 
+    /* @brief Place another copy of `meshObjects[sourceIdx]` at world = mat * local + pos. Shares its triangles and BLAS.
+       Marks scene dirty */
+    MeshObject& addInstance(size_t sourceIdx, const Vec3& pos, const Matrix3x3& mat);
+
+    /* @brief Change the placement of a built scene's object. Only the top level structure is rebuilt */
+    void moveObject(size_t meshObjectIdx, const Vec3& pos, const Matrix3x3& mat);
+
+    /* @brief Take an object out of a built scene. Its BLAS is dropped and the top level rebuilt, nothing else is.
+       Its triangles and vertices stay in the arrays, unreferenced. Later objects move down one index.
+       Throws if other objects instance it, remove those first */
+    void removeObject(size_t meshObjectIdx);
+
 	void buildVertexNormals();
 
     void buildTriangleNormals();
 
+    /* @brief Precompute `cacheTriangleRecords`. Linear in the triangle count */
+    void buildTriangleRecords();
+
     std::vector<size_t> genAttachedTriangles(const size_t vertexIndex) const;
 
-    /* @brief: build acceleration structures. Marks scene clean. See `isDirty` */
+    /* @brief: build acceleration structures. Marks scene clean. See `isDirty`.
+       Always rebuilds the whole scene, see `buildAdded` for adding objects to a built one */
     void build();
 
+    /* @brief Build only what `addObject` and `addInstance` appended since the last build: normals, records and AABBs of the new
+       triangles and vertices, a BLAS per new mesh and the top level. Results match a full `build`.
+       Does a full `build` if the scene was never built or `accelStructType` changed since. Marks scene clean */
+    void buildAdded();
+
+    /* @brief Refit acceleration structures after the vertices of `meshObjectIdxs` moved. Also updates their normals and AABBs.
+       Cost is proportional to the moved geometry. Instances of a moved mesh move with it */
+    void updateGeometry(const std::vector<size_t>& meshObjectIdxs);
+
     bool getIsDirty() const { return isDirty; }
 
+    /* @brief World bounds of the built scene */
+    AABB getBounds() const { return tlas.getBounds(); }
+
     void updateAnimations();
 
     Scene cut(const std::vector<size_t> trianglesToCut) const;
 
 private:
-    KDTreeNode accelStruct{};
+    /* BLASes are of type `accelStructType` */
+    TLAS tlas{};
     bool isDirty = true; /* Scene is dirty if objects are added or removed */
     bool triangleAABBsDirty = true;
+    /* Sizes of `meshObjects`, `triangles` and `vertices` at the last build. Entries before them are built */
+    size_t builtMeshObjectCount = 0;
+    size_t builtTriangleCount = 0;
+    size_t builtVertexCount = 0;
+
+    /* @brief Record the current sizes as built and mark the scene clean */
+    void markBuilt();
+
+    /* @brief Worker threads for builds. The calling thread takes part too */
+    size_t numBuildWorkers() const;
+
+    /* @brief Print the memory saved by `Settings::quantizeBVHNodes` */
+    void reportNodeMemory() const;
 
     /* Metrics Timers for [start/stop]Timer*/
     struct Timers {
         static constexpr const char* buildScene = "buildScene";
+        /* Only the BLASes and the top level, for comparing `accelStructType`s. `buildScene` also counts normals and AABBs */
+        static constexpr const char* buildAccelStructure = "buildAccelStructure";
+        static constexpr const char* updateGeometry = "updateGeometry";
+        static constexpr const char* buildAdded = "buildAdded";
+        static constexpr const char* reorderNodes = "reorderNodes";
     };
 };
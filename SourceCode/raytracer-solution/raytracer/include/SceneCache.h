@@ -0,0 +1,102 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstdint>
+#include <type_traits>
+#include <stdexcept>
+
+#include "Filesystem.h"
+
+class Scene;
+class Settings;
+class TLAS;
+
+/* Sequential binary writer for `SceneCache` files. Only trivially copyable data is written, in native byte order */
+class CacheWriter
+{
+public:
+    explicit CacheWriter(const Path& path) : stream(path, std::ios::out | std::ios::binary) {}
+
+    bool good() const { return stream.good(); }
+
+    template <typename T>
+    void write(const T& value)
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "CacheWriter: T must be trivially copyable");
+        stream.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    /* Element count followed by the raw elements */
+    template <typename T>
+    void writeVector(const std::vector<T>& values)
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "CacheWriter: T must be trivially copyable");
+        write<uint64_t>(values.size());
+        stream.write(reinterpret_cast<const char*>(values.data()), std::streamsize(values.size() * sizeof(T)));
+    }
+
+private:
+    std::ofstream stream;
+};
+
+/* Reads what `CacheWriter` wrote. Throws on truncated files, so a broken cache is never half-applied */
+class CacheReader
+{
+public:
+    explicit CacheReader(const Path& path);
+
+    template <typename T>
+    T read()
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "CacheReader: T must be trivially copyable");
+        T value;
+        readBytes(reinterpret_cast<char*>(&value), sizeof(T));
+        return value;
+    }
+
+    /* Vectors are read in one call, no per-element parsing */
+    template <typename T>
+    void readVector(std::vector<T>& out)
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "CacheReader: T must be trivially copyable");
+        const uint64_t size = read<uint64_t>();
+        if (size > remaining / sizeof(T)) {
+            throw std::runtime_error("CacheReader: vector exceeds file size");
+        }
+        out.resize(size_t(size));
+        readBytes(reinterpret_cast<char*>(out.data()), size_t(size) * sizeof(T));
+    }
+
+private:
+    void readBytes(char* dst, size_t count);
+
+    std::ifstream stream;
+    /* Bytes left in the file */
+    uint64_t remaining = 0;
+};
+
+/* On-disk cache of the data `Scene::build` derives from geometry: vertex normals, triangle AABBs and the BLASes.
+*  Files are named after `hashScene`, which covers the geometry and every setting the build reads.
+*  A changed scene or setting therefore misses the cache instead of loading stale data */
+class SceneCache
+{
+public:
+    /* @brief FNV-1a hash of vertices, triangles, mesh objects, `Scene::accelStructType` and the build settings */
+    static uint64_t hashScene(const Scene& scene);
+
+    /* @brief Fill the derived data of `scene` and `tlas` from the cache.
+       Requires triangle normals. The top level is rebuilt, it depends on placements that are not hashed
+       @return false on a cache miss or an unreadable file. `scene` and `tlas` must then be built normally */
+    static bool load(Scene& scene, TLAS& tlas);
+
+    /* @brief Store the derived data of a built scene. Failures are reported and otherwise ignored */
+    static void write(const Scene& scene, const TLAS& tlas);
+
+private:
+    /* Bump when the file layout or any cached structure changes */
+    static constexpr uint32_t formatVersion = 4;
+    static constexpr uint32_t magic = 0x48434353; // "SCCH"
+
+    static Path getCachePath(const Settings& settings, uint64_t hash);
+};
@@ -8,6 +8,19 @@
 
 #include "Filesystem.h"
 
+enum class AccelStructType {
+    KDTREE,
+    BVH,
+    GRID, /* uniform grid, see `Grid` */
+};
+
+/* How `BVH::build` chooses its splits */
+enum class BVHBuilder {
+    SAH, /* binned Surface Area Heuristic. Better trees */
+    LBVH, /* Morton code order. Faster builds, for meshes rebuilt every frame */
+    SBVH, /* SAH with spatial splits. Slower builds, tighter trees around long thin triangles */
+};
+
 class ImageSettings {
 public:
     size_t startX = 0;
@@ -55,10 +68,45 @@ public:
     bool bWriteBmp = true;
 
     // Optimization Settings
+    AccelStructType accelStructure = AccelStructType::KDTREE; /* Scenes can override this, see CRTSceneIO::parseSettings */
     bool forceNoAccelStructure = false;
     bool forceSingleThreaded = false;
     size_t maxTrianglesPerLeaf = 4;
     size_t accelTreeMaxDepth = 12345;
+    /* kd-tree leaves link to their neighbours, and rays walk leaf to leaf without a stack. See KDTree::traverseRopes */
+    bool kdTreeRopes = false;
+    /* Build kd-trees only this many levels deep. Deeper subtrees are built the first time a ray enters them, see KDTree::LazySubtree.
+       0 builds the whole tree up front */
+    size_t kdTreeLazyDepth = 0;
+    // Surface Area Heuristic. Costs are relative to each other, see KDTreeNode::build
+    float sahTraversalCost = 1.f;
+    float sahIntersectionCost = 1.5f;
+    size_t sahBins = 32;
+    BVHBuilder bvhBuilder = BVHBuilder::SAH; /* Scenes can override this, see CRTSceneIO::parseSettings */
+    /* Cells per triangle of grid BLASes. See Grid::build */
+    float gridDensity = 2.f;
+    /* SBVH reference budget as a multiple of the triangle count. 1 allows no spatial splits */
+    float sbvhDuplication = 1.5f;
+    /* 2, 4 or 8 children per BVH node. 4 uses SSE, 8 uses AVX if the build enables it */
+    size_t bvhWidth = 2;
+    /* Traverse binary BVHs through nodes with 8-bit child bounds, half the size of `BVHNode`. Requires bvhWidth 2 */
+    bool quantizeBVHNodes = false;
+    /* Lay out kd-tree and binary BVH nodes in cache line and page sized treelets after the build. See NodeLayout */
+    bool reorderNodes = false;
+    /* Shadow rays traverse a separate BVH over only the occluding triangles of each mesh. See OccluderBVH */
+    bool occluderStructure = false;
+    /* Acceleration structure nodes with more triangles than this are built on several threads */
+    size_t parallelBuildThreshold = 4096;
+    /* A refit BVH is rebuilt once its SAH cost exceeds this multiple of its cost after the last build. See Scene::updateGeometry */
+    float refitRebuildThreshold = 1.5f;
+    /* 1, 4 or 8 leaf triangles intersected at once. 4 uses SSE, 8 uses AVX if the build enables it. 1 tests one triangle at a time */
+    size_t trianglePackWidth = 1;
+    /* Primary rays are traced in square packets of this many pixels per side, see `Scene::intersectPacket`. 0 traces single rays */
+    size_t primaryPacketSize = 0;
+    /* Trace rays in waves, one per depth, sorted by origin Morton code and direction octant. See Renderer::processFrameWaves */
+    bool sortSecondaryRays = false;
+    /* Reuse vertex normals, triangle AABBs and BLASes of unchanged scenes from `getSceneCacheDir`. See SceneCache */
+    bool useSceneCache = false;
 
     /* @brief: Caller needs to catch exceptions from nlohmann::json. Missing keys is also an exception */
     static Settings load(const std::string& filename = "settings.json");
@@ -66,6 +114,11 @@ public:
     /* Format back to Json-formatted string */
     std::string toString() const;
 
+    static AccelStructType AccelStructTypeFromString(const std::string& type);
+    static std::string StringFromAccelStructType(AccelStructType type);
+    static BVHBuilder BVHBuilderFromString(const std::string& builder);
+    static std::string StringFromBVHBuilder(BVHBuilder builder);
+
     void checkSettings() const;
     size_t debugPixelIdx(size_t imageWidth) const;
     std::string projectPath() const;
@@ -78,4 +131,5 @@ public:
     std::filesystem::path getCompareFile(std::filesystem::path file) const;
     Path getDiffFile(std::filesystem::path file) const;
     Path getSceneOutput() const;
+    Path getSceneCacheDir() const;
 };
\ No newline at end of file
@@ -0,0 +1,142 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <cstdint>
+
+#include "json.hpp"
+
+#include "include/AABB.h"
+#include "include/BVH.h"
+#include "include/BVHNode.h"
+#include "include/KDTree.h"
+#include "include/Grid.h"
+#include "include/OccluderBVH.h"
+#include "include/Settings.h"
+
+class Scene;
+class TraceHit;
+class Ray;
+class RayPacket;
+class ThreadPool;
+class MeshObject;
+class CacheWriter;
+class CacheReader;
+
+/* Two-level acceleration structure. Every mesh gets a bottom level structure (BLAS) over its triangles in local space.
+*  Each `MeshObject` is an instance that places a BLAS in the world, and the top level is a BVH over the instances' world bounds.
+*  Instanced meshes are stored once, and moving an object only rebuilds the top level, see `buildTopLevel` */
+class TLAS
+{
+    using json = nlohmann::json;
+public:
+    TLAS() = default;
+
+    /* @brief Build one BLAS of type `type` per mesh that owns its triangles, then the top level.
+       Requires `Scene::cacheTriangleAABBs` */
+    void build(const Scene& scene, AccelStructType type, ThreadPool& pool);
+    /* @brief Build a BLAS for each mesh from `Scene::meshObjects[firstMeshIdx]` on, then the top level. Earlier BLASes are kept.
+       Requires `Scene::cacheTriangleAABBs` of the new triangles */
+    void addMeshObjects(const Scene& scene, size_t firstMeshIdx, ThreadPool& pool);
+    /* @brief Drop `meshIdx`, which `Scene::meshObjects` no longer holds, and its BLAS unless other objects still use it.
+       Rebuilds the top level */
+    void removeMeshObject(const Scene& scene, size_t meshIdx);
+    /* @brief Rebuild the top level from the current `MeshObject` placements. Bottom level structures are kept */
+    void buildTopLevel(const Scene& scene);
+    /* @brief Bring the BLASes of `meshObjectIdxs` up to date after their triangles moved, then rebuild the top level.
+       BVHs are refit, and rebuilt only if that degraded them past `refitRebuildThreshold`.
+       kd-trees and grids are always rebuilt, their split planes and cells cannot follow the triangles */
+    void updateGeometry(const Scene& scene, const std::vector<size_t>& meshObjectIdxs, ThreadPool& pool);
+    /* @brief Lay out the nodes of every BLAS in treelet order, see `NodeLayout`. BLASes that `updateGeometry` rebuilds
+       are laid out again if `Settings::reorderNodes` is set */
+    void reorderNodes();
+    /* @brief Pack the leaf triangles of every BLAS, see `TrianglePacks`, and build the `OccluderBVH`s if enabled.
+       Both read materials. `build` and `updateGeometry` do this already */
+    void buildPacks(const Scene& scene);
+    /* @brief Intersect all instances with a world space ray. Write the closest hit, in world space, to `out` */
+    void traverse(const Scene& scene, const Ray& ray, TraceHit& out) const;
+    /* @brief `traverse` for every ray of a coherent packet. `outHits` is parallel to `RayPacket::getRays`.
+       kd-tree BLASes are traversed with the packet, BVH BLASes one ray at a time */
+    void traversePacket(const Scene& scene, const RayPacket& packet, TraceHit* outHits) const;
+    /* @brief Any-hit query for shadow rays. See `KDTree::isOccluded` */
+    bool isOccluded(const Scene& scene, const Vec3& start, const Vec3& end) const;
+    size_t getBLASCount() const { return blases.size(); }
+    AccelStructType getType() const { return type; }
+    /* @brief Node memory of all BVH BLASes: what traversal reads, and what binary `BVHNode`s would take */
+    void getBVHNodeBytes(size_t& traversalBytes, size_t& binaryBytes) const;
+    /* @brief World bounds of all instances. Empty if there are none */
+    AABB getBounds() const { return nodes.empty() ? AABB::MakeEmpty() : nodes[0].aabb; }
+    /* @brief Store the BLASes. The top level is not stored, see `SceneCache` */
+    void writeCache(CacheWriter& writer) const;
+    /* @brief Restore what `writeCache` stored. Call `buildTopLevel` afterwards */
+    void readCache(CacheReader& reader, AccelStructType expectedType);
+    json toJson() const;
+    std::string toString() const;
+
+private:
+    /* Only the structure selected by `type` is built */
+    struct BLAS {
+        KDTree kdTree{};
+        BVH bvh{};
+        Grid grid{};
+        /* Only built with `Settings::occluderStructure`. Shadow rays then traverse it instead of the structure above */
+        OccluderBVH occluders{};
+        AABB bounds{}; // local space
+    };
+
+    struct Instance {
+        Matrix3x3 localFromWorld{};
+        /* Inverse transpose of the placement matrix */
+        Matrix3x3 normalToWorld{};
+        Vec3 pos{ 0.f, 0.f, 0.f };
+        AABB worldBounds{};
+        uint32_t blasIdx = 0;
+        /* Identity placement. Rays are passed to the BLAS unchanged */
+        bool isIdentity = true;
+    };
+
+    /* Hard limit on tree depth. Bounds the traversal stack */
+    static constexpr size_t maxDepth = 64;
+    static constexpr uint32_t maxInstancesPerLeaf = 2;
+
+    /* @brief Build the BLASes of the meshes from `Scene::meshObjects[firstMeshIdx]` on and map their instances.
+       Appends to `blases` and `blasFromMeshObject`. The meshes are built in parallel on `pool` */
+    void buildBLASes(const Scene& scene, size_t firstMeshIdx, ThreadPool& pool);
+
+    /* @brief (Re)build `blas` over the triangles of `meshObject` */
+    void buildBLAS(const Scene& scene, const MeshObject& meshObject, BLAS& blas, ThreadPool& pool) const;
+
+    void buildBLASPacks(const Scene& scene, BLAS& blas) const;
+
+    void buildBLASOccluders(const Scene& scene, const MeshObject& meshObject, BLAS& blas) const;
+
+    void reorderBLASNodes(BLAS& blas) const;
+
+    /* @brief Median split on the longest axis of the instance centers. Instance counts are small, so no SAH is needed
+       @param [begin, end): range in `instanceRefs` owned by the node */
+    void buildTopLevelRecursive(uint32_t nodeIdx, uint32_t begin, uint32_t end, size_t depth);
+
+    void traverseBLAS(const Scene& scene, const BLAS& blas, const Ray& ray, TraceHit& out) const;
+
+    /* @brief Intersect one instance. Replaces `out` if its hit is closer */
+    void intersectInstance(const Scene& scene, const Ray& ray, const Instance& instance, TraceHit& out) const;
+
+    /* @brief `intersectInstance` for every ray of `packet`. Falls back to single rays if the placement makes the packet incoherent */
+    void intersectInstancePacket(const Scene& scene, const RayPacket& packet, const Instance& instance, TraceHit* outHits) const;
+
+    /* @brief Transform a world space ray into the BLAS space of `instance`. `scale` is the length of the transformed direction */
+    static Ray toLocalRay(const Ray& ray, const Instance& instance, float& scale);
+
+    /* @brief Bring a BLAS hit of `toLocalRay` back to world space. Replaces `out` if it is closer */
+    static void mergeLocalHit(const Ray& ray, const Instance& instance, float scale, const TraceHit& localHit, TraceHit& out);
+
+    bool instanceOccludes(const Scene& scene, const Instance& instance, const Vec3& start, const Vec3& end) const;
+
+    AccelStructType type = AccelStructType::KDTREE;
+    std::vector<BLAS> blases{};
+    /* Index of the BLAS of each `Scene::meshObjects` entry */
+    std::vector<uint32_t> blasFromMeshObject{};
+    std::vector<Instance> instances{};
+    /* `BVHNode::triangleCount` counts instances here. Leaves reference `instanceRefs` */
+    std::vector<BVHNode> nodes{};
+    std::vector<uint32_t> instanceRefs{};
+};
@@ -0,0 +1,45 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Fixed set of worker threads pulling tasks from one queue. Used for fork-join work such as acceleration structure builds.
+*  A thread waiting for its tasks executes queued tasks meanwhile, so nested forks cannot deadlock */
+class ThreadPool
+{
+public:
+    /* @param numWorkers: threads besides the calling one. 0 runs every task on the calling thread */
+    explicit ThreadPool(size_t numWorkers);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    /* @brief Queue `task`. `pending` is decremented once it has run. See `wait` */
+    void submit(std::function<void()> task, std::atomic<size_t>& pending);
+
+    /* @brief Execute queued tasks on the calling thread until `pending` reaches 0 */
+    void wait(const std::atomic<size_t>& pending);
+
+    /* @brief Call `body(begin, end)` for consecutive chunks of [0, count). Returns when all chunks are done.
+       Chunk `i` is [i * chunkSize, min((i + 1) * chunkSize, count)) */
+    void parallelFor(size_t count, size_t chunkSize, const std::function<void(size_t, size_t)>& body);
+
+    /* @brief workers + the calling thread */
+    size_t getNumThreads() const { return workers.size() + 1; }
+
+private:
+    /* @return false if the queue was empty */
+    bool runOne();
+    void workerLoop();
+
+    std::vector<std::thread> workers{};
+    std::deque<std::function<void()>> tasks{};
+    std::mutex tasksMutex{};
+    std::condition_variable tasksAvailable{};
+    bool stopping = false;
+};
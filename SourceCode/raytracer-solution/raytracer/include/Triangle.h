@@ -13,8 +13,15 @@ public:
 	Triangle() = default; // required for deserialization with nlohmann::json. Do not use this constructor directly
 	Triangle(size_t v0, size_t v1, size_t v2, size_t _materialIndex);
 
+	/* Two-sided test against `Scene::cacheTriangleRecords[triRef]`. Hits at or beyond `hit.t` are rejected.
+	*  Back faces only hit refractive materials, as `TraceHitType::INSIDE_REFRACTIVE` */
 	void intersect(const Scene& scene, const Ray& ray, size_t triRef, TraceHit& hit) const;
 
+	/* Fill `hit` from a geometric hit found by `TriangleRecord` or `TrianglePack`. Back faces must already be culled,
+	*  see `intersect`. `hit` can still be unsuccessful if the smooth shading normal faces away from the ray */
+	void computeHit(const Scene& scene, const Ray& ray, size_t triRef, float t, float baryU, float baryV, bool frontFacing,
+		TraceHit& hit) const;
+
 	/* Quick line-triangle intersect that returns only a bool. Used for occlusion testing.
 	*  @return: true also for backside */
 	bool fastIntersect(const Scene& scene, const Vec3& start, const Vec3& end) const;
@@ -40,18 +47,12 @@ private:
 
 	Vec3 hitNormal(const Scene& scene, const TraceHit& hit) const;
 
-	void computeHit(const Scene& scene, const Ray& ray, float rProj, TraceHit& hit) const;
-
-	void swapFace();
-
 	/* Used for quick line-triangle intersection testing
 	* @return: true if sign is positive. False if sign is negative or zero */
 	bool signOfVolume(const Vec3& a, const Vec3& b, const Vec3& c, const Vec3& d) const;
 
 	static TraceHitType getTraceHitType(const Vec3& n, const Vec3& rayDir);
 
-	Triangle swappedTriangle() const;
-
 	/* for DEBUG builds */
 	static void assertHit(const Scene& scene, const TraceHit& hit);
 };
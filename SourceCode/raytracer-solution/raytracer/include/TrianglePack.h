@@ -0,0 +1,66 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+class Scene;
+class Ray;
+class TraceHit;
+class Mailbox;
+class ScopedCounter;
+
+/* `Width` triangle records in SoA layout, so that one SIMD instruction handles one component of all triangles.
+*  Unused lanes are zero and never hit */
+template <size_t Width>
+struct alignas(32) TrianglePack
+{
+    /* Component, then lane. See `TriangleRecord` */
+    float v0[3][Width];
+    float e1[3][Width];
+    float e2[3][Width];
+    uint32_t triRef[Width];
+    /* Bit i is set if lane i can be hit from behind, i.e. its material is refractive. See `Triangle::intersect` */
+    uint32_t backfaceMask = 0;
+
+    TrianglePack()
+    {
+        for (size_t lane = 0; lane < Width; ++lane) {
+            for (int axis = 0; axis < 3; ++axis) {
+                v0[axis][lane] = 0.f;
+                e1[axis][lane] = 0.f;
+                e2[axis][lane] = 0.f;
+            }
+            triRef[lane] = 0;
+        }
+    }
+};
+
+/* Leaf triangles of a `KDTree` or `BVH`, packed in groups of `Settings::trianglePackWidth`.
+*  Pack i holds `triangleRefs[i * width, (i + 1) * width)`. The owning structure starts every leaf at a multiple of the width,
+*  see `alignLeaf`, so a leaf at `offset` starts in pack `offset / width` */
+class TrianglePacks
+{
+public:
+    /* @brief Pack `triangleRefs`. Width 1 leaves the packs empty, leaves are then intersected one triangle at a time.
+       Requires `Scene::cacheTriangleRecords`. Materials are read too, so packs are rebuilt rather than cached */
+    void build(const Scene& scene, const std::vector<uint32_t>& triangleRefs, size_t width);
+
+    /* @brief Intersect a ray with the leaf triangles `triangleRefs[offset, offset + count)`. Replaces `out` if a hit is closer.
+       Lanes already in `mailbox` are masked, and a pack with no lane left is skipped
+       @param packTests: counts the packs tested. Owned by the traversal, so it is recorded once per ray */
+    void intersectLeaf(const Scene& scene, const Ray& ray, uint32_t offset, uint32_t count, TraceHit& out,
+        ScopedCounter& packTests, Mailbox* mailbox = nullptr) const;
+
+    /* @brief 1 if packing is off */
+    size_t getWidth() const { return width; }
+
+    /* @brief Pad `triangleRefs` so that the next leaf appended to it starts a new pack
+       @return offset of the next leaf */
+    static uint32_t alignLeaf(std::vector<uint32_t>& triangleRefs, size_t width);
+
+private:
+    size_t width = 1;
+    /* Only the array matching `width` is filled */
+    std::vector<TrianglePack<4>> packs4{};
+    std::vector<TrianglePack<8>> packs8{};
+};
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "include/CRTTypes.h"
+
+/* Precomputed intersection data of one triangle. 36 bytes. Lives in `Scene::cacheTriangleRecords`, parallel to `Scene::triangles`.
+*  Intersection tests read only this record instead of gathering three vertices through `Triangle::v` */
+class TriangleRecord
+{
+public:
+    TriangleRecord() = default;
+
+    TriangleRecord(const Vec3& v0, const Vec3& v1, const Vec3& v2) : v0(v0), e1(v1 - v0), e2(v2 - v0) {}
+
+    /* @brief Two-sided Moller-Trumbore test.
+       @return false if the ray misses, is parallel to the plane, or hits at t < 0 or t >= maxT.
+       Otherwise `t`, the barycentric weights `baryU` (of v1) and `baryV` (of v2), and `frontFacing` are written.
+       Front faces wind counter-clockwise as seen from the ray, like `Triangle::getNormal` */
+    bool intersect(const Ray& ray, float maxT, float& t, float& baryU, float& baryV, bool& frontFacing) const
+    {
+        const Vec3& dir = ray.getDirection();
+        const Vec3 pvec = cross(dir, e2);
+        // det = -dot(dir, cross(e1, e2)), so a positive det means the normal faces the ray
+        const float det = dot(e1, pvec);
+        if (det > -parallelEpsilon && det < parallelEpsilon) {
+            return false;
+        }
+        const float invDet = 1.f / det;
+
+        const Vec3 tvec = ray.origin - v0;
+        const float u = dot(tvec, pvec) * invDet;
+        if (u < 0.f || u > 1.f) {
+            return false;
+        }
+        const Vec3 qvec = cross(tvec, e1);
+        const float v = dot(dir, qvec) * invDet;
+        if (v < 0.f || u + v > 1.f) {
+            return false;
+        }
+        const float tHit = dot(e2, qvec) * invDet;
+        if (tHit < 0.f || tHit >= maxT) {
+            return false;
+        }
+
+        t = tHit;
+        baryU = u;
+        baryV = v;
+        frontFacing = det > 0.f;
+        return true;
+    }
+
+    Vec3 v0{ 0.f, 0.f, 0.f };
+    /* v1 - v0 */
+    Vec3 e1{ 0.f, 0.f, 0.f };
+    /* v2 - v0 */
+    Vec3 e2{ 0.f, 0.f, 0.f };
+
+private:
+    /* Rays this close to the plane are treated as parallel and miss */
+    static constexpr float parallelEpsilon = 1e-12f;
+};
@@ -4,6 +4,7 @@
 #include <cstdlib>
 #include <algorithm>
 #include <vector>
+#include <cstdint>
 
 #include "json_fwd.h"
 
@@ -50,6 +51,23 @@ namespace Utils {
     inline std::string stringFromBool(bool b) {
         return b ? "true" : "false";
     }
+
+    /* @return the low 10 bits of `v` with two zero bits inserted after each bit */
+    inline uint32_t expandBits10(uint32_t v) {
+        v &= 0x3ffu;
+        v = (v | (v << 16)) & 0x030000ffu;
+        v = (v | (v << 8)) & 0x0300f00fu;
+        v = (v | (v << 4)) & 0x030c30c3u;
+        v = (v | (v << 2)) & 0x09249249u;
+        return v;
+    }
+
+    /* @brief 30-bit Morton code. Points close on the Z-order curve are close in space
+    *  @param x, y, z: [0, 1]. Values outside are clamped */
+    inline uint32_t mortonCode3D(float x, float y, float z) {
+        auto quantize = [](float f) { return uint32_t(std::clamp(f * 1024.f, 0.f, 1023.f)); };
+        return (expandBits10(quantize(x)) << 2) | (expandBits10(quantize(y)) << 1) | expandBits10(quantize(z));
+    }
 }
 
 template<typename T>
@@ -0,0 +1,162 @@
+#pragma once
+#include "include/CRTTypes.h"
+#include "include/Settings.h"
+#include "include/Scene.h"
+#include "include/KDTree.h"
+#include "include/BVH.h"
+#include "include/ThreadPool.h"
+#include "include/TestUtils.h"
+#include "include/UnitTestData.h"
+
+namespace AccelStructUnitTests {
+
+    /* @brief Build `UnitTestData::loadRandomScene` with `settings` and compare single rays and packets with brute force.
+       The scene has an instance, so the top level is checked too */
+    void checkAccelStruct(const Settings& settings)
+    {
+        Scene scene{ "accel", &settings };
+        UnitTestData::loadRandomScene(scene);
+        assertMatchesBruteForce(scene);
+        assertPacketsMatchBruteForce(scene);
+    }
+
+    void checkAccelStruct(AccelStructType type, BVHBuilder builder)
+    {
+        Settings settings{};
+        settings.accelStructure = type;
+        settings.bvhBuilder = builder;
+        checkAccelStruct(settings);
+    }
+
+    /* @brief Compare `traverse` and `isOccluded` of one BLAS with brute force over its triangles `triangleRefs`.
+       The BLAS is in world space, like an object at the origin */
+    template <typename Traverse, typename IsOccluded>
+    void assertBLASMatchesBruteForce(const Scene& scene, const std::vector<uint32_t>& triangleRefs, Traverse&& traverse,
+        IsOccluded&& isOccluded)
+    {
+        std::mt19937 rng{ 13 };
+        std::uniform_real_distribution<float> u(-2.f, 2.f);
+        for (int i = 0; i < 2000; ++i) {
+            const Vec3 origin{ u(rng), u(rng), u(rng) };
+            const Vec3 target = Vec3{ u(rng), u(rng), u(rng) } * 0.25f;
+            Vec3 dir = target - origin;
+            dir.normalize();
+            const Ray ray{ origin, dir };
+
+            TraceHit expected{};
+            expected.t = std::numeric_limits<float>::max();
+            bool expectedOccluded = false;
+            for (uint32_t triRef : triangleRefs) {
+                TraceHit tryHit{};
+                tryHit.t = expected.t;
+                scene.triangles[triRef].intersect(scene, ray, triRef, tryHit);
+                if (tryHit.successful() && tryHit.t < expected.t) {
+                    expected = tryHit;
+                }
+                expectedOccluded = expectedOccluded || scene.triangles[triRef].fastIntersect(scene, origin, target);
+            }
+
+            TraceHit hit{};
+            traverse(ray, hit);
+            assert(hit.successful() == expected.successful());
+            if (expected.successful()) {
+                assert(hit.triRef == expected.triRef);
+                assert(fEqual(hit.t, expected.t));
+            }
+            assert(isOccluded(origin, target) == expectedOccluded);
+        }
+    }
+
+    /* @brief `Scene::build` only forks on machines with several cores. Build the BLAS of the first object on a pool of 3 workers,
+       forking from 16 triangles on, so that the parallel paths of every builder run */
+    void checkParallelBuild()
+    {
+        Settings settings{};
+        settings.parallelBuildThreshold = 16;
+        Scene scene{ "parallel", &settings };
+        UnitTestData::loadRandomScene(scene);
+        const std::vector<uint32_t> triangleRefs(scene.meshObjects[0].triangleIndexes.begin(), scene.meshObjects[0].triangleIndexes.end());
+        ThreadPool pool{ 3 };
+
+        KDTree kdTree{};
+        kdTree.build(std::vector<uint32_t>(triangleRefs), scene.cacheTriangleAABBs, scene.triangles, scene.vertices, settings, pool);
+        assertBLASMatchesBruteForce(scene, triangleRefs,
+            [&](const Ray& ray, TraceHit& out) { kdTree.traverse(scene, ray, out); },
+            [&](const Vec3& start, const Vec3& end) { return kdTree.isOccluded(scene, start, end); });
+
+        for (BVHBuilder builder : { BVHBuilder::SAH, BVHBuilder::LBVH, BVHBuilder::SBVH }) {
+            BVH bvh{};
+            bvh.build(std::vector<uint32_t>(triangleRefs), scene.cacheTriangleAABBs, scene.triangles, scene.vertices, settings,
+                builder, pool);
+            assertBLASMatchesBruteForce(scene, triangleRefs,
+                [&](const Ray& ray, TraceHit& out) { bvh.traverse(scene, ray, out); },
+                [&](const Vec3& start, const Vec3& end) { return bvh.isOccluded(scene, start, end); });
+        }
+
+        // Pool workers record into a shared slot, see `Metrics::sharedThreadIdx`
+        const int before = recordedCount("ParallelBuildTest");
+        pool.parallelFor(4000, 100, [](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                GSceneMetrics.record("ParallelBuildTest");
+            }
+        });
+        assert(recordedCount("ParallelBuildTest") == before + 4000);
+    }
+
+    void run() {
+        checkAccelStruct(AccelStructType::KDTREE, BVHBuilder::SAH);
+        checkAccelStruct(AccelStructType::BVH, BVHBuilder::SAH);
+        checkAccelStruct(AccelStructType::BVH, BVHBuilder::LBVH);
+        checkAccelStruct(AccelStructType::BVH, BVHBuilder::SBVH);
+        checkAccelStruct(AccelStructType::GRID, BVHBuilder::SAH);
+
+        // Wide nodes collapse the tree of every builder
+        for (size_t width : { 4, 8 }) {
+            for (BVHBuilder builder : { BVHBuilder::SAH, BVHBuilder::LBVH, BVHBuilder::SBVH }) {
+                Settings wide{};
+                wide.accelStructure = AccelStructType::BVH;
+                wide.bvhBuilder = builder;
+                wide.bvhWidth = width;
+                checkAccelStruct(wide);
+            }
+        }
+
+        // Quantized child bounds must stay conservative, whatever the tree shape
+        for (BVHBuilder builder : { BVHBuilder::SAH, BVHBuilder::LBVH, BVHBuilder::SBVH }) {
+            Settings quantized{};
+            quantized.accelStructure = AccelStructType::BVH;
+            quantized.bvhBuilder = builder;
+            quantized.quantizeBVHNodes = true;
+            checkAccelStruct(quantized);
+        }
+
+        // Binary nodes in treelet order, and the quantized nodes derived from them
+        for (bool quantize : { false, true }) {
+            Settings reordered{};
+            reordered.accelStructure = AccelStructType::BVH;
+            reordered.reorderNodes = true;
+            reordered.quantizeBVHNodes = quantize;
+            checkAccelStruct(reordered);
+        }
+
+        // Every BVH builder must stop at single triangles when leaves are asked to be empty
+        for (BVHBuilder builder : { BVHBuilder::SAH, BVHBuilder::LBVH, BVHBuilder::SBVH }) {
+            Settings noLeafTriangles{};
+            noLeafTriangles.accelStructure = AccelStructType::BVH;
+            noLeafTriangles.bvhBuilder = builder;
+            noLeafTriangles.bvhWidth = 4;
+            noLeafTriangles.maxTrianglesPerLeaf = 0;
+            checkAccelStruct(noLeafTriangles);
+        }
+
+        // Shadow rays through the occluder trees instead of the kd-trees or BVHs
+        for (AccelStructType type : { AccelStructType::KDTREE, AccelStructType::BVH }) {
+            Settings occluders{};
+            occluders.accelStructure = type;
+            occluders.occluderStructure = true;
+            checkAccelStruct(occluders);
+        }
+
+        checkParallelBuild();
+    }
+}
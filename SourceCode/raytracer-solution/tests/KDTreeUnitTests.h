@@ -1,10 +1,46 @@
 #pragma once
 #include "include/CRTTypes.h"
-#include "include/KDTreeNode.h"
+#include "include/Settings.h"
+#include "include/Scene.h"
+#include "include/TestUtils.h"
+#include "include/UnitTestData.h"
 
 namespace KDTreeUnitTests {
 
+    /* @brief Build `UnitTestData::loadRandomScene` with kd-tree BLASes and compare single rays and packets with brute force */
+    void checkKDTree(const Settings& settings)
+    {
+        Scene scene{ "kdtree", &settings };
+        UnitTestData::loadRandomScene(scene);
+        assertMatchesBruteForce(scene);
+        assertPacketsMatchBruteForce(scene);
+    }
+
     void run() {
+        Settings settings{};
+        settings.accelStructure = AccelStructType::KDTREE;
+        checkKDTree(settings);
+
+        // Stackless traversal along ropes
+        Settings ropes = settings;
+        ropes.kdTreeRopes = true;
+        checkKDTree(ropes);
+
+        // Subtrees below depth 2 are built by the first ray that reaches them
+        Settings lazy = settings;
+        lazy.kdTreeLazyDepth = 2;
+        checkKDTree(lazy);
+
+        // Leaves intersected in SIMD packs, with the mailbox masking shared triangles
+        Settings packed = settings;
+        packed.trianglePackWidth = 4;
+        checkKDTree(packed);
 
+        // Nodes in treelet order. Ropes are built again over the new indices
+        Settings reordered = settings;
+        reordered.reorderNodes = true;
+        checkKDTree(reordered);
+        reordered.kdTreeRopes = true;
+        checkKDTree(reordered);
     }
 }
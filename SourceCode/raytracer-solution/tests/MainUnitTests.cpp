@@ -1,20 +1,27 @@
 #include <iostream>
 
+#include "include/Globals.h"
+
 #include "include/CRTTypesUnitTests.h"
 #include "include/TriangleUnitTests.h"
 #include "include/CameraUnitTests.h"
 #include "include/Benchmarks.h"
 #include "include/SceneUnitTests.h"
 #include "include/KDTreeUnitTests.h"
+#include "include/AccelStructUnitTests.h"
+#include "include/RendererUnitTests.h"
 //#include "include/RendererIntegrationTests.h"
 
 int main()
 {
+    GResetGlobals();
     CRTTypesUnitTests::run();
     TriangleUnitTests::run();
     CameraUnitTests::run();
     SceneUnitTests::run();
     KDTreeUnitTests::run();
+    AccelStructUnitTests::run();
+    RendererUnitTests::run();
     Benchmarks::run();
 
     //RendererIntegrationTests::run();
@@ -0,0 +1,81 @@
+#pragma once
+#include <cassert>
+
+#include "include/Camera.h"
+#include "include/Image.h"
+#include "include/Light.h"
+#include "include/Material.h"
+#include "include/Renderer.h"
+#include "include/RendererOutput.h"
+#include "include/Scene.h"
+#include "include/Settings.h"
+#include "include/UnitTestData.h"
+
+namespace RendererUnitTests {
+
+    /* @brief Render `scene` with the renderer options of `settings` and flatten the result */
+    Image renderImage(const Scene& scene, const Settings& settings)
+    {
+        RendererOutput output{ settings };
+        output.init();
+        Renderer renderer{ &settings, &scene, output };
+        renderer.render();
+        return output.getFlatImage();
+    }
+
+    bool sameImage(const Image& a, const Image& b)
+    {
+        if (a.data.size() != b.data.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < a.data.size(); ++i) {
+            if (a.data[i].r != b.data[i].r || a.data[i].g != b.data[i].g || a.data[i].b != b.data[i].b) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /* @brief Sorted waves trace rays in another order, but must shade every pixel like the unsorted queues.
+       The random scene gets reflective and refractive triangles, so pixels that hit them spawn secondary rays */
+    void checkSortSecondaryRays()
+    {
+        Settings settings{};
+        settings.resolutionX = 64;
+        settings.resolutionY = 48;
+        settings.debugPixel = false;
+        Scene scene{ "sort", &settings };
+        UnitTestData::loadRandomScene(scene);
+
+        // Weights as `CRTSceneIO` loads them
+        Material mirror{ { 0.9f, 0.9f, 0.9f }, false, Material::Type::REFLECTIVE };
+        mirror.reflectivity = 0.8f;
+        mirror.diffuseness = 0.2f;
+        Material glass{ { 1.f, 1.f, 1.f }, false, Material::Type::REFRACTIVE };
+        glass.ior = 1.5f;
+        glass.transparency = 0.9f;
+        glass.reflectivity = 0.1f;
+        scene.materials.push_back(mirror);
+        scene.materials.push_back(glass);
+        for (size_t i = 0; i < scene.triangles.size(); ++i) {
+            scene.triangles[i].materialIndex = i % 3;
+        }
+        scene.lights.push_back(Light::MakePoint({ 2.f, 3.f, 4.f }, 400.f, { 1.f, 1.f, 1.f }));
+        scene.camera = Camera{ 60.f, { 0.5f, 0.5f, 6.f }, Matrix3x3::identity() };
+        scene.camera.lookAt({ 0.25f, 0.5f, 0.5f });
+        scene.build();
+
+        const Image unsorted = renderImage(scene, settings);
+        Settings sorted = settings;
+        sorted.sortSecondaryRays = true;
+        assert(sameImage(renderImage(scene, sorted), unsorted));
+
+        // Secondary rays of a packet tile are sorted within the tile
+        sorted.primaryPacketSize = 8;
+        assert(sameImage(renderImage(scene, sorted), unsorted));
+    }
+
+    void run() {
+        checkSortSecondaryRays();
+    }
+}
@@ -1,9 +1,154 @@
 #pragma once
+#include <filesystem>
+#include <random>
+
 #include "include/Scene.h"
+#include "include/Settings.h"
+#include "include/TestUtils.h"
+#include "include/UnitTestData.h"
 
 namespace SceneUnitTests
 {
+    /* @brief Build the random scene twice with the scene cache on. The second build must load the first one's cache,
+       and a changed setting, a moved vertex or a truncated file must fall back to a normal build */
+    void checkSceneCache(AccelStructType type)
+    {
+        Settings settings{};
+        settings.accelStructure = type;
+        settings.useSceneCache = true;
+        settings.outputDir = (std::filesystem::temp_directory_path() / "raytracer-unit-tests").string();
+        std::filesystem::remove_all(settings.getSceneCacheDir());
+
+        const int hits = recordedCount("SceneCacheHit");
+        {
+            Scene scene{ "cache", &settings };
+            UnitTestData::loadRandomScene(scene);
+            assert(recordedCount("SceneCacheHit") == hits);
+        }
+        {
+            Scene scene{ "cache", &settings };
+            UnitTestData::loadRandomScene(scene);
+            assert(recordedCount("SceneCacheHit") == hits + 1);
+            assertMatchesBruteForce(scene);
+
+            scene.vertices[0] = scene.vertices[0] + Vec3{ 0.1f, 0.f, 0.f };
+            scene.build();
+            assert(recordedCount("SceneCacheHit") == hits + 1);
+            assertMatchesBruteForce(scene);
+        }
+
+        Settings otherLeaves = settings;
+        otherLeaves.maxTrianglesPerLeaf = 2;
+        {
+            Scene scene{ "cache", &otherLeaves };
+            UnitTestData::loadRandomScene(scene);
+            assert(recordedCount("SceneCacheHit") == hits + 1);
+        }
+
+        for (const auto& entry : std::filesystem::directory_iterator(settings.getSceneCacheDir())) {
+            std::filesystem::resize_file(entry.path(), std::filesystem::file_size(entry.path()) / 2);
+        }
+        {
+            Scene scene{ "cache", &settings };
+            UnitTestData::loadRandomScene(scene);
+            assert(recordedCount("SceneCacheHit") == hits + 1);
+            assertMatchesBruteForce(scene);
+        }
+        std::filesystem::remove_all(settings.getSceneCacheDir());
+    }
+
+    /* @brief Move every vertex of mesh 0 by `offset(vertex)` and update the scene. Mesh 3 is its instance */
+    template <typename Offset>
+    void deformFirstMesh(Scene& scene, Offset&& offset)
+    {
+        std::vector<bool> moved(scene.vertices.size(), false);
+        for (size_t triIdx : scene.meshObjects[0].triangleIndexes) {
+            for (size_t vertIdx : scene.triangles[triIdx].v) {
+                if (!moved[vertIdx]) {
+                    moved[vertIdx] = true;
+                    scene.vertices[vertIdx] = scene.vertices[vertIdx] + offset(scene.vertices[vertIdx]);
+                }
+            }
+        }
+        scene.updateGeometry({ 0, 3 });
+    }
+
+    /* @brief Deform a mesh and its instance with `updateGeometry`. A small jitter must refit a BVH, scattering the vertices
+       must rebuild it, and kd-trees and grids are always rebuilt. Packs and occluder trees must follow */
+    void checkUpdateGeometry(AccelStructType type)
+    {
+        Settings settings{};
+        settings.accelStructure = type;
+        settings.trianglePackWidth = 4;
+        settings.occluderStructure = true;
+        Scene scene{ "deform", &settings };
+        UnitTestData::loadRandomScene(scene);
+
+        std::mt19937 rng{ 17 };
+        std::uniform_real_distribution<float> u(-1.f, 1.f);
+        const int refits = recordedCount("BLASRefit");
+        const int rebuilds = recordedCount("BLASRebuild");
+
+        deformFirstMesh(scene, [&](const Vec3&) { return Vec3{ u(rng), u(rng), u(rng) } * 0.01f; });
+        const bool isBVH = type == AccelStructType::BVH;
+        assert(recordedCount("BLASRefit") == refits + (isBVH ? 1 : 0));
+        assert(recordedCount("BLASRebuild") == rebuilds + (isBVH ? 0 : 1));
+        assertMatchesBruteForce(scene);
+
+        deformFirstMesh(scene, [&](const Vec3& vertex) { return Vec3{ u(rng), u(rng), u(rng) } - vertex; });
+        assert(recordedCount("BLASRefit") == refits + (isBVH ? 1 : 0));
+        assert(recordedCount("BLASRebuild") == rebuilds + (isBVH ? 1 : 2));
+        assertMatchesBruteForce(scene);
+    }
+
+    /* @brief Edit a built scene with `buildAdded`, `moveObject` and `removeObject`, and compare with brute force after each edit.
+       Only the changed objects and the top level are built, the result must still match a full build */
+    void checkIncrementalUpdates(AccelStructType type)
+    {
+        Settings settings{};
+        settings.accelStructure = type;
+        Scene scene{ "incremental", &settings };
+        UnitTestData::loadRandomScene(scene);
+
+        // Object 4 and a rotated, scaled instance of it as object 5
+        std::mt19937 rng{ 19 };
+        addRandomObject(scene, rng, 100, { 0.f, -1.5f, 0.f }, 0.5f);
+        scene.addInstance(4, { 1.f, -1.5f, 1.f }, Matrix3x3::Yaw(30.f) * 1.5f);
+        scene.buildAdded();
+        assert(!scene.getIsDirty());
+        assertMatchesBruteForce(scene);
+
+        scene.moveObject(1, { 0.5f, 0.f, -1.f }, Matrix3x3::Pitch(45.f));
+        assertMatchesBruteForce(scene);
+        scene.moveObject(5, { -2.f, 0.f, 0.f }, Matrix3x3::identity());
+        assertMatchesBruteForce(scene);
+
+        bool threw = false;
+        try {
+            scene.removeObject(4);
+        }
+        catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert(threw);
+
+        scene.removeObject(5);
+        scene.removeObject(2);
+        assert(scene.meshObjects.size() == 4);
+        assertMatchesBruteForce(scene);
+    }
+
     void run() {
+        checkSceneCache(AccelStructType::KDTREE);
+        checkSceneCache(AccelStructType::BVH);
+        checkSceneCache(AccelStructType::GRID);
+
+        checkUpdateGeometry(AccelStructType::KDTREE);
+        checkUpdateGeometry(AccelStructType::BVH);
+        checkUpdateGeometry(AccelStructType::GRID);
 
+        checkIncrementalUpdates(AccelStructType::KDTREE);
+        checkIncrementalUpdates(AccelStructType::BVH);
+        checkIncrementalUpdates(AccelStructType::GRID);
     }
 }
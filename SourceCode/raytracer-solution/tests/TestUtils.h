@@ -1,6 +1,17 @@
 #pragma once
+#include <cassert>
+#include <limits>
+#include <random>
+#include <vector>
+
 #include "include/CRTTypes.h"
+#include "include/RayPacket.h"
 #include "include/Triangle.h"
+#include "include/Scene.h"
+#include "include/TraceHit.h"
+#include "include/Globals.h"
+
+#include "json.hpp"
 
 Triangle& addTriangle(Scene& scene, const Vec3& v0, const Vec3& v1, const Vec3& v2)
 {
@@ -13,7 +24,8 @@ Triangle& addTriangle(Scene& scene, const Vec3& v0, const Vec3& v1, const Vec3&
     vs.push_back(v2);
 
     size_t materialIdx = 0;
-    Triangle t{ vs, startIdx, startIdx + 1, startIdx + 2, materialIdx };
+    Triangle t{ startIdx, startIdx + 1, startIdx + 2, materialIdx };
+    t.buildNormal(vs);
     tris.push_back(t);
 
     return tris.back();
@@ -28,3 +40,155 @@ void resetScene(Scene& scene)
     scene.cacheVertexNormals.clear();
     scene.lights.clear();
 }
+
+/* @brief Add an object of `count` random triangles inside the cube of half size `extent` around `center`. Uses material 0 */
+MeshObject& addRandomObject(Scene& scene, std::mt19937& rng, size_t count, const Vec3& center, float extent)
+{
+    std::uniform_real_distribution<float> u(-1.f, 1.f);
+    std::vector<Vec3> vertices{};
+    std::vector<Triangle> triangles{};
+    for (size_t i = 0; i < count; ++i) {
+        const Vec3 v0 = center + Vec3{ u(rng), u(rng), u(rng) } * extent;
+        const size_t startIdx = vertices.size();
+        vertices.push_back(v0);
+        vertices.push_back(v0 + Vec3{ u(rng), u(rng), u(rng) } * (0.3f * extent));
+        vertices.push_back(v0 + Vec3{ u(rng), u(rng), u(rng) } * (0.3f * extent));
+        triangles.emplace_back(startIdx, startIdx + 1, startIdx + 2, 0);
+    }
+    std::vector<Vec3> uvs(vertices.size(), Vec3{ 0.f, 0.f, 0.f });
+    return scene.addObject(vertices, triangles, uvs);
+}
+
+/* @brief Count of `name` recorded in `GSceneMetrics` by all threads */
+int recordedCount(const std::string& name)
+{
+    const ordered_json counters = GSceneMetrics.toJson()["counters"];
+    return counters.contains(name) ? counters[name].get<int>() : 0;
+}
+
+/* @brief Closest hit by testing every triangle of every object, transformed like `TLAS` does. Reference for the acceleration structures */
+void bruteForceIntersect(const Scene& scene, const Ray& ray, TraceHit& out)
+{
+    out.t = std::numeric_limits<float>::max();
+    out.type = TraceHitType::OUT_OF_BOUNDS;
+    for (const MeshObject& meshObject : scene.meshObjects) {
+        // Objects that are not moved are tested with the world ray, a renormalized direction can round differently
+        const bool isIdentity = meshObject.mat.isIdentity() && meshObject.pos.lengthSquared() == 0.f;
+        const Matrix3x3 localFromWorld = meshObject.mat.inverse();
+        Vec3 localDir = localFromWorld * ray.getDirection();
+        const float scale = isIdentity ? 1.f : localDir.length();
+        localDir = localDir / scale;
+        const Ray localRay = isIdentity ? ray : Ray{ localFromWorld * (ray.origin - meshObject.pos), localDir };
+        for (size_t triIdx : meshObject.triangleIndexes) {
+            TraceHit hit{};
+            hit.t = out.t * scale;
+            scene.triangles[triIdx].intersect(scene, localRay, triIdx, hit);
+            if (hit.successful() && hit.t / scale < out.t) {
+                out = hit;
+                out.t = hit.t / scale;
+            }
+        }
+    }
+}
+
+/* @brief Any-hit query by testing every triangle of every object. Reference for `Scene::isOccluded` */
+bool bruteForceOccluded(const Scene& scene, const Vec3& start, const Vec3& end)
+{
+    for (const MeshObject& meshObject : scene.meshObjects) {
+        const Matrix3x3 localFromWorld = meshObject.mat.inverse();
+        const Vec3 localStart = localFromWorld * (start - meshObject.pos);
+        const Vec3 localEnd = localFromWorld * (end - meshObject.pos);
+        for (size_t triIdx : meshObject.triangleIndexes) {
+            const Triangle& tri = scene.triangles[triIdx];
+            if (scene.materials[tri.materialIndex].occludes && tri.fastIntersect(scene, localStart, localEnd)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/* @brief Trace random rays through the built `scene` and compare with the brute force references.
+   Closest hits must be the same triangle at the same distance. Any-hit queries must agree on segments that stop short of
+   the closest hit and on segments that pass it, which the hit triangle itself occludes */
+void assertMatchesBruteForce(const Scene& scene)
+{
+    std::mt19937 rng{ 11 };
+    std::uniform_real_distribution<float> u(-1.f, 1.f);
+    const AABB bounds = scene.getBounds();
+    const Vec3 center = bounds.center();
+    const float radius = (bounds.bounds[1] - bounds.bounds[0]).length();
+    size_t hits = 0;
+    for (int i = 0; i < 10000; ++i) {
+        const Vec3 origin = center + Vec3{ u(rng), u(rng), u(rng) } * radius;
+        const Vec3 target = center + Vec3{ u(rng), u(rng), u(rng) } * (0.25f * radius);
+        Vec3 dir = target - origin;
+        dir.normalize();
+        const Ray ray{ origin, dir };
+
+        TraceHit expected{};
+        bruteForceIntersect(scene, ray, expected);
+        TraceHit hit{};
+        scene.intersect(ray, hit);
+        assert(hit.successful() == expected.successful());
+        if (!expected.successful()) {
+            assert(scene.isOccluded(origin, target) == bruteForceOccluded(scene, origin, target));
+            continue;
+        }
+        ++hits;
+        assert(hit.triRef == expected.triRef);
+        assert(fEqual(hit.t, expected.t));
+
+        const Vec3 beforeHit = origin + dir * (expected.t * 0.99f);
+        assert(scene.isOccluded(origin, beforeHit) == bruteForceOccluded(scene, origin, beforeHit));
+        // Near an edge the segment test may round differently from the ray test
+        const float edgeMargin = 1e-3f;
+        if (expected.baryU > edgeMargin && expected.baryV > edgeMargin && 1.f - expected.baryU - expected.baryV > edgeMargin) {
+            assert(scene.isOccluded(origin, origin + dir * (expected.t * 1.01f)));
+        }
+    }
+    assert(hits > 0);
+}
+
+/* @brief Trace random 8x8 packets through the built `scene` with `Scene::intersectPacket` and compare every ray with brute force.
+   Each packet fans out from one origin like a tile of primary rays. Packets that straddle an axis are incoherent */
+void assertPacketsMatchBruteForce(const Scene& scene)
+{
+    std::mt19937 rng{ 23 };
+    std::uniform_real_distribution<float> u(-1.f, 1.f);
+    const AABB bounds = scene.getBounds();
+    const Vec3 center = bounds.center();
+    const float radius = (bounds.bounds[1] - bounds.bounds[0]).length();
+    const float spacing = 0.01f * radius;
+    size_t hits = 0;
+    for (int i = 0; i < 200; ++i) {
+        const Vec3 origin = center + Vec3{ u(rng), u(rng), u(rng) } * radius;
+        const Vec3 target = center + Vec3{ u(rng), u(rng), u(rng) } * (0.25f * radius);
+        const Vec3 right = Vec3{ u(rng), u(rng), u(rng) } * spacing;
+        const Vec3 up = Vec3{ u(rng), u(rng), u(rng) } * spacing;
+
+        std::vector<Ray> rays{};
+        for (int y = -4; y < 4; ++y) {
+            for (int x = -4; x < 4; ++x) {
+                Vec3 dir = target + right * float(x) + up * float(y) - origin;
+                dir.normalize();
+                rays.push_back({ origin, dir });
+            }
+        }
+        const RayPacket packet{ std::move(rays) };
+        std::vector<TraceHit> packetHits(packet.size());
+        scene.intersectPacket(packet, packetHits.data());
+
+        for (size_t r = 0; r < packet.size(); ++r) {
+            TraceHit expected{};
+            bruteForceIntersect(scene, packet.getRays()[r], expected);
+            assert(packetHits[r].successful() == expected.successful());
+            if (expected.successful()) {
+                ++hits;
+                assert(packetHits[r].triRef == expected.triRef);
+                assert(fEqual(packetHits[r].t, expected.t));
+            }
+        }
+    }
+    assert(hits > 0);
+}
@@ -19,7 +19,7 @@ namespace TriangleUnitTests
         float area;
         auto& vs = scene.vertices;
         Vec3 n;
-        Triangle& t = addTriangle(scene, { -1.75f, -1.75f, -3.f }, { 1.75f, -1.75f, -3.f }, { 0.f, 1.75f, -3.f });
+        Triangle t = addTriangle(scene, { -1.75f, -1.75f, -3.f }, { 1.75f, -1.75f, -3.f }, { 0.f, 1.75f, -3.f });
         n = t.getNormal();
 
         assert(n.equal({ 0.f, 0.f, 1.f }));
@@ -46,7 +46,8 @@ namespace TriangleUnitTests
         scene.materials.push_back(Material{});
         Material& material = scene.materials.back();
         material.type = Material::Type::DIFFUSE;
-        t.intersect(scene, ray, hit);
+        scene.buildTriangleRecords();
+        t.intersect(scene, ray, scene.triangles.size() - 1, hit);
         assert(hit.successful());
 
     }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include<string>
+#include <random>
 
 #include "include/Camera.h"
 #include "include/Scene.h"
@@ -17,7 +18,7 @@ namespace UnitTestData {
 
         camera = Camera{};
         camera.setDir(dir);
-        camera.fov = 90.f;
+        camera.setFov(90.f);
     }
 
     void loadScene1(Scene& scene)
@@ -31,7 +32,7 @@ namespace UnitTestData {
         size_t materialIdx = 0;
 
         scene.triangles = {
-            {scene.vertices, 0, 1, 2, materialIdx}
+            {0, 1, 2, materialIdx}
         };
 
         Camera camera{};
@@ -39,4 +40,17 @@ namespace UnitTestData {
         scene.camera = camera;
     }
 
+    /* @brief Three clusters of random triangles and a moved instance of the first, so every scene has a two-level structure.
+       The same triangles for every call. Builds the scene */
+    void loadRandomScene(Scene& scene)
+    {
+        std::mt19937 rng{ 7 };
+        scene.materials.push_back(Material{});
+        addRandomObject(scene, rng, 200, { 0.f, 0.f, 0.f }, 1.f);
+        addRandomObject(scene, rng, 200, { 1.5f, 0.5f, 0.f }, 1.f);
+        addRandomObject(scene, rng, 50, { -1.f, 1.f, 1.f }, 0.25f);
+        scene.addInstance(0, { 0.f, 0.f, 3.f }, Matrix3x3::identity());
+        scene.build();
+    }
+
 } // namespace UnitTestData